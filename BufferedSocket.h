@@ -0,0 +1,334 @@
+/**
+ * Buffered reads for text protocols. Data is received in large chunks and
+ * lines or fixed-size blocks are returned as views into the buffer. The
+ * delimiter search uses SSE2 or AVX2 when the processor has them.
+ *
+ * EXAMPLE OF USE:
+ *
+ *    #include "BufferedSocket.h"
+ *
+ *    int main()
+ *    {
+ *        ServerSocket server( 50 );
+ *
+ *        if ( server.setup( "3490" ) && server.start( 0 ) )
+ *        {
+ *            BufferedSocket client( server.accept() );
+ *            BufferView line;
+ *
+ *            // A line of a Redis-like protocol, for instance "$5"
+ *            while ( client.readUntil( "\r\n", line ).status == SocketStatus::OK )
+ *            {
+ *                BufferView value;
+ *
+ *                // line.data and line.size are valid until the next read
+ *                client.readExactly( 5 + 2, value );
+ *            }
+ *        }
+ *
+ *        return 0;
+ *    }
+ */
+
+
+
+#ifndef BUFFEREDSOCKET_H
+#define BUFFEREDSOCKET_H
+
+
+
+#include <vector>
+#include "Socket.h"
+
+#if defined( __x86_64__ ) || ( defined( __i386__ ) && defined( __SSE2__ ) )
+#include <immintrin.h>
+#define BUFFEREDSOCKET_X86
+#endif
+
+
+
+/**
+ * Data inside the buffer of a BufferedSocket.
+ */
+struct BufferView
+{
+    BufferView() :
+        data( nullptr ),
+        size( 0 )
+    {
+    }
+
+    const char* data;
+    size_t size;
+};
+
+
+
+/**
+ * This class reads delimited or fixed-size data from a stream socket.
+ */
+class BufferedSocket
+{
+    public:
+
+    /**
+     * The socket is owned by the BufferedSocket. bufferSize is the size of
+     * each receive call, the buffer grows up to maxBufferSize to hold a
+     * longer line or block.
+     */
+    BufferedSocket( Socket&& socket, size_t bufferSize = 65536, size_t maxBufferSize = 1048576 ) :
+        mSocket( std::move( socket ) ),
+        mBuffer( bufferSize > 0 ? bufferSize : 1 ),
+        mMaxBufferSize( std::max( maxBufferSize, mBuffer.size() ) ),
+        mStart( 0 ),
+        mEnd( 0 ),
+        mScanned( 0 )
+    {
+    }
+
+    Socket& getSocket()
+    {
+        return mSocket;
+    }
+
+    /**
+     * Bytes received but not read yet.
+     */
+    size_t getBufferedSize() const
+    {
+        return mEnd - mStart;
+    }
+
+    SocketResult readUntil( const std::string& delimiter, BufferView& line )
+    {
+        return readUntil( delimiter.data(), delimiter.size(), line );
+    }
+
+    /**
+     * Read up to the next delimiter. The view holds the data before the
+     * delimiter, which is consumed too. It is valid until the next read.
+     *
+     * In non-blocking mode the status is WOULD_BLOCK until the delimiter
+     * arrived. It is FAILURE with ENOBUFS when maxBufferSize bytes came
+     * without a delimiter.
+     */
+    SocketResult readUntil( const char* delimiter, size_t delimiterSize, BufferView& line )
+    {
+        if ( delimiterSize == 0 )
+        {
+            return SocketResult( 0, SocketStatus::FAILURE, EINVAL );
+        }
+
+        for ( ;; )
+        {
+            size_t available = mEnd - mStart;
+
+            if ( available >= delimiterSize )
+            {
+                // Bytes searched by a previous call are skipped
+                const char* data = mBuffer.data() + mStart;
+                size_t found = mScanned + findDelimiter( data + mScanned, available - mScanned, delimiter, delimiterSize );
+
+                if ( found < available )
+                {
+                    line.data = data;
+                    line.size = found;
+                    mStart += found + delimiterSize;
+                    mScanned = 0;
+
+                    return SocketResult( found );
+                }
+
+                mScanned = available - delimiterSize + 1;
+            }
+
+            if ( available >= mMaxBufferSize )
+            {
+                return SocketResult( 0, SocketStatus::FAILURE, ENOBUFS );
+            }
+
+            SocketResult result = fill( available + 1 );
+
+            if ( result.status != SocketStatus::OK )
+            {
+                return result;
+            }
+        }
+    }
+
+    /**
+     * Read exactly size bytes, valid until the next read. The status is
+     * FAILURE with ENOBUFS when size is larger than maxBufferSize.
+     */
+    SocketResult readExactly( size_t size, BufferView& block )
+    {
+        if ( size > mMaxBufferSize )
+        {
+            return SocketResult( 0, SocketStatus::FAILURE, ENOBUFS );
+        }
+
+        while ( mEnd - mStart < size )
+        {
+            SocketResult result = fill( size );
+
+            if ( result.status != SocketStatus::OK )
+            {
+                return result;
+            }
+        }
+
+        block.data = mBuffer.data() + mStart;
+        block.size = size;
+        mStart += size;
+        mScanned = 0;
+
+        return SocketResult( size );
+    }
+
+    /**
+     * Position of the first delimiter in data, or size when there is none.
+     */
+    static size_t findDelimiter( const char* data, size_t size, const char* delimiter, size_t delimiterSize )
+    {
+        if ( delimiterSize == 0 || size < delimiterSize )
+        {
+            return size;
+        }
+
+        // Only positions where the whole delimiter fits can start it
+        const char* end = data + size - delimiterSize + 1;
+        const char* position = data;
+
+        while ( ( position = findByte( position, end, delimiter[0] ) ) != end )
+        {
+            if ( memcmp( position + 1, delimiter + 1, delimiterSize - 1 ) == 0 )
+            {
+                return position - data;
+            }
+
+            position++;
+        }
+
+        return size;
+    }
+
+    /**
+     * First occurrence of value in [begin, end), or end when there is none.
+     */
+    static const char* findByte( const char* begin, const char* end, char value )
+    {
+#ifdef BUFFEREDSOCKET_X86
+        static const bool hasAvx2 = __builtin_cpu_supports( "avx2" );
+
+        if ( hasAvx2 )
+        {
+            return findByteAvx2( begin, end, value );
+        }
+
+        return findByteSse2( begin, end, value );
+#else
+        return findByteScalar( begin, end, value );
+#endif
+    }
+
+    static const char* findByteScalar( const char* begin, const char* end, char value )
+    {
+        while ( begin < end && *begin != value )
+        {
+            begin++;
+        }
+
+        return begin;
+    }
+
+#ifdef BUFFEREDSOCKET_X86
+    __attribute__(( target( "sse2" ) ))
+    static const char* findByteSse2( const char* begin, const char* end, char value )
+    {
+        const __m128i pattern = _mm_set1_epi8( value );
+
+        for ( ; end - begin >= 16; begin += 16 )
+        {
+            __m128i block = _mm_loadu_si128( reinterpret_cast< const __m128i* >( begin ) );
+            int mask = _mm_movemask_epi8( _mm_cmpeq_epi8( block, pattern ) );
+
+            if ( mask != 0 )
+            {
+                return begin + __builtin_ctz( mask );
+            }
+        }
+
+        return findByteScalar( begin, end, value );
+    }
+
+    __attribute__(( target( "avx2" ) ))
+    static const char* findByteAvx2( const char* begin, const char* end, char value )
+    {
+        const __m256i pattern = _mm256_set1_epi8( value );
+
+        for ( ; end - begin >= 32; begin += 32 )
+        {
+            __m256i block = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( begin ) );
+            unsigned int mask = static_cast< unsigned int >( _mm256_movemask_epi8( _mm256_cmpeq_epi8( block, pattern ) ) );
+
+            if ( mask != 0 )
+            {
+                return begin + __builtin_ctz( mask );
+            }
+        }
+
+        return findByteSse2( begin, end, value );
+    }
+#endif
+
+    private:
+
+    /**
+     * Receive more data, with room for at least needed bytes from the start
+     * of the unread data.
+     */
+    SocketResult fill( size_t needed )
+    {
+        if ( mStart == mEnd )
+        {
+            mStart = 0;
+            mEnd = 0;
+        }
+        else if ( mBuffer.size() - mStart < needed || mBuffer.size() - mEnd < mBuffer.size() / 2 )
+        {
+            // The views handed out before are not valid anymore anyway
+            memmove( mBuffer.data(), mBuffer.data() + mStart, mEnd - mStart );
+            mEnd -= mStart;
+            mStart = 0;
+        }
+
+        if ( mBuffer.size() - mStart < needed )
+        {
+            mBuffer.resize( mStart + std::max( needed, std::min( 2 * mBuffer.size(), mMaxBufferSize ) ) );
+        }
+
+        SocketResult result = mSocket.tryReceive( mBuffer.data() + mEnd, mBuffer.size() - mEnd );
+
+        if ( result.status == SocketStatus::OK )
+        {
+            mEnd += static_cast< size_t >( result.size );
+        }
+
+        return result;
+    }
+
+    Socket mSocket;
+
+    // Received data between mStart and mEnd
+    std::vector< char > mBuffer;
+    size_t mMaxBufferSize;
+    size_t mStart;
+    size_t mEnd;
+
+    // Bytes after mStart already searched for the delimiter
+    size_t mScanned;
+};
+
+
+
+#endif // BUFFEREDSOCKET_H
@@ -0,0 +1,412 @@
+/**
+ * A pool of client connections keyed by host and port. Connections are
+ * established once and then handed out again, which saves the name
+ * resolution and the TCP handshake of every request. Names are resolved
+ * again after a time to live, so new connections follow DNS changes.
+ *
+ * EXAMPLE OF USE:
+ *
+ *    #include "ConnectionPool.h"
+ *
+ *    int main()
+ *    {
+ *        // At most 8 idle and 32 open connections per host, idle ones are
+ *        // closed after 30 seconds
+ *        ConnectionPool pool( 8, 32, 30000 );
+ *
+ *        // This block might be in many threads at once
+ *        SocketResult result;
+ *        Socket socket = pool.checkout( "192.168.0.1", "3490", result );
+ *
+ *        if ( socket.isValid() )
+ *        {
+ *            bool reusable = socket.send( request, requestSize ) != -1 && ...;
+ *
+ *            // Give the connection back, broken ones are closed
+ *            pool.checkin( "192.168.0.1", "3490", std::move( socket ), reusable );
+ *        }
+ *
+ *        return 0;
+ *    }
+ */
+
+
+
+#ifndef CONNECTIONPOOL_H
+#define CONNECTIONPOOL_H
+
+
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Resolver.h"
+
+
+
+/**
+ * This class keeps warm client connections. It is thread-safe.
+ */
+class ConnectionPool
+{
+    public:
+
+    /**
+     * maxIdle and maxTotal are per host and port. maxTotal counts idle and
+     * checked out connections. Idle connections are closed after idleTimeout
+     * milliseconds, 0 keeps them forever. A new connection that is not
+     * established within connectTimeout milliseconds is abandoned (-1 waits
+     * as long as the kernel does). Names are resolved again when resolveTtl
+     * milliseconds have passed, through resolver when one is given (it must
+     * outlive the pool), which then also caches them.
+     */
+    ConnectionPool( size_t maxIdle = 8, size_t maxTotal = 64, int idleTimeout = 60000, int connectTimeout = 5000,
+                    int resolveTtl = 30000, Resolver* resolver = nullptr ) :
+        mMaxIdle( maxIdle ),
+        mMaxTotal( maxTotal ),
+        mIdleTimeout( idleTimeout ),
+        mConnectTimeout( connectTimeout ),
+        mResolveTtl( resolveTtl ),
+        mResolver( resolver ),
+        mHitCount( 0 ),
+        mMissCount( 0 )
+    {
+    }
+
+    ConnectionPool( const ConnectionPool& ) = delete;
+    ConnectionPool& operator=( const ConnectionPool& ) = delete;
+
+    Socket checkout( const std::string& host, const std::string& port )
+    {
+        SocketResult result;
+
+        return checkout( host, port, result );
+    }
+
+    /**
+     * Hand out an idle connection that is still alive, or connect a new one.
+     * When maxTotal connections are already open, the returned socket is
+     * invalid and result.status is WOULD_BLOCK. It is TIMEOUT when no address
+     * answered within connectTimeout.
+     */
+    Socket checkout( const std::string& host, const std::string& port, SocketResult& result )
+    {
+        std::string key = makeKey( host, port );
+        std::shared_ptr< Endpoint > endpoint;
+        std::vector< Socket > expired;
+
+        {
+            std::lock_guard< std::mutex > lock( mMutex );
+            std::shared_ptr< Endpoint >& entry = mEndpoints[key];
+
+            if ( !entry )
+            {
+                entry = std::make_shared< Endpoint >();
+            }
+
+            endpoint = entry;
+            evictExpired( *endpoint, std::chrono::steady_clock::now(), expired );
+        }
+
+        expired.clear();
+
+        Socket socket;
+
+        while ( takeIdle( *endpoint, socket ) )
+        {
+            if ( isAlive( socket ) )
+            {
+                mHitCount.fetch_add( 1, std::memory_order_relaxed );
+                result = SocketResult();
+                return socket;
+            }
+
+            socket.close();
+            release( *endpoint );
+        }
+
+        mMissCount.fetch_add( 1, std::memory_order_relaxed );
+
+        std::shared_ptr< ClientSocket > client;
+
+        {
+            std::lock_guard< std::mutex > lock( mMutex );
+
+            if ( endpoint->total >= mMaxTotal )
+            {
+                result = SocketResult( 0, SocketStatus::WOULD_BLOCK, EAGAIN );
+                return Socket();
+            }
+
+            // Reserve the slot while connecting outside the lock
+            endpoint->total++;
+
+            if ( std::chrono::steady_clock::now() < endpoint->resolveExpiration )
+            {
+                client = endpoint->client;
+            }
+        }
+
+        if ( !client )
+        {
+            client = resolve( *endpoint, host, port );
+
+            if ( client == nullptr )
+            {
+                release( *endpoint );
+                result = SocketResult( 0, SocketStatus::FAILURE, EHOSTUNREACH );
+                return Socket();
+            }
+        }
+
+        result = SocketResult( 0, SocketStatus::FAILURE, EHOSTUNREACH );
+
+        for ( size_t i = 0; i < client->getSocketAddressCount() && !socket.isValid(); ++i )
+        {
+            socket = mConnectTimeout >= 0 ? client->connect( i, mConnectTimeout, result ) : client->connect( i, result );
+        }
+
+        if ( !socket.isValid() )
+        {
+            release( *endpoint );
+        }
+
+        return socket;
+    }
+
+    /**
+     * Give back a connection obtained from checkout(). It is closed when it
+     * is not reusable (for instance after a protocol error), invalid, or
+     * when maxIdle connections are already waiting.
+     */
+    void checkin( const std::string& host, const std::string& port, Socket socket, bool reusable = true )
+    {
+        {
+            std::lock_guard< std::mutex > lock( mMutex );
+            std::shared_ptr< Endpoint >& endpoint = mEndpoints[makeKey( host, port )];
+
+            if ( !endpoint )
+            {
+                endpoint = std::make_shared< Endpoint >();
+            }
+
+            if ( reusable && socket.isValid() && endpoint->idle.size() < mMaxIdle )
+            {
+                endpoint->idle.push_back( IdleConnection( std::move( socket ), std::chrono::steady_clock::now() ) );
+                return;
+            }
+
+            if ( endpoint->total > 0 )
+            {
+                endpoint->total--;
+            }
+        }
+
+        // Closing might flush coalesced writes, so it is not done in the lock
+        socket.close();
+    }
+
+    /**
+     * Close the connections idle for longer than idleTimeout and forget the
+     * hosts left without connections. Returns the number of connections
+     * closed. Expired connections are also closed on checkout, so calling it
+     * is only needed to release idle hosts.
+     */
+    size_t evictIdle()
+    {
+        std::vector< Socket > expired;
+
+        {
+            std::lock_guard< std::mutex > lock( mMutex );
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+            for ( auto iterator = mEndpoints.begin(); iterator != mEndpoints.end(); )
+            {
+                evictExpired( *iterator->second, now, expired );
+
+                // Only copies made in the lock keep an endpoint alive, so
+                // nobody can start using an unused one while it is erased
+                if ( iterator->second->total == 0 && iterator->second.use_count() == 1 )
+                {
+                    iterator = mEndpoints.erase( iterator );
+                }
+                else
+                {
+                    ++iterator;
+                }
+            }
+        }
+
+        return expired.size();
+    }
+
+    size_t getIdleCount()
+    {
+        std::lock_guard< std::mutex > lock( mMutex );
+        size_t count = 0;
+
+        for ( auto& entry : mEndpoints )
+        {
+            count += entry.second->idle.size();
+        }
+
+        return count;
+    }
+
+    /**
+     * Number of checkouts served by an idle connection.
+     */
+    uint64_t getHitCount() const
+    {
+        return mHitCount.load( std::memory_order_relaxed );
+    }
+
+    /**
+     * Number of checkouts that had to connect.
+     */
+    uint64_t getMissCount() const
+    {
+        return mMissCount.load( std::memory_order_relaxed );
+    }
+
+    private:
+
+    struct IdleConnection
+    {
+        IdleConnection( Socket&& idleSocket, std::chrono::steady_clock::time_point idleSince ) :
+            socket( std::move( idleSocket ) ),
+            since( idleSince )
+        {
+        }
+
+        Socket socket;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    struct Endpoint
+    {
+        Endpoint() :
+            total( 0 )
+        {
+        }
+
+        // Replaced when resolveExpiration has passed, checkouts in progress
+        // keep using their copy
+        std::shared_ptr< ClientSocket > client;
+        std::chrono::steady_clock::time_point resolveExpiration;
+
+        // The most recently used connection is at the back
+        std::deque< IdleConnection > idle;
+
+        // Idle and checked out connections
+        size_t total;
+    };
+
+    static std::string makeKey( const std::string& host, const std::string& port )
+    {
+        return host + ":" + port;
+    }
+
+    /**
+     * A healthy idle connection has nothing to read. End of stream means the
+     * peer closed it, and unexpected data would desynchronize the protocol.
+     */
+    static bool isAlive( const Socket& socket )
+    {
+        char byte;
+        ssize_t size = ::recv( socket.getSocketDescriptor(), &byte, 1, MSG_PEEK | MSG_DONTWAIT );
+
+        return size == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK );
+    }
+
+    bool takeIdle( Endpoint& endpoint, Socket& socket )
+    {
+        std::lock_guard< std::mutex > lock( mMutex );
+
+        if ( endpoint.idle.empty() )
+        {
+            return false;
+        }
+
+        socket = std::move( endpoint.idle.back().socket );
+        endpoint.idle.pop_back();
+
+        return true;
+    }
+
+    void release( Endpoint& endpoint )
+    {
+        std::lock_guard< std::mutex > lock( mMutex );
+
+        if ( endpoint.total > 0 )
+        {
+            endpoint.total--;
+        }
+    }
+
+    // Name resolution runs outside the lock, the latest result is kept
+    std::shared_ptr< ClientSocket > resolve( Endpoint& endpoint, const std::string& host, const std::string& port )
+    {
+        std::shared_ptr< ClientSocket > client = std::make_shared< ClientSocket >();
+
+        if ( mResolver != nullptr ? !client->setup( *mResolver, host, port ) : !client->setup( host, port ) )
+        {
+            return nullptr;
+        }
+
+        std::lock_guard< std::mutex > lock( mMutex );
+
+        endpoint.client = client;
+        endpoint.resolveExpiration = std::chrono::steady_clock::now() + std::chrono::milliseconds( mResolveTtl );
+
+        return client;
+    }
+
+    /**
+     * The idle list is ordered by age, so expired connections are at the
+     * front. They are moved to expired, to be closed outside the lock.
+     */
+    void evictExpired( Endpoint& endpoint, std::chrono::steady_clock::time_point now, std::vector< Socket >& expired )
+    {
+        if ( mIdleTimeout <= 0 )
+        {
+            return;
+        }
+
+        std::chrono::milliseconds timeout( mIdleTimeout );
+
+        while ( !endpoint.idle.empty() && now - endpoint.idle.front().since >= timeout )
+        {
+            expired.push_back( std::move( endpoint.idle.front().socket ) );
+            endpoint.idle.pop_front();
+
+            if ( endpoint.total > 0 )
+            {
+                endpoint.total--;
+            }
+        }
+    }
+
+    size_t mMaxIdle;
+    size_t mMaxTotal;
+    int mIdleTimeout;
+    int mConnectTimeout;
+    int mResolveTtl;
+    Resolver* mResolver;
+
+    std::atomic< uint64_t > mHitCount;
+    std::atomic< uint64_t > mMissCount;
+
+    // Endpoints without connections are removed by evictIdle()
+    std::mutex mMutex;
+    std::unordered_map< std::string, std::shared_ptr< Endpoint > > mEndpoints;
+};
+
+
+
+#endif // CONNECTIONPOOL_H
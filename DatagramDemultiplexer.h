@@ -0,0 +1,586 @@
+/**
+ * Per-peer sessions for datagram servers (QUIC-like protocols, game servers).
+ * Each worker thread has its own socket bound to the port with SO_REUSEPORT,
+ * so the kernel spreads the peers across the workers and keeps every peer on
+ * the same one. Datagrams are received in batches, their session is looked
+ * up in a striped hash table keyed by the peer address, and sessions idle for
+ * too long are expired by a timing wheel.
+ *
+ * EXAMPLE OF USE:
+ *
+ *    #include "DatagramDemultiplexer.h"
+ *
+ *    struct Player
+ *    {
+ *        uint64_t score = 0;
+ *    };
+ *
+ *    int main()
+ *    {
+ *        ServerSocket server;
+ *
+ *        // 4 workers, sessions expire after 10 seconds without datagrams
+ *        DatagramDemultiplexer demultiplexer( 4, 10000 );
+ *
+ *        if ( server.setup( "3490", SocketType::DATAGRAM ) )
+ *        {
+ *            // Called on a worker thread, never concurrently for a session
+ *            demultiplexer.start( server, 0, []( DatagramSession& session, const char* data, size_t size )
+ *            {
+ *                if ( !session.state )
+ *                {
+ *                    session.state = std::make_shared< Player >();
+ *                }
+ *
+ *                std::static_pointer_cast< Player >( session.state )->score += size;
+ *                session.send( data, size );
+ *            },
+ *            []( DatagramSession& session )
+ *            {
+ *                // The peer went quiet, session.state is released after this
+ *            } );
+ *
+ *            // ...
+ *
+ *            demultiplexer.stop();
+ *        }
+ *
+ *        return 0;
+ *    }
+ */
+
+
+
+#ifndef DATAGRAMDEMULTIPLEXER_H
+#define DATAGRAMDEMULTIPLEXER_H
+
+
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <sys/eventfd.h>
+#include "Socket.h"
+
+
+
+// Stripes of the session table, each with its own lock
+#ifndef DEMULTIPLEXER_STRIPES
+#define DEMULTIPLEXER_STRIPES 64
+#endif
+
+// Slots of the timing wheel of each worker
+#ifndef DEMULTIPLEXER_WHEEL_SLOTS
+#define DEMULTIPLEXER_WHEEL_SLOTS 256
+#endif
+
+
+
+class DatagramDemultiplexer;
+
+/**
+ * The state of one peer.
+ */
+class DatagramSession
+{
+    public:
+
+    DatagramSession( const SocketAddress& peer, Socket& socket ) :
+        mPeer( peer ),
+        mDestination( peer ),
+        mSocket( &socket ),
+        mLastActive( 0 ),
+        mExpired( false )
+    {
+    }
+
+    DatagramSession( const DatagramSession& ) = delete;
+    DatagramSession& operator=( const DatagramSession& ) = delete;
+
+    const SocketAddress& getPeer() const
+    {
+        return mPeer;
+    }
+
+    /**
+     * Send a datagram to the peer, from the port it sent to. Returns the
+     * number of bytes sent or -1 in case of error. A session that expired
+     * (after onExpired returned) or was kept after
+     * DatagramDemultiplexer::stop() has no socket anymore and fails with
+     * EBADF, but send() must not run concurrently with stop().
+     */
+    ssize_t send( const void* data, size_t size )
+    {
+        Socket* socket = mSocket.load( std::memory_order_acquire );
+
+        if ( socket == nullptr )
+        {
+            errno = EBADF;
+            return -1;
+        }
+
+        return socket->sendTo( mDestination, data, size );
+    }
+
+    // Anything the application keeps for the peer, released on expiration
+    std::shared_ptr< void > state;
+
+    private:
+
+    friend class DatagramDemultiplexer;
+
+    SocketAddress mPeer;
+    Destination mDestination;
+
+    // The socket of the worker, cleared on expiration and by stop()
+    std::atomic< Socket* > mSocket;
+
+    // Milliseconds of the last datagram, updated without the lock
+    std::atomic< int64_t > mLastActive;
+
+    // Held while a callback runs, so each session sees one thread at a time
+    std::mutex mMutex;
+    bool mExpired;
+};
+
+
+
+/**
+ * This class dispatches the datagrams of a port to per-peer sessions on
+ * worker threads.
+ */
+class DatagramDemultiplexer
+{
+    public:
+
+    typedef std::function< void( DatagramSession& session, const char* data, size_t size ) > DatagramCallback;
+    typedef std::function< void( DatagramSession& session ) > SessionCallback;
+
+    /**
+     * Sessions expire idleTimeout milliseconds after their last datagram.
+     * Datagrams longer than maxDatagramSize are truncated.
+     */
+    DatagramDemultiplexer( size_t workerCount = 4, int idleTimeout = 30000, size_t maxDatagramSize = 65536 ) :
+        mWorkerCount( workerCount > 0 ? workerCount : 1 ),
+        mIdleTimeout( idleTimeout > 0 ? idleTimeout : 1 ),
+        mTickTime( std::max( 1, mIdleTimeout / ( DEMULTIPLEXER_WHEEL_SLOTS / 2 ) ) ),
+        mMaxDatagramSize( maxDatagramSize > 0 ? maxDatagramSize : 1 ),
+        mWakeDescriptor( -1 ),
+        mStopping( false ),
+        mSessionCount( 0 ),
+        mDatagramCount( 0 ),
+        mCreatedCount( 0 ),
+        mExpiredCount( 0 )
+    {
+    }
+
+    DatagramDemultiplexer( const DatagramDemultiplexer& ) = delete;
+    DatagramDemultiplexer& operator=( const DatagramDemultiplexer& ) = delete;
+
+    ~DatagramDemultiplexer()
+    {
+        stop();
+    }
+
+    /**
+     * Bind one socket per worker to a datagram address of server and start
+     * the workers. onDatagram is called for every datagram and onExpired (if
+     * any) when a session expires. Returns false in case of error.
+     */
+    bool start( ServerSocket& server, size_t socketAddressIndex, const DatagramCallback& onDatagram,
+                const SessionCallback& onExpired = SessionCallback() )
+    {
+        if ( !mWorkers.empty() )
+        {
+            SocketLog::report( "DatagramDemultiplexer", "start", EISCONN );
+            return false;
+        }
+
+        mOnDatagram = onDatagram;
+        mOnExpired = onExpired;
+        mStopping.store( false, std::memory_order_relaxed );
+
+        mWakeDescriptor = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+
+        if ( mWakeDescriptor == -1 )
+        {
+            SocketLog::report( "DatagramDemultiplexer", "eventfd", errno );
+            return false;
+        }
+
+        for ( size_t i = 0; i < mWorkerCount; ++i )
+        {
+            std::unique_ptr< Worker > worker( new Worker( mMaxDatagramSize ) );
+
+            worker->socket = server.startConnectionless( socketAddressIndex, true );
+
+            if ( !worker->socket.isValid() || !worker->socket.setNonBlocking( true ) )
+            {
+                mWorkers.clear();
+                ::close( mWakeDescriptor );
+                mWakeDescriptor = -1;
+                return false;
+            }
+
+            mWorkers.push_back( std::move( worker ) );
+        }
+
+        for ( size_t i = 0; i < mWorkers.size(); ++i )
+        {
+            mWorkers[i]->thread = std::thread( &DatagramDemultiplexer::work, this, std::ref( *mWorkers[i] ) );
+        }
+
+        return true;
+    }
+
+    /**
+     * Stop the workers and close their sockets. The remaining sessions are
+     * dropped without calling onExpired, and the ones still held through
+     * find() can no longer send.
+     */
+    void stop()
+    {
+        if ( mWorkers.empty() )
+        {
+            return;
+        }
+
+        mStopping.store( true, std::memory_order_relaxed );
+        eventfd_write( mWakeDescriptor, 1 );
+
+        for ( size_t i = 0; i < mWorkers.size(); ++i )
+        {
+            mWorkers[i]->thread.join();
+        }
+
+        // Sessions the application still holds must not reach the sockets
+        for ( size_t i = 0; i < DEMULTIPLEXER_STRIPES; ++i )
+        {
+            std::lock_guard< std::mutex > lock( mStripes[i].mutex );
+
+            for ( auto& entry : mStripes[i].sessions )
+            {
+                entry.second->mSocket.store( nullptr, std::memory_order_release );
+            }
+
+            mStripes[i].sessions.clear();
+        }
+
+        for ( size_t i = 0; i < mWorkers.size(); ++i )
+        {
+            for ( size_t slot = 0; slot < mWorkers[i]->wheel.size(); ++slot )
+            {
+                for ( size_t j = 0; j < mWorkers[i]->wheel[slot].size(); ++j )
+                {
+                    mWorkers[i]->wheel[slot][j]->mSocket.store( nullptr, std::memory_order_release );
+                }
+            }
+        }
+
+        mWorkers.clear();
+        mSessionCount.store( 0, std::memory_order_relaxed );
+
+        ::close( mWakeDescriptor );
+        mWakeDescriptor = -1;
+    }
+
+    /**
+     * The session of peer, or nullptr when there is none. Callbacks can use
+     * it to reach other sessions, locking them is up to the application.
+     */
+    std::shared_ptr< DatagramSession > find( const SocketAddress& peer )
+    {
+        Stripe& stripe = getStripe( peer );
+        std::lock_guard< std::mutex > lock( stripe.mutex );
+        auto iterator = stripe.sessions.find( peer );
+
+        return iterator != stripe.sessions.end() ? iterator->second : nullptr;
+    }
+
+    size_t getSessionCount() const
+    {
+        return mSessionCount.load( std::memory_order_relaxed );
+    }
+
+    uint64_t getDatagramCount() const
+    {
+        return mDatagramCount.load( std::memory_order_relaxed );
+    }
+
+    uint64_t getCreatedCount() const
+    {
+        return mCreatedCount.load( std::memory_order_relaxed );
+    }
+
+    uint64_t getExpiredCount() const
+    {
+        return mExpiredCount.load( std::memory_order_relaxed );
+    }
+
+    private:
+
+    typedef std::shared_ptr< DatagramSession > SessionPointer;
+
+    // Padded so the locks of different stripes do not share a cache line
+    struct alignas( 64 ) Stripe
+    {
+        std::mutex mutex;
+        std::unordered_map< SocketAddress, SessionPointer > sessions;
+    };
+
+    struct Worker
+    {
+        explicit Worker( size_t maxDatagramSize ) :
+            buffer( new char[SOCKET_BATCH_SIZE * maxDatagramSize] ),
+            wheel( DEMULTIPLEXER_WHEEL_SLOTS ),
+            wheelTick( 0 )
+        {
+        }
+
+        Socket socket;
+        std::thread thread;
+
+        // Room for a batch of datagrams, left uninitialized so the pages a
+        // small datagram does not reach are never touched
+        std::unique_ptr< char[] > buffer;
+
+        // Sessions created by this worker by the tick of their deadline,
+        // wheelTick is the next tick to check
+        std::vector< std::vector< SessionPointer > > wheel;
+        int64_t wheelTick;
+    };
+
+    static int64_t getTime()
+    {
+        return std::chrono::duration_cast< std::chrono::milliseconds >( std::chrono::steady_clock::now().time_since_epoch() ).count();
+    }
+
+    Stripe& getStripe( const SocketAddress& peer )
+    {
+        // The low bits pick the bucket inside the stripe, use the high ones
+        return mStripes[( peer.hash() >> 32 ) % DEMULTIPLEXER_STRIPES];
+    }
+
+    void work( Worker& worker )
+    {
+        SocketAddress senders[SOCKET_BATCH_SIZE];
+        struct iovec buffers[SOCKET_BATCH_SIZE];
+        ssize_t sizes[SOCKET_BATCH_SIZE];
+
+        struct pollfd descriptors[2];
+        descriptors[0].fd = worker.socket.getSocketDescriptor();
+        descriptors[0].events = POLLIN;
+        descriptors[1].fd = mWakeDescriptor;
+        descriptors[1].events = POLLIN;
+
+        worker.wheelTick = getTime() / mTickTime;
+
+        while ( !mStopping.load( std::memory_order_relaxed ) )
+        {
+            int64_t now = getTime();
+            int waitTime = static_cast< int >( std::max< int64_t >( 0, worker.wheelTick * mTickTime - now ) + 1 );
+
+            descriptors[0].revents = 0;
+            descriptors[1].revents = 0;
+
+            if ( ::poll( descriptors, 2, waitTime ) > 0 && ( descriptors[0].revents & POLLIN ) != 0 )
+            {
+                // A bounded number of batches, so the wheel keeps turning
+                for ( int batch = 0; batch < 16; ++batch )
+                {
+                    for ( int i = 0; i < SOCKET_BATCH_SIZE; ++i )
+                    {
+                        buffers[i].iov_base = worker.buffer.get() + i * mMaxDatagramSize;
+                        buffers[i].iov_len = mMaxDatagramSize;
+                    }
+
+                    int count = worker.socket.receiveFromBatch( senders, buffers, sizes, SOCKET_BATCH_SIZE );
+
+                    if ( count <= 0 )
+                    {
+                        break;
+                    }
+
+                    dispatch( worker, senders, buffers, sizes, count );
+
+                    if ( count < SOCKET_BATCH_SIZE )
+                    {
+                        break;
+                    }
+                }
+            }
+
+            expire( worker, getTime() );
+        }
+    }
+
+    void dispatch( Worker& worker, const SocketAddress* senders, const struct iovec* buffers, const ssize_t* sizes, int count )
+    {
+        int64_t now = getTime();
+        SessionPointer session;
+
+        mDatagramCount.fetch_add( count, std::memory_order_relaxed );
+
+        for ( int i = 0; i < count; ++i )
+        {
+            // Consecutive datagrams of a peer share the lookup
+            if ( !session || senders[i] != senders[i - 1] )
+            {
+                session = getSession( worker, senders[i], now );
+            }
+
+            for ( ;; )
+            {
+                {
+                    std::lock_guard< std::mutex > lock( session->mMutex );
+
+                    if ( !session->mExpired )
+                    {
+                        session->mLastActive.store( now, std::memory_order_relaxed );
+                        mOnDatagram( *session, static_cast< const char* >( buffers[i].iov_base ), static_cast< size_t >( sizes[i] ) );
+                        break;
+                    }
+                }
+
+                // Expired by another worker between the lookup and the lock
+                session = getSession( worker, senders[i], now );
+            }
+        }
+    }
+
+    // Find the session of peer, or create it and put it in the wheel
+    SessionPointer getSession( Worker& worker, const SocketAddress& peer, int64_t now )
+    {
+        Stripe& stripe = getStripe( peer );
+        SessionPointer session;
+
+        {
+            std::lock_guard< std::mutex > lock( stripe.mutex );
+            SessionPointer& entry = stripe.sessions[peer];
+
+            if ( entry )
+            {
+                return entry;
+            }
+
+            entry = std::make_shared< DatagramSession >( peer, worker.socket );
+            entry->mLastActive.store( now, std::memory_order_relaxed );
+            session = entry;
+        }
+
+        mSessionCount.fetch_add( 1, std::memory_order_relaxed );
+        mCreatedCount.fetch_add( 1, std::memory_order_relaxed );
+
+        schedule( worker, session, now + mIdleTimeout, worker.wheelTick );
+
+        return session;
+    }
+
+    // Put session in the slot of the first tick after deadline, but not
+    // before firstTick
+    void schedule( Worker& worker, const SessionPointer& session, int64_t deadline, int64_t firstTick )
+    {
+        int64_t tick = std::max( deadline / mTickTime + 1, firstTick );
+
+        worker.wheel[tick % DEMULTIPLEXER_WHEEL_SLOTS].push_back( session );
+    }
+
+    /**
+     * Check the slots of the ticks that passed. Datagrams only refresh the
+     * time of their session, so a session still active is put back in the
+     * slot of its new deadline here instead of on every datagram.
+     */
+    void expire( Worker& worker, int64_t now )
+    {
+        int64_t lastTick = now / mTickTime;
+
+        // After a long stall one turn of the wheel sees every slot
+        if ( lastTick - worker.wheelTick >= DEMULTIPLEXER_WHEEL_SLOTS )
+        {
+            worker.wheelTick = lastTick - DEMULTIPLEXER_WHEEL_SLOTS + 1;
+        }
+
+        std::vector< SessionPointer > due;
+
+        for ( ; worker.wheelTick <= lastTick; ++worker.wheelTick )
+        {
+            due.clear();
+            due.swap( worker.wheel[worker.wheelTick % DEMULTIPLEXER_WHEEL_SLOTS] );
+
+            for ( size_t i = 0; i < due.size(); ++i )
+            {
+                int64_t deadline = due[i]->mLastActive.load( std::memory_order_relaxed ) + mIdleTimeout;
+
+                if ( deadline > now || !remove( due[i], now ) )
+                {
+                    schedule( worker, due[i], deadline, worker.wheelTick + 1 );
+                    continue;
+                }
+
+                std::lock_guard< std::mutex > lock( due[i]->mMutex );
+                due[i]->mExpired = true;
+
+                if ( mOnExpired )
+                {
+                    mOnExpired( *due[i] );
+                }
+
+                // onExpired can still send, the application might keep the
+                // session after it but the worker socket can be closed
+                due[i]->mSocket.store( nullptr, std::memory_order_release );
+                due[i]->state.reset();
+            }
+        }
+    }
+
+    // Take an idle session out of the table, unless a datagram just came
+    bool remove( const SessionPointer& session, int64_t now )
+    {
+        Stripe& stripe = getStripe( session->mPeer );
+        std::lock_guard< std::mutex > lock( stripe.mutex );
+
+        if ( session->mLastActive.load( std::memory_order_relaxed ) + mIdleTimeout > now )
+        {
+            return false;
+        }
+
+        auto iterator = stripe.sessions.find( session->mPeer );
+
+        if ( iterator != stripe.sessions.end() && iterator->second == session )
+        {
+            stripe.sessions.erase( iterator );
+            mSessionCount.fetch_sub( 1, std::memory_order_relaxed );
+            mExpiredCount.fetch_add( 1, std::memory_order_relaxed );
+        }
+
+        return true;
+    }
+
+    size_t mWorkerCount;
+    int mIdleTimeout;
+    int mTickTime;
+    size_t mMaxDatagramSize;
+
+    DatagramCallback mOnDatagram;
+    SessionCallback mOnExpired;
+
+    std::vector< std::unique_ptr< Worker > > mWorkers;
+    int mWakeDescriptor;
+    std::atomic< bool > mStopping;
+
+    Stripe mStripes[DEMULTIPLEXER_STRIPES];
+
+    std::atomic< size_t > mSessionCount;
+    std::atomic< uint64_t > mDatagramCount;
+    std::atomic< uint64_t > mCreatedCount;
+    std::atomic< uint64_t > mExpiredCount;
+};
+
+
+
+#endif // DATAGRAMDEMULTIPLEXER_H
@@ -0,0 +1,497 @@
+/**
+ * An event loop that waits for many sockets at once using epoll and dispatches
+ * readable, writable and hangup events to callbacks, so a single thread can
+ * serve a large number of connections.
+ *
+ * EXAMPLE OF USE:
+ *
+ *    #include "EventLoop.h"
+ *
+ *    int main()
+ *    {
+ *        ServerSocket server( 50 );
+ *        EventLoop loop;
+ *
+ *        // Accepted sockets are kept by descriptor until the peer hangs up
+ *        std::unordered_map< int, Socket > connections;
+ *
+ *        // In edge-triggered mode (the default) the descriptors must be
+ *        // non-blocking and every callback must consume all pending data or
+ *        // connections, because it is called only once per readiness change.
+ *        server.setNonBlocking( true );
+ *
+ *        if ( server.setup( "3490" ) && server.start( 0 ) )
+ *        {
+ *            loop.add( server, [&]( int )
+ *            {
+ *                SocketResult result;
+ *                Socket socket;
+ *
+ *                while ( ( socket = server.accept( result ) ).isValid() )
+ *                {
+ *                    loop.add( socket,
+ *                        [&]( int fd ) { ... connections[fd].tryReceive( buffer, size ) ... },
+ *                        [&]( int fd ) { ... connections[fd].trySend( buffer, size ) ... },
+ *                        [&]( int fd ) { loop.remove( fd ); connections.erase( fd ); } );
+ *
+ *                    connections[socket.getSocketDescriptor()] = std::move( socket );
+ *                }
+ *            } );
+ *
+ *            // Dispatch events until loop.stop() is called
+ *            loop.run();
+ *        }
+ *
+ *        return 0;
+ *    }
+ */
+
+
+
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "Socket.h"
+
+
+
+enum class EventTrigger
+{
+    LEVEL,
+    EDGE
+};
+
+
+
+/**
+ * This class dispatches socket readiness events to callbacks.
+ */
+class EventLoop
+{
+    public:
+
+    // Receives the descriptor which triggered the event
+    typedef std::function< void( int socketDescriptor ) > EventCallback;
+
+    /**
+     * maxEvents is the maximum number of events collected by a single
+     * epoll_wait() call.
+     */
+    EventLoop( int maxEvents = 256 ) :
+        mEpollDescriptor( -1 ),
+        mWakeDescriptor( -1 ),
+        mStopping( false ),
+        mGeneration( 0 ),
+        mEvents( maxEvents > 0 ? maxEvents : 1 )
+    {
+        mEpollDescriptor = epoll_create1( EPOLL_CLOEXEC );
+
+        if ( mEpollDescriptor == -1 )
+        {
+            SocketLog::report( "EventLoop", "epoll_create1", errno );
+            return;
+        }
+
+        // Used to wake up epoll_wait() when stop() is called from another thread
+        mWakeDescriptor = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+
+        if ( mWakeDescriptor == -1 )
+        {
+            SocketLog::report( "EventLoop", "eventfd", errno );
+            return;
+        }
+
+        struct epoll_event event;
+        memset( &event, 0, sizeof( event ) );
+        event.events = EPOLLIN;
+        event.data.u64 = makeToken( mWakeDescriptor, 0 );
+
+        if ( epoll_ctl( mEpollDescriptor, EPOLL_CTL_ADD, mWakeDescriptor, &event ) == -1 )
+        {
+            SocketLog::report( "EventLoop", "epoll_ctl", errno );
+        }
+    }
+
+    EventLoop( const EventLoop& ) = delete;
+    EventLoop& operator=( const EventLoop& ) = delete;
+
+    ~EventLoop()
+    {
+        ::close( mWakeDescriptor );
+        ::close( mEpollDescriptor );
+    }
+
+    /**
+     * Watch a connected socket. Empty callbacks are not registered.
+     */
+    bool add( const Socket& socket, const EventCallback& onReadable, const EventCallback& onWritable = EventCallback(),
+              const EventCallback& onHangup = EventCallback(), EventTrigger trigger = EventTrigger::EDGE )
+    {
+        return add( socket.getSocketDescriptor(), onReadable, onWritable, onHangup, trigger );
+    }
+
+    /**
+     * Watch the listening descriptor created by ServerSocket::start().
+     * onAcceptable is called when connections are waiting in the backlog.
+     */
+    bool add( const ServerSocket& server, const EventCallback& onAcceptable, EventTrigger trigger = EventTrigger::EDGE )
+    {
+        return add( server.getSocketDescriptor(), onAcceptable, EventCallback(), EventCallback(), trigger );
+    }
+
+    /**
+     * Watch one listening descriptor of ServerSocket::startSharded(). Usually
+     * each worker thread has its own EventLoop watching its own shard.
+     */
+    bool add( const ServerSocket& server, size_t shard, const EventCallback& onAcceptable, EventTrigger trigger = EventTrigger::EDGE )
+    {
+        return add( server.getShardDescriptor( shard ), onAcceptable, EventCallback(), EventCallback(), trigger );
+    }
+
+    bool add( int socketDescriptor, const EventCallback& onReadable, const EventCallback& onWritable = EventCallback(),
+              const EventCallback& onHangup = EventCallback(), EventTrigger trigger = EventTrigger::EDGE )
+    {
+        if ( socketDescriptor < 0 || mEpollDescriptor == -1 )
+        {
+            SocketLog::report( "EventLoop", "add", EBADF );
+            return false;
+        }
+
+        size_t index = static_cast< size_t >( socketDescriptor );
+
+        if ( index >= mEntries.size() )
+        {
+            mEntries.resize( index + 1 );
+        }
+
+        if ( mEntries[index] )
+        {
+            SocketLog::report( "EventLoop", "add", EEXIST );
+            return false;
+        }
+
+        std::shared_ptr< EventEntry > entry = std::make_shared< EventEntry >();
+        entry->onReadable = onReadable;
+        entry->onWritable = onWritable;
+        entry->onHangup = onHangup;
+        entry->events = EPOLLRDHUP;
+        entry->generation = ++mGeneration;
+
+        if ( onReadable )
+        {
+            entry->events |= EPOLLIN;
+        }
+
+        if ( onWritable )
+        {
+            entry->events |= EPOLLOUT;
+        }
+
+        if ( trigger == EventTrigger::EDGE )
+        {
+            entry->events |= EPOLLET;
+        }
+
+        struct epoll_event event;
+        memset( &event, 0, sizeof( event ) );
+        event.events = entry->events;
+        event.data.u64 = makeToken( socketDescriptor, entry->generation );
+
+        if ( epoll_ctl( mEpollDescriptor, EPOLL_CTL_ADD, socketDescriptor, &event ) == -1 )
+        {
+            SocketLog::report( "EventLoop", "epoll_ctl", errno );
+            return false;
+        }
+
+        mEntries[index] = entry;
+
+        return true;
+    }
+
+    /**
+     * Enable or disable readable notifications, for instance to stop reading
+     * from a peer until the data already received is processed.
+     */
+    bool setReadable( int socketDescriptor, bool enabled )
+    {
+        EventEntry* entry = getEntry( socketDescriptor );
+
+        if ( entry == nullptr || !entry->onReadable )
+        {
+            return false;
+        }
+
+        return setEvents( socketDescriptor, *entry, EPOLLIN, enabled );
+    }
+
+    /**
+     * Enable or disable writable notifications. Useful in level-triggered mode,
+     * where a socket is writable most of the time.
+     */
+    bool setWritable( int socketDescriptor, bool enabled )
+    {
+        EventEntry* entry = getEntry( socketDescriptor );
+
+        if ( entry == nullptr || !entry->onWritable )
+        {
+            return false;
+        }
+
+        return setEvents( socketDescriptor, *entry, EPOLLOUT, enabled );
+    }
+
+    /**
+     * Flush a socket in write coalescing mode once the current batch of
+     * events was dispatched, so the writes of all the callbacks of the batch
+     * go out in one call. The socket must stay alive until then, or be
+     * removed from the loop before it is destroyed.
+     */
+    void flushAfterDispatch( Socket& socket )
+    {
+        mFlushList.push_back( &socket );
+    }
+
+    bool remove( const Socket& socket )
+    {
+        return remove( socket.getSocketDescriptor() );
+    }
+
+    bool remove( const ServerSocket& server )
+    {
+        return remove( server.getSocketDescriptor() );
+    }
+
+    /**
+     * Stop watching a descriptor. It is safe to call it from inside a callback,
+     * pending events of the removed descriptor are discarded.
+     */
+    bool remove( int socketDescriptor )
+    {
+        EventEntry* entry = getEntry( socketDescriptor );
+
+        if ( entry == nullptr )
+        {
+            return false;
+        }
+
+        for ( size_t i = 0; i < mFlushList.size(); )
+        {
+            if ( mFlushList[i]->getSocketDescriptor() == socketDescriptor )
+            {
+                mFlushList[i] = mFlushList.back();
+                mFlushList.pop_back();
+            }
+            else
+            {
+                ++i;
+            }
+        }
+
+        epoll_ctl( mEpollDescriptor, EPOLL_CTL_DEL, socketDescriptor, nullptr );
+
+        // A callback of this entry might be running, so it is only released
+        // when the dispatcher drops its reference
+        entry->active = false;
+        mEntries[socketDescriptor].reset();
+
+        return true;
+    }
+
+    /**
+     * Wait up to timeout milliseconds (-1 waits forever) and dispatch a batch
+     * of events. Returns the number of events dispatched or -1 in case of error.
+     */
+    int poll( int timeout = -1 )
+    {
+        if ( mEpollDescriptor == -1 )
+        {
+            return -1;
+        }
+
+        int count = epoll_wait( mEpollDescriptor, mEvents.data(), static_cast< int >( mEvents.size() ), timeout );
+
+        if ( count == -1 )
+        {
+            if ( errno == EINTR )
+            {
+                return 0;
+            }
+
+            SocketLog::report( "EventLoop", "epoll_wait", errno );
+            return -1;
+        }
+
+        int dispatched = 0;
+
+        for ( int i = 0; i < count; ++i )
+        {
+            int socketDescriptor = static_cast< int >( mEvents[i].data.u64 & 0xFFFFFFFF );
+            uint32_t generation = static_cast< uint32_t >( mEvents[i].data.u64 >> 32 );
+            uint32_t events = mEvents[i].events;
+
+            if ( socketDescriptor == mWakeDescriptor )
+            {
+                eventfd_t value;
+                eventfd_read( mWakeDescriptor, &value );
+                continue;
+            }
+
+            if ( static_cast< size_t >( socketDescriptor ) >= mEntries.size() )
+            {
+                continue;
+            }
+
+            std::shared_ptr< EventEntry > entry = mEntries[socketDescriptor];
+
+            if ( !entry || entry->generation != generation )
+            {
+                continue;
+            }
+
+            // Each callback might remove the descriptor, so it is checked again
+            // before every dispatch
+            if ( ( events & EPOLLIN ) && entry->active && entry->onReadable )
+            {
+                entry->onReadable( socketDescriptor );
+            }
+
+            if ( ( events & EPOLLOUT ) && entry->active && entry->onWritable )
+            {
+                entry->onWritable( socketDescriptor );
+            }
+
+            if ( ( events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) && entry->active && entry->onHangup )
+            {
+                entry->onHangup( socketDescriptor );
+            }
+
+            dispatched++;
+        }
+
+        flushSockets();
+
+        return dispatched;
+    }
+
+    /**
+     * Dispatch events until stop() is called. A stop() that came before
+     * run() makes it return right away.
+     */
+    void run()
+    {
+        // The request is consumed, so the loop can be run again afterwards
+        while ( !mStopping.exchange( false ) )
+        {
+            if ( poll( -1 ) == -1 )
+            {
+                break;
+            }
+        }
+    }
+
+    /**
+     * Make run() return. It can be called from any thread.
+     */
+    void stop()
+    {
+        mStopping = true;
+
+        if ( mWakeDescriptor != -1 )
+        {
+            eventfd_write( mWakeDescriptor, 1 );
+        }
+    }
+
+    private:
+
+    struct EventEntry
+    {
+        EventEntry() :
+            events( 0 ),
+            generation( 0 ),
+            active( true )
+        {
+        }
+
+        EventCallback onReadable;
+        EventCallback onWritable;
+        EventCallback onHangup;
+        uint32_t events;
+        uint32_t generation;
+        bool active;
+    };
+
+    // The generation distinguishes events of a removed descriptor from events
+    // of a new one that reused the same number within the same batch.
+    static uint64_t makeToken( int socketDescriptor, uint32_t generation )
+    {
+        return ( static_cast< uint64_t >( generation ) << 32 ) | static_cast< uint32_t >( socketDescriptor );
+    }
+
+    bool setEvents( int socketDescriptor, EventEntry& entry, uint32_t mask, bool enabled )
+    {
+        uint32_t events = enabled ? ( entry.events | mask ) : ( entry.events & ~mask );
+
+        if ( events == entry.events )
+        {
+            return true;
+        }
+
+        struct epoll_event event;
+        memset( &event, 0, sizeof( event ) );
+        event.events = events;
+        event.data.u64 = makeToken( socketDescriptor, entry.generation );
+
+        if ( epoll_ctl( mEpollDescriptor, EPOLL_CTL_MOD, socketDescriptor, &event ) == -1 )
+        {
+            SocketLog::report( "EventLoop", "epoll_ctl", errno );
+            return false;
+        }
+
+        entry.events = events;
+
+        return true;
+    }
+
+    void flushSockets()
+    {
+        for ( size_t i = 0; i < mFlushList.size(); ++i )
+        {
+            mFlushList[i]->flush();
+        }
+
+        mFlushList.clear();
+    }
+
+    EventEntry* getEntry( int socketDescriptor )
+    {
+        if ( socketDescriptor < 0 || static_cast< size_t >( socketDescriptor ) >= mEntries.size() )
+        {
+            return nullptr;
+        }
+
+        return mEntries[socketDescriptor].get();
+    }
+
+    int mEpollDescriptor;
+    int mWakeDescriptor;
+    std::atomic< bool > mStopping;
+    uint32_t mGeneration;
+    std::vector< struct epoll_event > mEvents;
+    std::vector< std::shared_ptr< EventEntry > > mEntries;
+
+    // Sockets to flush after the current batch, see flushAfterDispatch()
+    std::vector< Socket* > mFlushList;
+};
+
+
+
+#endif // EVENTLOOP_H
@@ -0,0 +1,480 @@
+/**
+ * Length-prefixed messages over a stream socket. Received data is read in
+ * large chunks into a buffer and split into messages there, so a batch of
+ * small messages costs a single receive call, and messages are returned as
+ * views into the buffer instead of being copied.
+ *
+ * EXAMPLE OF USE:
+ *
+ *    #include "MessageSocket.h"
+ *
+ *    int main()
+ *    {
+ *        ClientSocket client;
+ *
+ *        if ( client.setup( "192.168.0.1", "3490" ) )
+ *        {
+ *            // 4 byte big-endian length before every message, which is
+ *            // refused when it is longer than 1 MiB
+ *            MessageSocket messages( client.connect( 0 ), MessagePrefix::UINT32, 1048576 );
+ *
+ *            messages.send( "hello", 5 );
+ *
+ *            MessageView message;
+ *
+ *            while ( messages.receive( message ).status == SocketStatus::OK )
+ *            {
+ *                // message.data and message.size are valid until the next
+ *                // call to receive()
+ *            }
+ *        }
+ *
+ *        return 0;
+ *    }
+ */
+
+
+
+#ifndef MESSAGESOCKET_H
+#define MESSAGESOCKET_H
+
+
+
+#include <vector>
+#include "Socket.h"
+
+
+
+// Longest prefix, a varint of a 64 bit size
+#define MESSAGE_MAX_PREFIX_SIZE 10
+
+
+
+enum class MessagePrefix
+{
+    UINT16,     // 2 bytes, big-endian
+    UINT32,     // 4 bytes, big-endian
+    VARINT      // 1 to 10 bytes, 7 bits per byte starting with the lowest ones
+};
+
+/**
+ * A received message inside the buffer of a MessageSocket.
+ */
+struct MessageView
+{
+    MessageView() :
+        data( nullptr ),
+        size( 0 )
+    {
+    }
+
+    const char* data;
+    size_t size;
+};
+
+
+
+/**
+ * This class sends and receives length-prefixed messages.
+ */
+class MessageSocket
+{
+    public:
+
+    /**
+     * The socket is owned by the MessageSocket. Messages longer than
+     * maxMessageSize are refused in both directions. bufferSize is the size
+     * of each receive call, the buffer only grows to hold longer messages.
+     * The data kept for flush() is limited to one message of maxMessageSize,
+     * see setMaxPendingSize().
+     */
+    MessageSocket( Socket&& socket, MessagePrefix prefix = MessagePrefix::UINT32,
+                   size_t maxMessageSize = 1048576, size_t bufferSize = 65536 ) :
+        mSocket( std::move( socket ) ),
+        mPrefix( prefix ),
+        mMaxMessageSize( std::min( maxMessageSize, getPrefixLimit( prefix ) ) ),
+        mBuffer( bufferSize > MESSAGE_MAX_PREFIX_SIZE ? bufferSize : MESSAGE_MAX_PREFIX_SIZE ),
+        mStart( 0 ),
+        mEnd( 0 ),
+        mPendingStart( 0 ),
+        mMaxPendingSize( mMaxMessageSize + MESSAGE_MAX_PREFIX_SIZE )
+    {
+    }
+
+    Socket& getSocket()
+    {
+        return mSocket;
+    }
+
+    /**
+     * Receive the next message. result.size is the size of the message.
+     *
+     * In non-blocking mode the status is WOULD_BLOCK until a whole message
+     * arrived. The status is FAILURE with EMSGSIZE for a message longer than
+     * maxMessageSize and EPROTO for a malformed prefix, the stream cannot be
+     * used anymore in both cases.
+     */
+    SocketResult receive( MessageView& message )
+    {
+        for ( ;; )
+        {
+            uint64_t messageSize = 0;
+            int prefixSize = decodePrefix( mBuffer.data() + mStart, mEnd - mStart, messageSize );
+            size_t needed = MESSAGE_MAX_PREFIX_SIZE;
+
+            if ( prefixSize < 0 )
+            {
+                return SocketResult( 0, SocketStatus::FAILURE, EPROTO );
+            }
+
+            if ( prefixSize > 0 )
+            {
+                if ( messageSize > mMaxMessageSize )
+                {
+                    return SocketResult( 0, SocketStatus::FAILURE, EMSGSIZE );
+                }
+
+                needed = prefixSize + static_cast< size_t >( messageSize );
+
+                if ( mEnd - mStart >= needed )
+                {
+                    message.data = mBuffer.data() + mStart + prefixSize;
+                    message.size = static_cast< size_t >( messageSize );
+                    mStart += needed;
+
+                    return SocketResult( message.size );
+                }
+            }
+
+            SocketResult result = fill( needed );
+
+            if ( result.status != SocketStatus::OK )
+            {
+                return result;
+            }
+        }
+    }
+
+    /**
+     * True when a whole message is waiting in the buffer, so receive() will
+     * return it without a system call. Useful in edge-triggered event loops.
+     */
+    bool hasMessage() const
+    {
+        uint64_t messageSize = 0;
+        int prefixSize = decodePrefix( mBuffer.data() + mStart, mEnd - mStart, messageSize );
+
+        return prefixSize > 0 && mEnd - mStart >= prefixSize + messageSize;
+    }
+
+    SocketResult send( const void* message, size_t size )
+    {
+        struct iovec buffer;
+        buffer.iov_base = const_cast< void* >( message );
+        buffer.iov_len = size;
+
+        return sendBatch( &buffer, 1 );
+    }
+
+    /**
+     * Send count messages, one per buffer, with up to SOCKET_BATCH_SIZE of
+     * them in each system call. result.size is the number of message bytes
+     * taken, messages are always taken whole.
+     *
+     * In non-blocking mode the data the socket cannot take is kept and sent
+     * by flush(), which must be called when the socket is writable again.
+     * Once maxPendingSize bytes are kept, the messages that were not started
+     * are refused and the status is WOULD_BLOCK, result.size counting the
+     * messages taken before them. A message the socket took in part is
+     * always kept whole, so the limit can be exceeded by one message.
+     */
+    SocketResult sendBatch( const struct iovec* messages, int count )
+    {
+        for ( int i = 0; i < count; ++i )
+        {
+            if ( messages[i].iov_len > mMaxMessageSize )
+            {
+                return SocketResult( 0, SocketStatus::FAILURE, EMSGSIZE );
+            }
+        }
+
+        char prefixes[SOCKET_BATCH_SIZE][MESSAGE_MAX_PREFIX_SIZE];
+        struct iovec buffers[2 * SOCKET_BATCH_SIZE];
+        ssize_t totalSize = 0;
+
+        for ( int first = 0; first < count; first += SOCKET_BATCH_SIZE )
+        {
+            int batchCount = std::min( count - first, SOCKET_BATCH_SIZE );
+
+            for ( int i = 0; i < batchCount; ++i )
+            {
+                buffers[2 * i].iov_base = prefixes[i];
+                buffers[2 * i].iov_len = encodePrefix( messages[first + i].iov_len, prefixes[i] );
+                buffers[2 * i + 1] = messages[first + i];
+            }
+
+            SocketResult result = flush();
+            size_t sentSize = 0;
+
+            // Messages must not overtake the data still pending
+            if ( result.status == SocketStatus::OK )
+            {
+                result = mSocket.trySendv( buffers, 2 * batchCount );
+                sentSize = static_cast< size_t >( result.size );
+            }
+
+            if ( result.status != SocketStatus::OK && result.status != SocketStatus::WOULD_BLOCK )
+            {
+                return SocketResult( totalSize, result.status, result.error );
+            }
+
+            // Keep what was not sent, message by message, while there is room
+            for ( int i = 0; i < batchCount; ++i )
+            {
+                size_t messageSize = buffers[2 * i].iov_len + buffers[2 * i + 1].iov_len;
+
+                if ( sentSize >= messageSize )
+                {
+                    sentSize -= messageSize;
+                }
+                else
+                {
+                    if ( sentSize == 0 && getPendingSize() + messageSize > mMaxPendingSize )
+                    {
+                        return SocketResult( totalSize, SocketStatus::WOULD_BLOCK, EAGAIN );
+                    }
+
+                    appendPending( &buffers[2 * i], 2, sentSize );
+                    sentSize = 0;
+                }
+
+                totalSize += buffers[2 * i + 1].iov_len;
+            }
+        }
+
+        return SocketResult( totalSize );
+    }
+
+    /**
+     * Send the data kept by a non-blocking send(). The status is WOULD_BLOCK
+     * while some of it is still pending.
+     */
+    SocketResult flush()
+    {
+        if ( mPendingStart == mPending.size() )
+        {
+            return SocketResult();
+        }
+
+        SocketResult result = mSocket.trySend( mPending.data() + mPendingStart, mPending.size() - mPendingStart );
+
+        mPendingStart += static_cast< size_t >( result.size );
+
+        if ( mPendingStart == mPending.size() )
+        {
+            mPending.clear();
+            mPendingStart = 0;
+        }
+        else if ( result.status == SocketStatus::OK )
+        {
+            result.status = SocketStatus::WOULD_BLOCK;
+        }
+
+        return result;
+    }
+
+    size_t getPendingSize() const
+    {
+        return mPending.size() - mPendingStart;
+    }
+
+    /**
+     * Bytes kept for flush() before sendBatch() refuses new messages. At
+     * least one message of maxMessageSize with its prefix is always allowed.
+     */
+    void setMaxPendingSize( size_t maxPendingSize )
+    {
+        mMaxPendingSize = std::max( maxPendingSize, mMaxMessageSize + MESSAGE_MAX_PREFIX_SIZE );
+    }
+
+    size_t getMaxPendingSize() const
+    {
+        return mMaxPendingSize;
+    }
+
+    private:
+
+    static size_t getPrefixLimit( MessagePrefix prefix )
+    {
+        switch ( prefix )
+        {
+            case MessagePrefix::UINT16:
+                return 0xFFFF;
+
+            case MessagePrefix::UINT32:
+                return static_cast< size_t >( 0xFFFFFFFFu );
+
+            default:
+                return SIZE_MAX;
+        }
+    }
+
+    size_t encodePrefix( uint64_t size, char* prefix ) const
+    {
+        switch ( mPrefix )
+        {
+            case MessagePrefix::UINT16:
+                prefix[0] = static_cast< char >( size >> 8 );
+                prefix[1] = static_cast< char >( size );
+                return 2;
+
+            case MessagePrefix::UINT32:
+                prefix[0] = static_cast< char >( size >> 24 );
+                prefix[1] = static_cast< char >( size >> 16 );
+                prefix[2] = static_cast< char >( size >> 8 );
+                prefix[3] = static_cast< char >( size );
+                return 4;
+
+            default:
+                break;
+        }
+
+        size_t length = 0;
+
+        while ( size >= 0x80 )
+        {
+            prefix[length++] = static_cast< char >( ( size & 0x7F ) | 0x80 );
+            size >>= 7;
+        }
+
+        prefix[length++] = static_cast< char >( size );
+
+        return length;
+    }
+
+    /**
+     * Returns the size of the prefix, 0 when it is not complete yet or -1
+     * when it is malformed.
+     */
+    int decodePrefix( const char* data, size_t available, uint64_t& size ) const
+    {
+        const unsigned char* bytes = reinterpret_cast< const unsigned char* >( data );
+
+        switch ( mPrefix )
+        {
+            case MessagePrefix::UINT16:
+                if ( available < 2 )
+                {
+                    return 0;
+                }
+
+                size = ( static_cast< uint64_t >( bytes[0] ) << 8 ) | bytes[1];
+                return 2;
+
+            case MessagePrefix::UINT32:
+                if ( available < 4 )
+                {
+                    return 0;
+                }
+
+                size = ( static_cast< uint64_t >( bytes[0] ) << 24 ) | ( static_cast< uint64_t >( bytes[1] ) << 16 ) |
+                       ( static_cast< uint64_t >( bytes[2] ) << 8 ) | bytes[3];
+                return 4;
+
+            default:
+                break;
+        }
+
+        size = 0;
+
+        for ( size_t i = 0; i < available && i < MESSAGE_MAX_PREFIX_SIZE; ++i )
+        {
+            size |= static_cast< uint64_t >( bytes[i] & 0x7F ) << ( 7 * i );
+
+            if ( ( bytes[i] & 0x80 ) == 0 )
+            {
+                return static_cast< int >( i + 1 );
+            }
+        }
+
+        return available >= MESSAGE_MAX_PREFIX_SIZE ? -1 : 0;
+    }
+
+    /**
+     * Receive more data, with room for at least needed bytes from the start
+     * of the current message.
+     */
+    SocketResult fill( size_t needed )
+    {
+        if ( mStart == mEnd )
+        {
+            mStart = 0;
+            mEnd = 0;
+        }
+        else if ( mBuffer.size() - mStart < needed || mBuffer.size() - mEnd < mBuffer.size() / 2 )
+        {
+            // Only the partial message is moved, the views handed out before
+            // are not valid anymore anyway
+            memmove( mBuffer.data(), mBuffer.data() + mStart, mEnd - mStart );
+            mEnd -= mStart;
+            mStart = 0;
+        }
+
+        if ( mBuffer.size() - mStart < needed )
+        {
+            mBuffer.resize( mStart + needed );
+        }
+
+        SocketResult result = mSocket.tryReceive( mBuffer.data() + mEnd, mBuffer.size() - mEnd );
+
+        if ( result.status == SocketStatus::OK )
+        {
+            mEnd += static_cast< size_t >( result.size );
+        }
+
+        return result;
+    }
+
+    // Keep the bytes of buffers after the first skip ones
+    void appendPending( const struct iovec* buffers, int count, size_t skip )
+    {
+        // Compacting only past the middle keeps appends amortized O(1)
+        if ( mPendingStart > 0 && mPendingStart >= mPending.size() / 2 )
+        {
+            mPending.erase( mPending.begin(), mPending.begin() + mPendingStart );
+            mPendingStart = 0;
+        }
+
+        for ( int i = 0; i < count; ++i )
+        {
+            if ( skip >= buffers[i].iov_len )
+            {
+                skip -= buffers[i].iov_len;
+                continue;
+            }
+
+            const char* data = static_cast< const char* >( buffers[i].iov_base );
+
+            mPending.insert( mPending.end(), data + skip, data + buffers[i].iov_len );
+            skip = 0;
+        }
+    }
+
+    Socket mSocket;
+    MessagePrefix mPrefix;
+    size_t mMaxMessageSize;
+
+    // Received data between mStart and mEnd
+    std::vector< char > mBuffer;
+    size_t mStart;
+    size_t mEnd;
+
+    // Data a non-blocking socket could not take yet, from mPendingStart
+    std::vector< char > mPending;
+    size_t mPendingStart;
+    size_t mMaxPendingSize;
+};
+
+
+
+#endif // MESSAGESOCKET_H
@@ -0,0 +1,457 @@
+/**
+ * A caching name resolver. Lookups run on a pool of worker threads, results
+ * are kept for a time to live, failures for a shorter one, and concurrent
+ * lookups of the same name share a single query.
+ *
+ * EXAMPLE OF USE:
+ *
+ *    #include "Resolver.h"
+ *
+ *    int main()
+ *    {
+ *        // 2 workers, names cached for 30 s and failures for 5 s
+ *        Resolver resolver( 2, 30000, 5000 );
+ *
+ *        // Blocks only until the first lookup of the name completes
+ *        ClientSocket client;
+ *
+ *        if ( client.setup( resolver, "192.168.0.1", "3490" ) )
+ *        {
+ *            Socket socket = client.connect( 0 );
+ *            // ...
+ *        }
+ *
+ *        // Or without blocking, the callback runs on a worker thread (or on
+ *        // this one when the name is cached)
+ *        resolver.resolve( "example.com", "80", SocketType::STREAM, []( const ResolverResult& result )
+ *        {
+ *            if ( result.error == 0 )
+ *            {
+ *                // ... use *result.addresses ...
+ *            }
+ *        } );
+ *
+ *        return 0;
+ *    }
+ */
+
+
+
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Socket.h"
+
+
+
+// Milliseconds between two sweeps of the expired cache entries
+#ifndef RESOLVER_SWEEP_INTERVAL
+#define RESOLVER_SWEEP_INTERVAL 1000
+#endif
+
+
+
+/**
+ * Outcome of a name resolution.
+ */
+struct ResolverResult
+{
+    ResolverResult() :
+        error( EAI_AGAIN )
+    {
+    }
+
+    int error;  // 0 or a getaddrinfo() error, see gai_strerror()
+
+    // Shared by every lookup served from the same cache entry
+    std::shared_ptr< const std::vector< SocketAddress > > addresses;
+};
+
+
+
+/**
+ * This class resolves and caches names. It is thread-safe.
+ */
+class Resolver
+{
+    public:
+
+    typedef std::function< void( const ResolverResult& result ) > ResolverCallback;
+
+    /**
+     * Resolve a name into addresses. Returns 0 or a getaddrinfo() error.
+     * The default backend calls getaddrinfo(), tests can provide a local one.
+     */
+    typedef std::function< int( const std::string& address, const std::string& port, SocketType socketType,
+                                std::vector< SocketAddress >& socketAddressList ) > ResolverBackend;
+
+    /**
+     * ttl and negativeTtl are in milliseconds. Transient failures (EAI_AGAIN,
+     * EAI_SYSTEM, EAI_MEMORY) are never cached.
+     */
+    Resolver( size_t workerCount = 2, int ttl = 30000, int negativeTtl = 5000, const ResolverBackend& backend = ResolverBackend() ) :
+        mTtl( ttl ),
+        mNegativeTtl( negativeTtl ),
+        mBackend( backend ? backend : ResolverBackend( resolveAddressInfo ) ),
+        mStopping( false ),
+        mHitCount( 0 ),
+        mMissCount( 0 ),
+        mCoalescedCount( 0 )
+    {
+        for ( size_t i = 0; i < ( workerCount > 0 ? workerCount : 1 ); ++i )
+        {
+            mWorkers.push_back( std::thread( &Resolver::work, this ) );
+        }
+    }
+
+    Resolver( const Resolver& ) = delete;
+    Resolver& operator=( const Resolver& ) = delete;
+
+    /**
+     * Lookups still waiting in the queue are not run, their callbacks get
+     * EAI_SYSTEM with errno set to ECANCELED.
+     */
+    ~Resolver()
+    {
+        std::vector< ResolverCallback > cancelled;
+
+        {
+            std::lock_guard< std::mutex > lock( mMutex );
+            mStopping = true;
+
+            for ( size_t i = 0; i < mQueue.size(); ++i )
+            {
+                std::vector< ResolverCallback >& waiters = mCache[mQueue[i]].waiters;
+
+                cancelled.insert( cancelled.end(), waiters.begin(), waiters.end() );
+                waiters.clear();
+            }
+
+            mQueue.clear();
+        }
+
+        mQueueCondition.notify_all();
+
+        ResolverResult result;
+        result.error = EAI_SYSTEM;
+
+        for ( size_t i = 0; i < cancelled.size(); ++i )
+        {
+            errno = ECANCELED;
+            cancelled[i]( result );
+        }
+
+        for ( size_t i = 0; i < mWorkers.size(); ++i )
+        {
+            mWorkers[i].join();
+        }
+    }
+
+    /**
+     * Call callback with the addresses of a name. It is called right away
+     * when the name is cached, otherwise from a worker thread.
+     */
+    void resolve( const std::string& address, const std::string& port, SocketType socketType, const ResolverCallback& callback )
+    {
+        std::string key = makeKey( address, port, socketType );
+        ResolverResult result;
+
+        {
+            std::lock_guard< std::mutex > lock( mMutex );
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+            sweep( now );
+
+            CacheEntry& entry = mCache[key];
+
+            if ( entry.state == CacheState::READY && now < entry.expiration )
+            {
+                mHitCount.fetch_add( 1, std::memory_order_relaxed );
+                result = entry.result;
+            }
+            else
+            {
+                entry.waiters.push_back( callback );
+
+                if ( entry.state == CacheState::PENDING )
+                {
+                    mCoalescedCount.fetch_add( 1, std::memory_order_relaxed );
+                    return;
+                }
+
+                mMissCount.fetch_add( 1, std::memory_order_relaxed );
+
+                entry.state = CacheState::PENDING;
+                entry.address = address;
+                entry.port = port;
+                entry.socketType = socketType;
+
+                mQueue.push_back( key );
+                mQueueCondition.notify_one();
+                return;
+            }
+        }
+
+        callback( result );
+    }
+
+    /**
+     * Wait for the addresses of a name.
+     */
+    ResolverResult resolve( const std::string& address, const std::string& port, SocketType socketType = SocketType::STREAM )
+    {
+        std::shared_ptr< std::promise< ResolverResult > > promise = std::make_shared< std::promise< ResolverResult > >();
+        std::future< ResolverResult > future = promise->get_future();
+
+        resolve( address, port, socketType, [promise]( const ResolverResult& result )
+        {
+            promise->set_value( result );
+        } );
+
+        return future.get();
+    }
+
+    /**
+     * Drop every cached name. Lookups in progress are not affected.
+     */
+    void clear()
+    {
+        std::lock_guard< std::mutex > lock( mMutex );
+
+        for ( auto iterator = mCache.begin(); iterator != mCache.end(); )
+        {
+            if ( iterator->second.state == CacheState::READY )
+            {
+                iterator = mCache.erase( iterator );
+            }
+            else
+            {
+                ++iterator;
+            }
+        }
+    }
+
+    /**
+     * Number of lookups served from the cache.
+     */
+    uint64_t getHitCount() const
+    {
+        return mHitCount.load( std::memory_order_relaxed );
+    }
+
+    /**
+     * Number of lookups that queried the backend.
+     */
+    uint64_t getMissCount() const
+    {
+        return mMissCount.load( std::memory_order_relaxed );
+    }
+
+    /**
+     * Number of lookups that joined a query already in progress.
+     */
+    uint64_t getCoalescedCount() const
+    {
+        return mCoalescedCount.load( std::memory_order_relaxed );
+    }
+
+    private:
+
+    enum class CacheState
+    {
+        EMPTY,
+        PENDING,
+        READY
+    };
+
+    struct CacheEntry
+    {
+        CacheEntry() :
+            state( CacheState::EMPTY ),
+            socketType( SocketType::STREAM )
+        {
+        }
+
+        CacheState state;
+        ResolverResult result;
+        std::chrono::steady_clock::time_point expiration;
+
+        // Query of a pending entry and the callbacks waiting for it
+        std::string address;
+        std::string port;
+        SocketType socketType;
+        std::vector< ResolverCallback > waiters;
+    };
+
+    static std::string makeKey( const std::string& address, const std::string& port, SocketType socketType )
+    {
+        return address + ":" + port + ( socketType == SocketType::DATAGRAM ? "/udp" : "/tcp" );
+    }
+
+    static int resolveAddressInfo( const std::string& address, const std::string& port, SocketType socketType,
+                                   std::vector< SocketAddress >& socketAddressList )
+    {
+        struct addrinfo hints;
+        struct addrinfo* serverInfo;
+        int type = SOCK_STREAM;
+
+        SocketParameterConverter::getParam( socketType, type );
+
+        memset( &hints, 0, sizeof hints );
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = type;
+
+        int status = getaddrinfo( address.c_str(), port.c_str(), &hints, &serverInfo );
+
+        if ( status == 0 )
+        {
+            SocketHandler::convertAddressInfo( serverInfo, socketAddressList );
+            freeaddrinfo( serverInfo );
+        }
+
+        return status;
+    }
+
+    /**
+     * Erase the expired entries, at most once per RESOLVER_SWEEP_INTERVAL so
+     * lookups do not walk the whole cache each time.
+     */
+    void sweep( std::chrono::steady_clock::time_point now )
+    {
+        if ( now < mNextSweep )
+        {
+            return;
+        }
+
+        mNextSweep = now + std::chrono::milliseconds( RESOLVER_SWEEP_INTERVAL );
+
+        for ( auto iterator = mCache.begin(); iterator != mCache.end(); )
+        {
+            if ( iterator->second.state == CacheState::READY && now >= iterator->second.expiration )
+            {
+                iterator = mCache.erase( iterator );
+            }
+            else
+            {
+                ++iterator;
+            }
+        }
+    }
+
+    static bool isTransient( int error )
+    {
+        return error == EAI_AGAIN || error == EAI_SYSTEM || error == EAI_MEMORY;
+    }
+
+    void work()
+    {
+        std::unique_lock< std::mutex > lock( mMutex );
+
+        for ( ;; )
+        {
+            mQueueCondition.wait( lock, [this]() { return mStopping || !mQueue.empty(); } );
+
+            if ( mStopping )
+            {
+                return;
+            }
+
+            std::string key = mQueue.front();
+            mQueue.pop_front();
+
+            // The entry is pending, so nobody else touches its query
+            CacheEntry& query = mCache[key];
+            std::string address = query.address;
+            std::string port = query.port;
+            SocketType socketType = query.socketType;
+
+            lock.unlock();
+
+            std::shared_ptr< std::vector< SocketAddress > > socketAddressList = std::make_shared< std::vector< SocketAddress > >();
+            ResolverResult result;
+
+            result.error = mBackend( address, port, socketType, *socketAddressList );
+
+            if ( result.error == 0 && socketAddressList->empty() )
+            {
+                result.error = EAI_NONAME;
+            }
+
+            if ( result.error == 0 )
+            {
+                result.addresses = socketAddressList;
+            }
+
+            lock.lock();
+
+            CacheEntry& entry = mCache[key];
+            std::vector< ResolverCallback > waiters;
+            int ttl = result.error == 0 ? mTtl : ( isTransient( result.error ) ? 0 : mNegativeTtl );
+
+            waiters.swap( entry.waiters );
+            entry.state = CacheState::READY;
+            entry.result = result;
+            entry.expiration = std::chrono::steady_clock::now() + std::chrono::milliseconds( ttl );
+
+            lock.unlock();
+
+            for ( size_t i = 0; i < waiters.size(); ++i )
+            {
+                waiters[i]( result );
+            }
+
+            lock.lock();
+        }
+    }
+
+    int mTtl;
+    int mNegativeTtl;
+    ResolverBackend mBackend;
+
+    std::mutex mMutex;
+    std::condition_variable mQueueCondition;
+    std::deque< std::string > mQueue;
+    std::unordered_map< std::string, CacheEntry > mCache;
+    std::chrono::steady_clock::time_point mNextSweep;
+    bool mStopping;
+    std::vector< std::thread > mWorkers;
+
+    std::atomic< uint64_t > mHitCount;
+    std::atomic< uint64_t > mMissCount;
+    std::atomic< uint64_t > mCoalescedCount;
+};
+
+
+
+inline bool ClientSocket::setup( Resolver& resolver, const std::string& address, const std::string& port, SocketType socketType )
+{
+    ResolverResult result = resolver.resolve( address, port, socketType );
+
+    if ( result.error != 0 )
+    {
+        setLastError( "ClientSocket", "getaddrinfo", result.error, true );
+        return false;
+    }
+
+    mSocketAddressList = *result.addresses;
+
+    return true;
+}
+
+
+
+#endif // RESOLVER_H
@@ -40,26 +40,24 @@
  *    
  *            if ( server.start( address ) )
  *            {
- *                // Wait for connection. The caller has the ownership of
- *                // socket, so is up to the caller to delete it.
- *                Socket* socket = server.accept();
+ *                // Wait for connection. The socket closes the connection when
+ *                // it goes out of scope, it can be moved to another thread.
+ *                Socket socket = server.accept();
  * 
  *                // This block might be in a thread
- *                if ( socket != nullptr )
+ *                if ( socket.isValid() )
  *                {
  *                    char* buffer = new char[bufferSize];
  *
  *                    // received contains the number of bytes received or 0 in case
  *                    // the connection was closed
- *                    ssize_t received = socket->receive( buffer, bufferSize);
+ *                    ssize_t received = socket.receive( buffer, bufferSize);
  *        
  *                    // The function send will always try to send bufferSize bytes
  *                    // to the remote side. sent contains the number of bytes sent
  *                    // or -1 in case of error.
- *                    ssize_t sent = socket->send( buffer, bufferSize );
+ *                    ssize_t sent = socket.send( buffer, bufferSize );
  *                    std::cout << "Sent " << sent << " bytes\n";
- *                    
- *                    delete socket;
  *                }
  * 
  *                server.close();
@@ -96,17 +94,15 @@
  *                address = i;
  *            }
  *
- *            // Connect to server using the choosen SocketAddress. The caller
- *            // has the ownership of socket, so is up to the caller to delete it.
- *            Socket* socket = client.connect( address );
+ *            // Connect to server using the choosen SocketAddress. The socket
+ *            // closes the connection when it goes out of scope.
+ *            Socket socket = client.connect( address );
  * 
  *            // This block might be in a thread
- *            if ( socket != nullptr )
+ *            if ( socket.isValid() )
  *            {
  *                // This is the same as in SERVER EXAMPLE
  *                // ...
- *
- *                delete socket;
  *            }
  * 
  *            client.close();
@@ -128,27 +124,88 @@
  *        // Fill serverAddress with information about the server
  *        // ...
  * 
- *        Socket socket;
+ *        Socket socket( SocketFamily::IPV4 );
  * 
  *        // Send data
  *        ssize_t sent = socket.sendTo( serverAddress, buffer, size );
  * 
  *        // Receive data
  *        ssize_t received = socket.receiveFrom( serverAddress, buffer, size );
- *        
+ *
+ *        // Many datagrams to the same peer: prepare the address once...
+ *        Destination server( serverAddress );
+ *        socket.sendTo( server, buffer, size );
+ *
+ *        // ...or connect the socket, then send() needs no address at all
+ *        if ( socket.connect( server ) )
+ *        {
+ *            socket.send( buffer, size );
+ *        }
+ *
  *        return 0;
  *    }
+ *
+ *    /// METRICS EXAMPLE ///
+ *
+ *    // Every socket counts its bytes, calls, partial sends and errors, and
+ *    // SocketMetrics adds them up for the whole process. Compile with
+ *    // -DSOCKET_NO_METRICS to leave them out.
+ *    uint64_t sent = socket.getCounter( SocketCounter::BYTES_SENT );
+ *
+ *    SocketMetricsSnapshot previous, current;
+ *    SocketMetrics::snapshot( previous );
+ *    // ...
+ *    SocketMetrics::snapshot( current );
+ *
+ *    double acceptRate = current.getRate( SocketCounter::ACCEPTS, previous );
+ *    uint64_t connectP99 = current.connectLatency.getPercentile( 99 );   // Microseconds
+ *
+ *    /// ERRORS EXAMPLE ///
+ *
+ *    // Errors come back in SocketResult, or from getLastError() after a
+ *    // failed setup(), start() or connect(). Nothing is printed unless a
+ *    // logger is set, this one prints at most 10 errors per second.
+ *    SocketLog::setLogger( SocketLog::writeToStandardError, 10 );
+ *
+ *    SocketResult result;
+ *    Socket socket = server.accept( result );
+ *
+ *    if ( !result && result.error == EMFILE )
+ *    {
+ *        // Out of descriptors, back off
+ *    }
  */
 
 
 
+#ifndef SOCKET_H
+#define SOCKET_H
+
+
+
 #include <iostream>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <cstddef>
 #include <cstring>
+#include <cstdio>
 #include <vector>
+#include <algorithm>
+#include <chrono>
+#include <climits>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
+#include <linux/errqueue.h>
 #include <errno.h>
 
 
@@ -188,539 +245,2993 @@ typedef uint16_t PORT;
 typedef uint32_t IPV6FLOWINFO;
 typedef uint32_t IPV6SCOPEID;
 
+// Maximum number of datagrams moved by a single batched send or receive
+#ifndef SOCKET_BATCH_SIZE
+#define SOCKET_BATCH_SIZE 64
+#endif
+
+// UDP segmentation offload options, missing in old system headers
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+// Zero-copy send options, missing in old system headers
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+// Smaller sends are copied, pinning pages costs more than copying them
+#ifndef SOCKET_ZEROCOPY_THRESHOLD
+#define SOCKET_ZEROCOPY_THRESHOLD 10240
+#endif
+
+// Buffered bytes that trigger a flush in write coalescing mode
+#ifndef SOCKET_COALESCE_THRESHOLD
+#define SOCKET_COALESCE_THRESHOLD 16384
+#endif
+
+// Bytes transferred between two buffer size adjustments in auto-tuning mode
+#ifndef SOCKET_TUNE_INTERVAL
+#define SOCKET_TUNE_INTERVAL 1048576
+#endif
+
+// Milliseconds between two reads of the buffer size sysctls in auto-tuning mode
+#ifndef SOCKET_SYSCTL_REFRESH
+#define SOCKET_SYSCTL_REFRESH 10000
+#endif
+
+// Kernel limits for a single segmented datagram
+#define SOCKET_MAX_SEGMENTS 64
+#define SOCKET_MAX_SEGMENTED_SIZE 65507
+
+/**
+ * Sequence numbers of the zero-copy sends of a buffer, see
+ * Socket::sendZeroCopy(). count is 0 when the buffer was copied.
+ */
+struct ZeroCopyRange
+{
+    ZeroCopyRange() : first( 0 ), count( 0 )
+    {
+    }
+
+    uint32_t first;
+    uint32_t count;
+};
 
+// Outcome of an operation on a socket
+enum class SocketStatus
+{
+    OK,
+    WOULD_BLOCK,    // Non-blocking socket is not ready, try again later
+    CLOSED,         // Remote side closed the connection
+    TIMEOUT,        // The deadline passed before the operation completed
+    FAILURE         // See SocketResult::error
+};
 
 /**
- * This class is used to convert system socket types to the types defined in this
- * file and vice-versa.
+ * Result of an operation on a socket. size holds the number of bytes
+ * transferred before the operation stopped, even when status is not OK, so a
+ * non-blocking caller can resume exactly where it stopped.
  */
-class SocketParameterConverter
+struct SocketResult
 {
-    public:
+    SocketResult( ssize_t size = 0, SocketStatus status = SocketStatus::OK, int error = 0 ) :
+        size( size ),
+        status( status ),
+        error( error )
+    {
+    }
 
-    static void getParam( int from, SocketFlags& to )
+    /**
+     * True when the operation completed, so that
+     * if ( socket.trySend( buffer, size ) ) reads naturally.
+     */
+    explicit operator bool() const
     {
-        switch ( from )
-        { 
-            case AI_PASSIVE:
-                to = SocketFlags::PASSIVE;
-                break;
-                
-            case AI_CANONNAME:
-                to = SocketFlags::CANONICALNAME;
-                break;
-                
-            default:
-                to = SocketFlags::PASSIVE;
-                break;
-        }
+        return status == SocketStatus::OK;
     }
-    
-    static void getParam( int from, SocketFamily& to )
+
+    ssize_t size;
+    SocketStatus status;
+    int error;          // errno value when status is FAILURE
+};
+
+/**
+ * An error reported to the logger, see SocketLog.
+ */
+struct SocketError
+{
+    const char* component;      // "Socket", "ServerSocket"...
+    const char* operation;      // The call that failed, "accept", "bind"...
+    int error;                  // errno value, or getaddrinfo() error when addressInfo is set
+    bool addressInfo;
+};
+
+typedef void ( *SocketLogger )( const SocketError& error );
+
+/**
+ * Optional sink for the errors of the library. Every operation returns its
+ * error to the caller anyway, so there is no logger by default, and then
+ * reporting an error costs a single atomic load: no formatting, no locks.
+ * A logger gets at most maxPerSecond errors, the others are only counted,
+ * so an error storm (EMFILE on accept, ECONNRESET on thousands of peers)
+ * cannot flood the log.
+ */
+class SocketLog
+{
+    public:
+
+    /**
+     * Set the logger for the whole process, nullptr removes it. It can be
+     * called from several threads, so the logger must be thread-safe.
+     */
+    static void setLogger( SocketLogger logger, uint32_t maxPerSecond = 100 )
     {
-        switch ( from )
-        {
-            case AF_UNSPEC:
-                to = SocketFamily::UNSPECIFIED;
-                break;
-                
-            case AF_INET:
-                to = SocketFamily::IPV4;
-                break;
-                
-            case AF_INET6:
-                to = SocketFamily::IPV6;
-                break;
-                
-            default:
-                to = SocketFamily::UNSPECIFIED;
-                break;
-        }
+        getState().maxPerSecond.store( maxPerSecond, std::memory_order_relaxed );
+        getState().logger.store( logger, std::memory_order_release );
     }
-    
-    static void getParam( int from, SocketType& to )
+
+    static void report( const char* component, const char* operation, int error, bool addressInfo = false )
     {
-        switch ( from )
+        SocketLogger logger = getState().logger.load( std::memory_order_acquire );
+
+        if ( logger == nullptr || !takeToken() )
         {
-            case SOCK_STREAM:
-                to = SocketType::STREAM;
-                break;
-                
-            case SOCK_DGRAM:
-                to = SocketType::DATAGRAM;
-                break;
-                
-            default:
-                to = SocketType::STREAM;
-                break;
+            return;
         }
+
+        SocketError socketError;
+        socketError.component = component;
+        socketError.operation = operation;
+        socketError.error = error;
+        socketError.addressInfo = addressInfo;
+
+        logger( socketError );
     }
-    
-    static void getParam( int from, SocketProtocol& to )
+
+    /**
+     * A logger writing "Component error: operation(). Description" to
+     * std::cerr, the output of older versions of the library.
+     */
+    static void writeToStandardError( const SocketError& error )
     {
-        switch ( from )
-        {
-            case 0:
-                to = SocketProtocol::ANY;
-                break;
-                
-            default:
-                to = SocketProtocol::ANY;
-                break;
-        }
+        std::cerr << error.component << " error: " << error.operation << "(). "
+                  << ( error.addressInfo ? gai_strerror( error.error ) : strerror( error.error ) ) << "\n";
     }
-    
-    static void getParam( SocketFlags from, int& to )
+
+    /**
+     * Number of errors dropped by the rate limit.
+     */
+    static uint64_t getSuppressedCount()
     {
-        switch ( from )
-        {
-            case SocketFlags::PASSIVE:
-                to = AI_PASSIVE;
-                break;
-                
-            case SocketFlags::CANONICALNAME:
-                to = AI_CANONNAME;
-                break;
-            
-            default:
-                to = AI_PASSIVE;
-        }
+        return getState().suppressedCount.load( std::memory_order_relaxed );
     }
-    
-    static void getParam( SocketFamily from, int& to )
+
+    private:
+
+    struct State
     {
-        switch ( from )
-        {
-            case SocketFamily::UNSPECIFIED:
-                to = AF_UNSPEC;
-                break;
-                
-            case SocketFamily::IPV4:
-                to = AF_INET;
-                break;
-                
-            case SocketFamily::IPV6:
-                to = AF_INET6;
-                break;
-                
-            default:
-                to = AF_UNSPEC;
-                break;
-        }
+        std::atomic< SocketLogger > logger;
+        std::atomic< uint32_t > maxPerSecond;
+
+        // Errors reported during the second that started at windowStart
+        std::atomic< int64_t > windowStart;
+        std::atomic< uint32_t > windowCount;
+        std::atomic< uint64_t > suppressedCount;
+    };
+
+    // Zero-initialized as static storage, so there is no logger until set
+    static State& getState()
+    {
+        static State state;
+
+        return state;
     }
-    
-    static void getParam( SocketType from, int& to )
+
+    static bool takeToken()
     {
-        switch ( from )
+        State& state = getState();
+        int64_t now = std::chrono::duration_cast< std::chrono::seconds >( std::chrono::steady_clock::now().time_since_epoch() ).count();
+        int64_t windowStart = state.windowStart.load( std::memory_order_relaxed );
+
+        // Only the thread that moves the window resets its count
+        if ( now != windowStart && state.windowStart.compare_exchange_strong( windowStart, now, std::memory_order_relaxed ) )
         {
-            case SocketType::STREAM:
-                to = SOCK_STREAM;
-                break;
-                
-            case SocketType::DATAGRAM:
-                to = SOCK_DGRAM;
-                break;
-                
-            default:
-                to = SOCK_STREAM;
-                break;
+            state.windowCount.store( 0, std::memory_order_relaxed );
         }
-    }
-    
-    static void getParam( SocketProtocol from, int& to )
-    {
-        switch ( from )
+
+        if ( state.windowCount.fetch_add( 1, std::memory_order_relaxed ) >= state.maxPerSecond.load( std::memory_order_relaxed ) )
         {
-            case SocketProtocol::ANY:
-                to = 0;
-                break;
-                
-            default:
-                to = 0;
-                break;
+            state.suppressedCount.fetch_add( 1, std::memory_order_relaxed );
+            return false;
         }
+
+        return true;
     }
 };
 
+/**
+ * Statistics of a TCP connection, see Socket::tcpInfo(). Fields the kernel
+ * does not report are 0.
+ */
+struct TcpInfo
+{
+    uint8_t state;              // TCP_ESTABLISHED, TCP_CLOSE_WAIT...
+    uint32_t rtt;               // Smoothed round trip time in microseconds
+    uint32_t rttVariance;       // In microseconds
+    uint32_t minRtt;            // In microseconds
+    uint32_t congestionWindow;  // In segments
+    uint32_t sendMss;           // Segment size in bytes
+    uint32_t retransmits;       // Timeouts of the oldest unacknowledged segment
+    uint32_t totalRetransmits;  // Segments retransmitted in the connection lifetime
+    uint32_t unacked;           // Segments sent and not acknowledged yet
+    uint32_t lost;              // Segments considered lost
+    uint32_t notSentBytes;      // Bytes in the send buffer not sent yet
+    uint32_t receiveSpace;      // Bytes the peer delivers in a round trip
+    uint64_t pacingRate;        // In bytes per second
+    uint64_t deliveryRate;      // Measured by the sender, in bytes per second
+    uint64_t bytesAcked;
+    uint64_t bytesReceived;
+};
+
+/**
+ * struct tcp_info of linux/tcp.h, which cannot be included together with
+ * netinet/tcp.h. The kernel only appends fields to it, so the ones an older
+ * kernel does not know are left at 0.
+ */
+struct SocketKernelTcpInfo
+{
+    struct tcp_info base;       // Fields up to tcpi_total_retrans
+    uint64_t pacingRate;
+    uint64_t maxPacingRate;
+    uint64_t bytesAcked;
+    uint64_t bytesReceived;
+    uint32_t segmentsOut;
+    uint32_t segmentsIn;
+    uint32_t notSentBytes;
+    uint32_t minRtt;
+    uint32_t dataSegmentsIn;
+    uint32_t dataSegmentsOut;
+    uint64_t deliveryRate;
+};
+
+static_assert( offsetof( SocketKernelTcpInfo, deliveryRate ) == 160, "unexpected struct tcp_info layout" );
+
+
+
+// Counters kept by every Socket and aggregated for the whole process, see
+// SocketMetrics. Defining SOCKET_NO_METRICS compiles the instrumentation out.
+enum class SocketCounter
+{
+    BYTES_SENT,
+    BYTES_RECEIVED,
+    SEND_CALLS,         // System calls, a large send() can make several
+    RECEIVE_CALLS,
+    PARTIAL_SENDS,      // Send calls that took only part of the data
+    WOULD_BLOCKS,       // EAGAIN of a send, receive or accept call
+    ERRORS,             // Send and receive calls that failed otherwise
+    ACCEPTS,
+    ACCEPT_ERRORS,
+    CONNECTS,
+    CONNECT_ERRORS,     // Including the timed out ones
+    COUNT
+};
+
+#define SOCKET_COUNTER_COUNT static_cast< size_t >( SocketCounter::COUNT )
+
+// Stripes of the process-wide counters, threads are spread among them
+#ifndef SOCKET_METRICS_SHARDS
+#define SOCKET_METRICS_SHARDS 16
+#endif
 
+// Log-linear histogram: values below 16 have a bucket each, then every power
+// of two is split in 8 buckets, so a value is known within 12.5%
+#define SOCKET_HISTOGRAM_SUB_BUCKETS 8
+#define SOCKET_HISTOGRAM_BUCKETS 496
 
 /**
- * This class holds information about Internet address.
+ * Copy of a SocketHistogram at one point in time.
  */
-class SocketAddress
+struct SocketHistogramSnapshot
 {
-    public:
-    
-    SocketAddress() :
-        mFlags( SocketFlags::PASSIVE ),
-        mFamily( SocketFamily::UNSPECIFIED ),
-        mSocketType( SocketType::STREAM ),
-        mProtocol( SocketProtocol::ANY ),
-        mPort( 0 ),
-        mIPv4Address( 0 ),
-        mIPv6FlowInfo( 0 ),
-        mIPv6ScopeId( 0 )
+    SocketHistogramSnapshot() :
+        count( 0 ),
+        sum( 0 ),
+        max( 0 ),
+        counts( SOCKET_HISTOGRAM_BUCKETS, 0 )
     {
-        memset( mIPv6Address, 0, sizeof( IPV6ADDRESS ) );
     }
-    
-    void setFlags( SocketFlags flags )
+
+    /**
+     * Smallest recorded value that percentile (0 to 100) percent of the
+     * values do not exceed, rounded up to the end of its bucket.
+     */
+    uint64_t getPercentile( double percentile ) const;
+
+    double getMean() const
     {
-        mFlags = flags;
+        return count > 0 ? static_cast< double >( sum ) / count : 0;
     }
-    
-    void setFamily( SocketFamily family )
+
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    std::vector< uint64_t > counts;
+};
+
+/**
+ * Histogram of non-negative values, for instance latencies in microseconds.
+ * Recording is lock-free and can happen from any thread.
+ */
+class SocketHistogram
+{
+    public:
+
+    SocketHistogram()
     {
-        mFamily = family;
+        reset();
     }
-    
-    void setSocketType( SocketType socketType )
+
+    SocketHistogram( const SocketHistogram& ) = delete;
+    SocketHistogram& operator=( const SocketHistogram& ) = delete;
+
+    void record( uint64_t value )
     {
-        mSocketType = socketType;
+        mCounts[getBucket( value )].fetch_add( 1, std::memory_order_relaxed );
+        mSum.fetch_add( value, std::memory_order_relaxed );
+
+        uint64_t max = mMax.load( std::memory_order_relaxed );
+
+        while ( value > max && !mMax.compare_exchange_weak( max, value, std::memory_order_relaxed ) )
+        {
+        }
     }
-    
-    void setProtocol( SocketProtocol protocol )
+
+    /**
+     * Values recorded meanwhile might be partially included.
+     */
+    void snapshot( SocketHistogramSnapshot& histogram ) const
     {
-        mProtocol = protocol;
-    }
-    
-    void setPort( PORT port )
+        histogram.count = 0;
+        histogram.counts.assign( SOCKET_HISTOGRAM_BUCKETS, 0 );
+
+        for ( size_t i = 0; i < SOCKET_HISTOGRAM_BUCKETS; ++i )
+        {
+            histogram.counts[i] = mCounts[i].load( std::memory_order_relaxed );
+            histogram.count += histogram.counts[i];
+        }
+
+        histogram.sum = mSum.load( std::memory_order_relaxed );
+        histogram.max = mMax.load( std::memory_order_relaxed );
+    }
+
+    void reset()
     {
-        mPort = port;
+        for ( size_t i = 0; i < SOCKET_HISTOGRAM_BUCKETS; ++i )
+        {
+            mCounts[i].store( 0, std::memory_order_relaxed );
+        }
+
+        mSum.store( 0, std::memory_order_relaxed );
+        mMax.store( 0, std::memory_order_relaxed );
     }
-    
-    void setIPv4Address( IPV4ADDRESS address )
+
+    static size_t getBucket( uint64_t value )
     {
-        mIPv4Address = address;
+        if ( value < 2 * SOCKET_HISTOGRAM_SUB_BUCKETS )
+        {
+            return static_cast< size_t >( value );
+        }
+
+        // Position of the highest bit, and the 3 bits after it
+        int exponent = 63 - __builtin_clzll( value );
+        size_t subBucket = static_cast< size_t >( value >> ( exponent - 3 ) ) & ( SOCKET_HISTOGRAM_SUB_BUCKETS - 1 );
+
+        return 2 * SOCKET_HISTOGRAM_SUB_BUCKETS + ( exponent - 4 ) * SOCKET_HISTOGRAM_SUB_BUCKETS + subBucket;
     }
-    
-    void setIPv4Address( const std::string& address )
+
+    /**
+     * Largest value that falls into bucket.
+     */
+    static uint64_t getBucketLimit( size_t bucket )
     {
-        struct sockaddr_in sa;
-        
-        inet_pton( AF_INET, address.c_str(), &(sa.sin_addr) );
-        
-        setIPv4Address( ntohl( sa.sin_addr.s_addr ) );
+        if ( bucket < 2 * SOCKET_HISTOGRAM_SUB_BUCKETS )
+        {
+            return bucket;
+        }
+
+        int shift = static_cast< int >( ( bucket - 2 * SOCKET_HISTOGRAM_SUB_BUCKETS ) / SOCKET_HISTOGRAM_SUB_BUCKETS ) + 1;
+        uint64_t first = static_cast< uint64_t >( SOCKET_HISTOGRAM_SUB_BUCKETS + bucket % SOCKET_HISTOGRAM_SUB_BUCKETS ) << shift;
+
+        return first + ( static_cast< uint64_t >( 1 ) << shift ) - 1;
     }
-    
-    void setIPv6Address( IPV6ADDRESS address )
+
+    private:
+
+    std::atomic< uint64_t > mCounts[SOCKET_HISTOGRAM_BUCKETS];
+    std::atomic< uint64_t > mSum;
+    std::atomic< uint64_t > mMax;
+};
+
+inline uint64_t SocketHistogramSnapshot::getPercentile( double percentile ) const
+{
+    if ( count == 0 )
     {
-        memcpy( mIPv6Address, address, sizeof( IPV6ADDRESS ) );
+        return 0;
     }
-    
-    void setIPv6Address( const std::string& address )
+
+    uint64_t rank = static_cast< uint64_t >( percentile / 100 * count + 0.5 );
+    uint64_t seen = 0;
+
+    rank = std::max< uint64_t >( 1, std::min( rank, count ) );
+
+    for ( size_t i = 0; i < counts.size(); ++i )
     {
-        struct sockaddr_in6 sa6;
-        
-        inet_pton( AF_INET6, address.c_str(), &(sa6.sin6_addr) );
+        seen += counts[i];
 
-        memcpy( mIPv6Address, sa6.sin6_addr.s6_addr, sizeof( unsigned char ) * 16 );
+        if ( seen >= rank )
+        {
+            return std::min( SocketHistogram::getBucketLimit( i ), max );
+        }
     }
-    
-    void setIPv6FlowInfo( IPV6FLOWINFO flowInfo )
+
+    return max;
+}
+
+/**
+ * Counters of a single socket. Only the thread using the socket updates them,
+ * without atomic read-modify-write instructions, but any thread can read them.
+ */
+class SocketCounters
+{
+    public:
+
+    SocketCounters()
     {
-        mIPv6FlowInfo = flowInfo;
+        for ( size_t i = 0; i < SOCKET_COUNTER_COUNT; ++i )
+        {
+            mValues[i].store( 0, std::memory_order_relaxed );
+        }
     }
-    
-    void setIPv6ScopeId( IPV6SCOPEID scopeID )
+
+    SocketCounters( const SocketCounters& other )
     {
-        mIPv6ScopeId = scopeID;
+        *this = other;
     }
-    
-    void setCanonicalHostname( const std::string& canonicalName )
+
+    SocketCounters& operator=( const SocketCounters& other )
     {
-        mCanonicalName = canonicalName;
+        for ( size_t i = 0; i < SOCKET_COUNTER_COUNT; ++i )
+        {
+            mValues[i].store( other.mValues[i].load( std::memory_order_relaxed ), std::memory_order_relaxed );
+        }
+
+        return *this;
     }
-    
-    SocketFlags getFlags() const
+
+    void add( SocketCounter counter, uint64_t value )
     {
-        return mFlags;
+        std::atomic< uint64_t >& total = mValues[static_cast< size_t >( counter )];
+
+        total.store( total.load( std::memory_order_relaxed ) + value, std::memory_order_relaxed );
     }
-    
-    SocketFamily getFamily() const
+
+    uint64_t get( SocketCounter counter ) const
     {
-        return mFamily;
+        return mValues[static_cast< size_t >( counter )].load( std::memory_order_relaxed );
     }
-    
-    SocketType getSocketType() const
+
+    private:
+
+    std::atomic< uint64_t > mValues[SOCKET_COUNTER_COUNT];
+};
+
+/**
+ * Process-wide counters at one point in time, see SocketMetrics::snapshot().
+ */
+struct SocketMetricsSnapshot
+{
+    SocketMetricsSnapshot()
     {
-        return mSocketType;
+        memset( counters, 0, sizeof( counters ) );
     }
-    
-    SocketProtocol getProtocol() const
+
+    uint64_t get( SocketCounter counter ) const
     {
-        return mProtocol;
+        return counters[static_cast< size_t >( counter )];
     }
-    
-    PORT getPort() const
+
+    /**
+     * Increase of counter per second since an older snapshot, for instance
+     * the accept rate with SocketCounter::ACCEPTS.
+     */
+    double getRate( SocketCounter counter, const SocketMetricsSnapshot& previous ) const
     {
-        return mPort;
+        double seconds = std::chrono::duration< double >( time - previous.time ).count();
+
+        return seconds > 0 ? ( get( counter ) - previous.get( counter ) ) / seconds : 0;
     }
-    
-    void getIPv4Address( std::string& address ) const
+
+    std::chrono::steady_clock::time_point time;
+    uint64_t counters[SOCKET_COUNTER_COUNT];
+    SocketHistogramSnapshot connectLatency;     // Microseconds
+};
+
+/**
+ * Counters of all the sockets of the process. Each thread adds to its own
+ * stripe with relaxed atomics, so threads do not contend for cache lines;
+ * snapshot() sums the stripes.
+ */
+class SocketMetrics
+{
+    public:
+
+    static void add( SocketCounter counter, uint64_t value )
     {
-        char ipv4[INET_ADDRSTRLEN];
-        IPV4ADDRESS nboIPv4 = htonl( mIPv4Address );
-        inet_ntop(AF_INET, &nboIPv4, ipv4, INET_ADDRSTRLEN);
-        
-        address = ipv4;
+#ifndef SOCKET_NO_METRICS
+        getShard().values[static_cast< size_t >( counter )].fetch_add( value, std::memory_order_relaxed );
+#else
+        (void) counter;
+        (void) value;
+#endif
     }
-    
-    void getIPv4Address( IPV4ADDRESS& address ) const
+
+    static void recordConnectLatency( uint64_t microseconds )
     {
-        address = mIPv4Address;
+#ifndef SOCKET_NO_METRICS
+        getConnectLatency().record( microseconds );
+#else
+        (void) microseconds;
+#endif
     }
-    
-    void getIPv6Address( std::string& address ) const
+
+    /**
+     * Counters only grow, rates come from the difference of two snapshots.
+     * With SOCKET_NO_METRICS everything is 0.
+     */
+    static void snapshot( SocketMetricsSnapshot& metrics )
     {
-        char ipv6[INET6_ADDRSTRLEN];
-        inet_ntop(AF_INET6, &mIPv6Address, ipv6, INET6_ADDRSTRLEN);
-        
-        address = ipv6;
+        metrics = SocketMetricsSnapshot();
+        metrics.time = std::chrono::steady_clock::now();
+
+#ifndef SOCKET_NO_METRICS
+        Shard* shards = getShards();
+
+        for ( size_t i = 0; i < SOCKET_METRICS_SHARDS; ++i )
+        {
+            for ( size_t j = 0; j < SOCKET_COUNTER_COUNT; ++j )
+            {
+                metrics.counters[j] += shards[i].values[j].load( std::memory_order_relaxed );
+            }
+        }
+
+        getConnectLatency().snapshot( metrics.connectLatency );
+#endif
     }
 
-    void getIPv6Address( IPV6ADDRESS& address ) const
+    private:
+
+    struct alignas( 64 ) Shard
     {
-        memcpy( address, mIPv6Address, sizeof( IPV6ADDRESS ) );
-    }
-    
-    IPV6FLOWINFO getIPv6FlowInfo() const
+        std::atomic< uint64_t > values[SOCKET_COUNTER_COUNT];
+    };
+
+    // Zero-initialized as static storage
+    static Shard* getShards()
     {
-        return mIPv6FlowInfo;
+        static Shard shards[SOCKET_METRICS_SHARDS];
+
+        return shards;
     }
-    
-    IPV6SCOPEID getIPv6ScopeId() const
+
+    static Shard& getShard()
     {
-        return mIPv6ScopeId;
+        static std::atomic< size_t > nextShard( 0 );
+        static thread_local size_t shard = nextShard.fetch_add( 1, std::memory_order_relaxed ) % SOCKET_METRICS_SHARDS;
+
+        return getShards()[shard];
     }
-    
-    std::string getCanonicalHostname() const
+
+    static SocketHistogram& getConnectLatency()
     {
-        return mCanonicalName;
-    }
+        static SocketHistogram connectLatency;
 
-    private:
-    
-    SocketFlags mFlags;
-    SocketFamily mFamily;
-    SocketType mSocketType;
-    SocketProtocol mProtocol;
-    PORT mPort;
-    IPV4ADDRESS mIPv4Address;
-    IPV6ADDRESS mIPv6Address;
-    IPV6FLOWINFO mIPv6FlowInfo;
-    IPV6SCOPEID mIPv6ScopeId;
-    std::string mCanonicalName;
+        return connectLatency;
+    }
 };
 
 
 
 /**
- * This class sends/receives messages to/from sockets.
+ * This class is used to convert system socket types to the types defined in this
+ * file and vice-versa.
  */
-class Socket
+class SocketParameterConverter
 {
     public:
 
-    /**
-     * Construct a connectionless socket
-     */
-    Socket( SocketFamily family )
+    static void getParam( int from, SocketFlags& to )
     {
-        int socketFamily = AF_INET, socketType = SOCK_DGRAM, socketProtocol = 0;
-        
-        switch ( family )
+        switch ( from )
+        { 
+            case AI_PASSIVE:
+                to = SocketFlags::PASSIVE;
+                break;
+                
+            case AI_CANONNAME:
+                to = SocketFlags::CANONICALNAME;
+                break;
+                
+            default:
+                to = SocketFlags::PASSIVE;
+                break;
+        }
+    }
+    
+    static void getParam( int from, SocketFamily& to )
+    {
+        switch ( from )
         {
-            case SocketFamily::IPV4:
-                socketFamily = AF_INET;
+            case AF_UNSPEC:
+                to = SocketFamily::UNSPECIFIED;
                 break;
                 
-            case SocketFamily::IPV6:
-                socketFamily = AF_INET6;
+            case AF_INET:
+                to = SocketFamily::IPV4;
                 break;
-
+                
+            case AF_INET6:
+                to = SocketFamily::IPV6;
+                break;
+                
             default:
+                to = SocketFamily::UNSPECIFIED;
                 break;
         }
-
-        mSocketDescriptor = socket( socketFamily, socketType, socketProtocol );
-        
-        if ( mSocketDescriptor == -1 )
+    }
+    
+    static void getParam( int from, SocketType& to )
+    {
+        switch ( from )
         {
-            std::cerr << "Socket error: " << strerror(errno) << "\n";
+            case SOCK_STREAM:
+                to = SocketType::STREAM;
+                break;
+                
+            case SOCK_DGRAM:
+                to = SocketType::DATAGRAM;
+                break;
+                
+            default:
+                to = SocketType::STREAM;
+                break;
         }
     }
     
-    Socket( int socketDescriptor, PORT port, IPV4ADDRESS ipv4 ) :
-        mSocketDescriptor( socketDescriptor ),
-        mFamily( SocketFamily::IPV4 ),
-        mPort( port ),
-        mIPv4Address( ipv4 ),
-        mIPv6FlowInfo( 0 ),
-        mIPv6ScopeId( 0 )
+    static void getParam( int from, SocketProtocol& to )
     {
-        memset( mIPv6Address, 0, sizeof( IPV6ADDRESS ) );
+        switch ( from )
+        {
+            case 0:
+                to = SocketProtocol::ANY;
+                break;
+                
+            default:
+                to = SocketProtocol::ANY;
+                break;
+        }
+    }
+    
+    static void getParam( SocketFlags from, int& to )
+    {
+        switch ( from )
+        {
+            case SocketFlags::PASSIVE:
+                to = AI_PASSIVE;
+                break;
+                
+            case SocketFlags::CANONICALNAME:
+                to = AI_CANONNAME;
+                break;
+            
+            default:
+                to = AI_PASSIVE;
+        }
     }
+    
+    static void getParam( SocketFamily from, int& to )
+    {
+        switch ( from )
+        {
+            case SocketFamily::UNSPECIFIED:
+                to = AF_UNSPEC;
+                break;
+                
+            case SocketFamily::IPV4:
+                to = AF_INET;
+                break;
+                
+            case SocketFamily::IPV6:
+                to = AF_INET6;
+                break;
+                
+            default:
+                to = AF_UNSPEC;
+                break;
+        }
+    }
+    
+    static void getParam( SocketType from, int& to )
+    {
+        switch ( from )
+        {
+            case SocketType::STREAM:
+                to = SOCK_STREAM;
+                break;
+                
+            case SocketType::DATAGRAM:
+                to = SOCK_DGRAM;
+                break;
+                
+            default:
+                to = SOCK_STREAM;
+                break;
+        }
+    }
+    
+    static void getParam( SocketProtocol from, int& to )
+    {
+        switch ( from )
+        {
+            case SocketProtocol::ANY:
+                to = 0;
+                break;
+                
+            default:
+                to = 0;
+                break;
+        }
+    }
+};
+
+
+
+/**
+ * This class holds information about Internet address. The address is kept
+ * as the system sockaddr, whose family field is the tag of the union, so
+ * converting it costs a copy and a SocketAddress fits in 40 bytes. Equal
+ * addresses have the same hash, which makes them keys of hash tables of
+ * peers.
+ */
+class SocketAddress
+{
+    public:
+    
+    SocketAddress() :
+        mFlags( static_cast< uint8_t >( SocketFlags::PASSIVE ) ),
+        mSocketType( static_cast< uint8_t >( SocketType::STREAM ) ),
+        mProtocol( static_cast< uint8_t >( SocketProtocol::ANY ) )
+    {
+        memset( &mAddress, 0, sizeof( mAddress ) );
+    }
+
+    SocketAddress( const SocketAddress& other ) :
+        mAddress( other.mAddress ),
+        mFlags( other.mFlags ),
+        mSocketType( other.mSocketType ),
+        mProtocol( other.mProtocol ),
+        mCanonicalName( other.mCanonicalName ? new std::string( *other.mCanonicalName ) : nullptr )
+    {
+    }
+
+    SocketAddress( SocketAddress&& other ) = default;
+
+    SocketAddress& operator=( const SocketAddress& other )
+    {
+        if ( this != &other )
+        {
+            mAddress = other.mAddress;
+            mFlags = other.mFlags;
+            mSocketType = other.mSocketType;
+            mProtocol = other.mProtocol;
+            mCanonicalName.reset( other.mCanonicalName ? new std::string( *other.mCanonicalName ) : nullptr );
+        }
+
+        return *this;
+    }
+
+    SocketAddress& operator=( SocketAddress&& other ) = default;
+    
+    void setFlags( SocketFlags flags )
+    {
+        mFlags = static_cast< uint8_t >( flags );
+    }
+    
+    void setFamily( SocketFamily family )
+    {
+        mAddress.base.sa_family = static_cast< sa_family_t >( family );
+    }
+    
+    void setSocketType( SocketType socketType )
+    {
+        mSocketType = static_cast< uint8_t >( socketType );
+    }
+    
+    void setProtocol( SocketProtocol protocol )
+    {
+        mProtocol = static_cast< uint8_t >( protocol );
+    }
+    
+    // The port is at the same place in both families
+    void setPort( PORT port )
+    {
+        mAddress.ipv4.sin_port = htons( port );
+    }
+    
+    void setIPv4Address( IPV4ADDRESS address )
+    {
+        mAddress.ipv4.sin_addr.s_addr = htonl( address );
+    }
+    
+    void setIPv4Address( const std::string& address )
+    {
+        inet_pton( AF_INET, address.c_str(), &mAddress.ipv4.sin_addr );
+    }
+    
+    void setIPv6Address( const IPV6ADDRESS address )
+    {
+        memcpy( mAddress.ipv6.sin6_addr.s6_addr, address, sizeof( IPV6ADDRESS ) );
+    }
+    
+    void setIPv6Address( const std::string& address )
+    {
+        inet_pton( AF_INET6, address.c_str(), &mAddress.ipv6.sin6_addr );
+    }
+    
+    void setIPv6FlowInfo( IPV6FLOWINFO flowInfo )
+    {
+        mAddress.ipv6.sin6_flowinfo = flowInfo;
+    }
+    
+    void setIPv6ScopeId( IPV6SCOPEID scopeID )
+    {
+        mAddress.ipv6.sin6_scope_id = scopeID;
+    }
+    
+    void setCanonicalHostname( const std::string& canonicalName )
+    {
+        mCanonicalName.reset( canonicalName.empty() ? nullptr : new std::string( canonicalName ) );
+    }
+
+    /**
+     * Take the family, address and port of a system socket address. Returns
+     * false, leaving this address unchanged, when it is neither IPv4 nor IPv6.
+     */
+    bool setSockaddr( const struct sockaddr* address, socklen_t addressSize )
+    {
+        // The size is checked first, an empty address has no family either
+        if ( addressSize >= sizeof( struct sockaddr_in ) && address->sa_family == AF_INET )
+        {
+            memcpy( &mAddress.ipv4, address, sizeof( struct sockaddr_in ) );
+            return true;
+        }
+
+        if ( addressSize >= sizeof( struct sockaddr_in6 ) && address->sa_family == AF_INET6 )
+        {
+            memcpy( &mAddress.ipv6, address, sizeof( struct sockaddr_in6 ) );
+            return true;
+        }
+
+        return false;
+    }
+    
+    SocketFlags getFlags() const
+    {
+        return static_cast< SocketFlags >( mFlags );
+    }
+    
+    SocketFamily getFamily() const
+    {
+        return static_cast< SocketFamily >( mAddress.base.sa_family );
+    }
+    
+    SocketType getSocketType() const
+    {
+        return static_cast< SocketType >( mSocketType );
+    }
+    
+    SocketProtocol getProtocol() const
+    {
+        return static_cast< SocketProtocol >( mProtocol );
+    }
+    
+    PORT getPort() const
+    {
+        return ntohs( mAddress.ipv4.sin_port );
+    }
+    
+    void getIPv4Address( std::string& address ) const
+    {
+        char ipv4[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &mAddress.ipv4.sin_addr, ipv4, INET_ADDRSTRLEN);
+        
+        address = ipv4;
+    }
+    
+    void getIPv4Address( IPV4ADDRESS& address ) const
+    {
+        address = ntohl( mAddress.ipv4.sin_addr.s_addr );
+    }
+    
+    void getIPv6Address( std::string& address ) const
+    {
+        char ipv6[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, &mAddress.ipv6.sin6_addr, ipv6, INET6_ADDRSTRLEN);
+        
+        address = ipv6;
+    }
+
+    void getIPv6Address( IPV6ADDRESS& address ) const
+    {
+        memcpy( address, mAddress.ipv6.sin6_addr.s6_addr, sizeof( IPV6ADDRESS ) );
+    }
+    
+    IPV6FLOWINFO getIPv6FlowInfo() const
+    {
+        return mAddress.ipv6.sin6_flowinfo;
+    }
+    
+    IPV6SCOPEID getIPv6ScopeId() const
+    {
+        return mAddress.ipv6.sin6_scope_id;
+    }
+    
+    std::string getCanonicalHostname() const
+    {
+        return mCanonicalName ? *mCanonicalName : std::string();
+    }
+
+    /**
+     * Fill a system socket address with this address.
+     */
+    void getSockaddr( struct sockaddr_storage& address, socklen_t& addressSize ) const
+    {
+        memset( &address, 0, sizeof( sockaddr_storage ) );
+
+        addressSize = getSockaddrSize();
+        memcpy( &address, &mAddress, addressSize );
+    }
+
+    /**
+     * The system socket address itself, valid as long as this object, to
+     * pass to bind(), connect() or sendto() without a copy.
+     */
+    const struct sockaddr* getSockaddr() const
+    {
+        return &mAddress.base;
+    }
+
+    socklen_t getSockaddrSize() const
+    {
+        return getFamily() == SocketFamily::IPV4 ? sizeof( struct sockaddr_in ) : sizeof( struct sockaddr_in6 );
+    }
+
+    /**
+     * Same family, address, port and (for IPv6) scope. Flags, socket type,
+     * protocol, flow information and canonical name are not compared.
+     */
+    bool operator==( const SocketAddress& other ) const
+    {
+        return compare( other ) == 0;
+    }
+
+    bool operator!=( const SocketAddress& other ) const
+    {
+        return compare( other ) != 0;
+    }
+
+    // Ordered by family, then address bytes, then port and scope
+    bool operator<( const SocketAddress& other ) const
+    {
+        return compare( other ) < 0;
+    }
+
+    /**
+     * Hash of the fields compared by operator==(), with every input bit
+     * spread over the result, so it suits open-addressing tables too.
+     */
+    size_t hash() const
+    {
+        uint64_t key = ( static_cast< uint64_t >( mAddress.base.sa_family ) << 48 ) |
+                       ( static_cast< uint64_t >( mAddress.ipv4.sin_port ) << 32 );
+
+        if ( mAddress.base.sa_family == AF_INET )
+        {
+            return static_cast< size_t >( mix( key | mAddress.ipv4.sin_addr.s_addr ) );
+        }
+
+        uint64_t high, low;
+        memcpy( &high, mAddress.ipv6.sin6_addr.s6_addr, sizeof( high ) );
+        memcpy( &low, mAddress.ipv6.sin6_addr.s6_addr + sizeof( high ), sizeof( low ) );
+
+        return static_cast< size_t >( mix( mix( mix( key | mAddress.ipv6.sin6_scope_id ) ^ high ) ^ low ) );
+    }
+
+    private:
+
+    int compare( const SocketAddress& other ) const
+    {
+        if ( mAddress.base.sa_family != other.mAddress.base.sa_family )
+        {
+            return mAddress.base.sa_family < other.mAddress.base.sa_family ? -1 : 1;
+        }
+
+        // Byte order of the network, so they sort like the numbers
+        int result = mAddress.base.sa_family == AF_INET ?
+                     memcmp( &mAddress.ipv4.sin_addr, &other.mAddress.ipv4.sin_addr, sizeof( struct in_addr ) ) :
+                     memcmp( &mAddress.ipv6.sin6_addr, &other.mAddress.ipv6.sin6_addr, sizeof( struct in6_addr ) );
+
+        if ( result != 0 )
+        {
+            return result;
+        }
+
+        if ( getPort() != other.getPort() )
+        {
+            return getPort() < other.getPort() ? -1 : 1;
+        }
+
+        if ( mAddress.base.sa_family == AF_INET || getIPv6ScopeId() == other.getIPv6ScopeId() )
+        {
+            return 0;
+        }
+
+        return getIPv6ScopeId() < other.getIPv6ScopeId() ? -1 : 1;
+    }
+
+    // Finalizer of SplitMix64
+    static uint64_t mix( uint64_t value )
+    {
+        value = ( value ^ ( value >> 30 ) ) * 0xBF58476D1CE4E5B9ull;
+        value = ( value ^ ( value >> 27 ) ) * 0x94D049BB133111EBull;
+
+        return value ^ ( value >> 31 );
+    }
+
+    // Network byte order, the family selects the member
+    union
+    {
+        struct sockaddr base;
+        struct sockaddr_in ipv4;
+        struct sockaddr_in6 ipv6;
+    } mAddress;
+
+    uint8_t mFlags;
+    uint8_t mSocketType;
+    uint8_t mProtocol;
+
+    // Rarely set, so it does not take room inline
+    std::unique_ptr< std::string > mCanonicalName;
+};
+
+
+
+namespace std
+{
+    template <>
+    struct hash< SocketAddress >
+    {
+        size_t operator()( const SocketAddress& socketAddress ) const
+        {
+            return socketAddress.hash();
+        }
+    };
+}
+
+
+
+/**
+ * A receiver of datagrams whose system address is prepared once, for
+ * senders that stream to the same few peers. It is a plain copyable value
+ * of 32 bytes, see Socket::sendTo() and Socket::connect().
+ */
+class Destination
+{
+    public:
+
+    Destination() :
+        mAddressSize( 0 )
+    {
+        memset( &mAddress, 0, sizeof( mAddress ) );
+    }
+
+    explicit Destination( const SocketAddress& socketAddress )
+    {
+        set( socketAddress.getSockaddr(), socketAddress.getSockaddrSize() );
+    }
+
+    Destination( const struct sockaddr* address, socklen_t addressSize )
+    {
+        set( address, addressSize );
+    }
+
+    /**
+     * False when it was not built from an IPv4 or IPv6 address.
+     */
+    bool isValid() const
+    {
+        return mAddressSize != 0;
+    }
+
+    const struct sockaddr* getSockaddr() const
+    {
+        return &mAddress.base;
+    }
+
+    socklen_t getSockaddrSize() const
+    {
+        return mAddressSize;
+    }
+
+    private:
+
+    void set( const struct sockaddr* address, socklen_t addressSize )
+    {
+        memset( &mAddress, 0, sizeof( mAddress ) );
+        mAddressSize = 0;
+
+        if ( ( address->sa_family == AF_INET && addressSize >= sizeof( struct sockaddr_in ) ) ||
+             ( address->sa_family == AF_INET6 && addressSize >= sizeof( struct sockaddr_in6 ) ) )
+        {
+            mAddressSize = address->sa_family == AF_INET ? sizeof( struct sockaddr_in ) : sizeof( struct sockaddr_in6 );
+            memcpy( &mAddress, address, mAddressSize );
+        }
+    }
+
+    union
+    {
+        struct sockaddr base;
+        struct sockaddr_in ipv4;
+        struct sockaddr_in6 ipv6;
+    } mAddress;
+
+    socklen_t mAddressSize;
+};
+
+
+
+/**
+ * This class sends/receives messages to/from sockets.
+ */
+class Socket
+{
+    public:
+
+    /**
+     * Construct an invalid socket, for instance to be assigned later with
+     * the result of ServerSocket::accept().
+     */
+    Socket() :
+        mSocketDescriptor( -1 ),
+        mFamily( SocketFamily::UNSPECIFIED ),
+        mPort( 0 ),
+        mIPv4Address( 0 ),
+        mIPv6FlowInfo( 0 ),
+        mIPv6ScopeId( 0 ),
+        mSendOffload( false ),
+        mReceiveOffload( false ),
+        mZeroCopy( false ),
+        mZeroCopyThreshold( SOCKET_ZEROCOPY_THRESHOLD ),
+        mZeroCopySequence( 0 ),
+        mCoalescing( false ),
+        mCoalesceThreshold( SOCKET_COALESCE_THRESHOLD ),
+        mWriteStart( 0 ),
+        mPushPending( false ),
+        mCoalescedWriteCount( 0 ),
+        mFlushCount( 0 ),
+        mAutoTuning( false ),
+        mMaxTunedBufferSize( 0 ),
+        mTuneBytes( 0 ),
+        mTuneBytesReceived( 0 )
+    {
+        mPipe[0] = -1;
+        mPipe[1] = -1;
+
+        memset( mIPv6Address, 0, sizeof( IPV6ADDRESS ) );
+    }
+
+    /**
+     * Construct a connectionless socket
+     */
+    Socket( SocketFamily family ) :
+        Socket()
+    {
+        SocketResult result;
+
+        openDatagram( family, result );
+    }
+
+    /**
+     * result.error holds the errno value when the socket is invalid.
+     */
+    Socket( SocketFamily family, SocketResult& result ) :
+        Socket()
+    {
+        openDatagram( family, result );
+    }
+
+    Socket( int socketDescriptor, PORT port, IPV4ADDRESS ipv4 ) :
+        mSocketDescriptor( socketDescriptor ),
+        mFamily( SocketFamily::IPV4 ),
+        mPort( port ),
+        mIPv4Address( ipv4 ),
+        mIPv6FlowInfo( 0 ),
+        mIPv6ScopeId( 0 ),
+        mSendOffload( false ),
+        mReceiveOffload( false ),
+        mZeroCopy( false ),
+        mZeroCopyThreshold( SOCKET_ZEROCOPY_THRESHOLD ),
+        mZeroCopySequence( 0 ),
+        mCoalescing( false ),
+        mCoalesceThreshold( SOCKET_COALESCE_THRESHOLD ),
+        mWriteStart( 0 ),
+        mPushPending( false ),
+        mCoalescedWriteCount( 0 ),
+        mFlushCount( 0 ),
+        mAutoTuning( false ),
+        mMaxTunedBufferSize( 0 ),
+        mTuneBytes( 0 ),
+        mTuneBytesReceived( 0 )
+    {
+        mPipe[0] = -1;
+        mPipe[1] = -1;
+
+        memset( mIPv6Address, 0, sizeof( IPV6ADDRESS ) );
+    }
+
+    Socket( int socketDescriptor, PORT port, IPV6ADDRESS ipv6, IPV6FLOWINFO flowInfo, IPV6SCOPEID scopeId ) :
+        mSocketDescriptor( socketDescriptor ),
+        mFamily( SocketFamily::IPV6 ),
+        mPort( port ),
+        mIPv4Address( 0 ),
+        mIPv6FlowInfo( flowInfo ),
+        mIPv6ScopeId( scopeId ),
+        mSendOffload( false ),
+        mReceiveOffload( false ),
+        mZeroCopy( false ),
+        mZeroCopyThreshold( SOCKET_ZEROCOPY_THRESHOLD ),
+        mZeroCopySequence( 0 ),
+        mCoalescing( false ),
+        mCoalesceThreshold( SOCKET_COALESCE_THRESHOLD ),
+        mWriteStart( 0 ),
+        mPushPending( false ),
+        mCoalescedWriteCount( 0 ),
+        mFlushCount( 0 ),
+        mAutoTuning( false ),
+        mMaxTunedBufferSize( 0 ),
+        mTuneBytes( 0 ),
+        mTuneBytesReceived( 0 )
+    {
+        mPipe[0] = -1;
+        mPipe[1] = -1;
+
+        memcpy( mIPv6Address, ipv6, sizeof( IPV6ADDRESS ) );
+    }
+
+    /**
+     * A socket owns its descriptor, so it can be moved but not copied. The
+     * moved-from socket is left invalid.
+     */
+    Socket( const Socket& ) = delete;
+    Socket& operator=( const Socket& ) = delete;
+
+    Socket( Socket&& other )
+    {
+        moveFrom( other );
+    }
+
+    Socket& operator=( Socket&& other )
+    {
+        if ( this != &other )
+        {
+            close();
+            moveFrom( other );
+        }
+
+        return *this;
+    }
+
+    ~Socket()
+    {
+        close();
+    }
+
+    /**
+     * Create a socket for a connected descriptor. The socket owns the
+     * descriptor, which is closed in case of an unknown address family
+     * (the returned socket is invalid then).
+     */
+    static Socket create( int socketDescriptor, const struct sockaddr_storage& address )
+    {
+        if ( address.ss_family == AF_INET )
+        {
+            const struct sockaddr_in* addressIPv4 = reinterpret_cast< const struct sockaddr_in* >( &address );
+
+            return Socket( socketDescriptor, ntohs( addressIPv4->sin_port ), ntohl( addressIPv4->sin_addr.s_addr ) );
+        }
+        else if ( address.ss_family == AF_INET6 )
+        {
+            const struct sockaddr_in6* addressIPv6 = reinterpret_cast< const struct sockaddr_in6* >( &address );
+            IPV6ADDRESS ipv6;
+
+            memcpy( ipv6, addressIPv6->sin6_addr.s6_addr, sizeof( IPV6ADDRESS ) );
+
+            return Socket( socketDescriptor, ntohs( addressIPv6->sin6_port ), ipv6, addressIPv6->sin6_flowinfo, addressIPv6->sin6_scope_id );
+        }
+
+        ::close( socketDescriptor );
+
+        return Socket();
+    }
+
+    bool isValid() const
+    {
+        return mSocketDescriptor != -1;
+    }
+
+    /**
+     * Close the descriptor. It is also closed by the destructor.
+     */
+    void close()
+    {
+        if ( mSocketDescriptor != -1 )
+        {
+            // Writes still buffered by write coalescing are sent when the
+            // socket takes them right away, a stuck peer must not block here
+            if ( mWriteStart != mWriteBuffer.size() )
+            {
+                struct iovec buffer;
+                buffer.iov_base = mWriteBuffer.data() + mWriteStart;
+                buffer.iov_len = mWriteBuffer.size() - mWriteStart;
+
+                writeBuffered( &buffer, 1, MSG_DONTWAIT );
+            }
+
+            ::close( mSocketDescriptor );
+            mSocketDescriptor = -1;
+        }
+
+        mWriteBuffer.clear();
+        mWriteStart = 0;
+
+        if ( mPipe[0] != -1 )
+        {
+            ::close( mPipe[0] );
+            ::close( mPipe[1] );
+            mPipe[0] = -1;
+            mPipe[1] = -1;
+        }
+    }
+
+    int getSocketDescriptor() const
+    {
+        return mSocketDescriptor;
+    }
+    
+    /**
+     * In non-blocking mode send() and receive() return as soon as the socket
+     * is not ready. Use trySend() and tryReceive() to know why they returned.
+     */
+    bool setNonBlocking( bool nonBlocking )
+    {
+        return setDescriptorNonBlocking( mSocketDescriptor, nonBlocking );
+    }
+
+    bool isNonBlocking() const
+    {
+        int flags = fcntl( mSocketDescriptor, F_GETFL, 0 );
+
+        return flags != -1 && ( flags & O_NONBLOCK ) != 0;
+    }
+
+    /**
+     * Counter of this socket, see SocketMetrics for the whole process. It is
+     * always 0 with SOCKET_NO_METRICS.
+     */
+    uint64_t getCounter( SocketCounter counter ) const
+    {
+#ifndef SOCKET_NO_METRICS
+        return mCounters.get( counter );
+#else
+        (void) counter;
+        return 0;
+#endif
+    }
+
+    /**
+     * Read the TCP_INFO statistics of a TCP connection. Returns false in case
+     * of error, for instance on a datagram socket.
+     */
+    bool tcpInfo( TcpInfo& info ) const
+    {
+        SocketKernelTcpInfo kernelInfo;
+        socklen_t infoSize = sizeof( kernelInfo );
+
+        memset( &kernelInfo, 0, sizeof( kernelInfo ) );
+        memset( &info, 0, sizeof( info ) );
+
+        if ( getsockopt( mSocketDescriptor, IPPROTO_TCP, TCP_INFO, &kernelInfo, &infoSize ) == -1 )
+        {
+            return false;
+        }
+
+        info.state = kernelInfo.base.tcpi_state;
+        info.rtt = kernelInfo.base.tcpi_rtt;
+        info.rttVariance = kernelInfo.base.tcpi_rttvar;
+        info.minRtt = kernelInfo.minRtt;
+        info.congestionWindow = kernelInfo.base.tcpi_snd_cwnd;
+        info.sendMss = kernelInfo.base.tcpi_snd_mss;
+        info.retransmits = kernelInfo.base.tcpi_retransmits;
+        info.totalRetransmits = kernelInfo.base.tcpi_total_retrans;
+        info.unacked = kernelInfo.base.tcpi_unacked;
+        info.lost = kernelInfo.base.tcpi_lost;
+        info.notSentBytes = kernelInfo.notSentBytes;
+        info.receiveSpace = kernelInfo.base.tcpi_rcv_space;
+        info.pacingRate = kernelInfo.pacingRate;
+        info.deliveryRate = kernelInfo.deliveryRate;
+        info.bytesAcked = kernelInfo.bytesAcked;
+        info.bytesReceived = kernelInfo.bytesReceived;
+
+        return true;
+    }
+
+    /**
+     * Grow SO_SNDBUF and SO_RCVBUF, every SOCKET_TUNE_INTERVAL bytes sent or
+     * received, to twice the measured bandwidth-delay product, up to
+     * maxBufferSize. Meant for long fat links where the default sizes cap the
+     * throughput.
+     *
+     * Setting a buffer stops the kernel's own tuning of it, which already
+     * grows it up to net.ipv4.tcp_wmem/tcp_rmem[2] (4-6 MB by default), and
+     * the kernel silently clamps the value to net.core.wmem_max/rmem_max
+     * (about 208 KB by default). So a buffer is only set when the product
+     * exceeds what the kernel's tuning reaches, and tuneBuffers() fails with
+     * ENOBUFS, leaving the buffer to the kernel, when it also exceeds the
+     * core maximum. Raise net.core.wmem_max/rmem_max for this mode to help.
+     */
+    void setBufferAutoTuning( bool enable, size_t maxBufferSize = 67108864 )
+    {
+        mAutoTuning = enable;
+        mMaxTunedBufferSize = maxBufferSize;
+        mTuneBytes = 0;
+        mTuneBytesReceived = 0;
+        mTuneTime = std::chrono::steady_clock::now();
+    }
+
+    bool isBufferAutoTuningEnabled() const
+    {
+        return mAutoTuning;
+    }
+
+    /**
+     * Adjust the buffer sizes now, see setBufferAutoTuning(). Returns false
+     * in case of error, or when a buffer needs more than net.core allows.
+     */
+    bool tuneBuffers()
+    {
+        TcpInfo info;
+
+        if ( !tcpInfo( info ) )
+        {
+            return false;
+        }
+
+        // Bytes in flight needed to keep the path busy while sending, and
+        // bytes the peer delivers in a round trip while receiving, from the
+        // rate measured since the previous call
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        uint64_t elapsed = std::chrono::duration_cast< std::chrono::microseconds >( now - mTuneTime ).count();
+        uint64_t sendProduct = info.deliveryRate * info.rtt / 1000000;
+        uint64_t receiveProduct = 0;
+
+        if ( mTuneBytesReceived > 0 && elapsed > 0 && info.bytesReceived > mTuneBytesReceived )
+        {
+            receiveProduct = ( info.bytesReceived - mTuneBytesReceived ) * info.rtt / elapsed;
+        }
+
+        mTuneTime = now;
+        mTuneBytesReceived = info.bytesReceived;
+
+        bool sendTuned = growBuffer( SO_SNDBUF, 2 * sendProduct );
+        bool receiveTuned = growBuffer( SO_RCVBUF, 2 * receiveProduct );
+
+        return sendTuned && receiveTuned;
+    }
+
+    /**
+     * Error of a non-blocking connect, or any other error pending on the
+     * socket. Returns 0 when there is none.
+     */
+    int getPendingError() const
+    {
+        int error = 0;
+        socklen_t errorSize = sizeof( error );
+
+        if ( getsockopt( mSocketDescriptor, SOL_SOCKET, SO_ERROR, &error, &errorSize ) == -1 )
+        {
+            return errno;
+        }
+
+        return error;
+    }
+
+    ssize_t send( const void* buffer, ssize_t size )
+    {
+        SocketResult result = trySend( buffer, size );
+
+        if ( result.status != SocketStatus::OK && result.status != SocketStatus::WOULD_BLOCK )
+        {
+            SocketLog::report( "Socket", "send", result.error );
+            return -1;
+        }
+
+        return result.size;
+    }
+
+    /**
+     * Try to send all size bytes. The status is WOULD_BLOCK when a non-blocking
+     * socket cannot take more data, result.size says how much was sent.
+     */
+    SocketResult trySend( const void* buffer, ssize_t size )
+    {
+        if ( mSocketDescriptor == -1 )
+        {
+            return SocketResult( 0, SocketStatus::FAILURE, EBADF );
+        }
+
+        if ( mCoalescing )
+        {
+            return coalesce( buffer, size );
+        }
+
+        ssize_t totalSentSize = 0;
+        bool sent = false;
+
+        // The first call is always made, a zero-length datagram is valid
+        while ( !sent || totalSentSize < size )
+        {
+            ssize_t sentSize = ::send( mSocketDescriptor, (reinterpret_cast<const char*>(buffer) + totalSentSize), size - totalSentSize, 0 );
+
+            countSend( sentSize, sentSize < size - totalSentSize );
+
+            if ( sentSize == -1 )
+            {
+                if ( errno == EINTR )
+                {
+                    continue;
+                }
+
+                return SocketResult( totalSentSize, errorStatus( errno ), errno );
+            }
+
+            sent = true;
+            totalSentSize += sentSize;
+        }
+
+        countTransferred( totalSentSize );
+
+        return SocketResult( totalSentSize );
+    }
+
+    ssize_t receive( void* buffer, ssize_t size )
+    {
+        if ( mSocketDescriptor != -1 )
+        {
+            ssize_t receivedSize = ::recv( mSocketDescriptor, buffer, size, 0 );
+
+            countReceive( receivedSize );
+            countTransferred( receivedSize );
+
+            return receivedSize;
+        }
+
+        return 0;
+    }
+
+    /**
+     * Receive up to size bytes. The status is CLOSED when the remote side
+     * closed the connection and WOULD_BLOCK when there is nothing to read.
+     */
+    SocketResult tryReceive( void* buffer, ssize_t size )
+    {
+        if ( mSocketDescriptor == -1 )
+        {
+            return SocketResult( 0, SocketStatus::FAILURE, EBADF );
+        }
+
+        ssize_t receivedSize;
+
+        do
+        {
+            receivedSize = ::recv( mSocketDescriptor, buffer, size, 0 );
+            countReceive( receivedSize );
+        }
+        while ( receivedSize == -1 && errno == EINTR );
+
+        if ( receivedSize == -1 )
+        {
+            return SocketResult( 0, errorStatus( errno ), errno );
+        }
+
+        // A zero-length datagram is valid, only a stream reports its end
+        if ( receivedSize == 0 && size > 0 && isStream() )
+        {
+            return SocketResult( 0, SocketStatus::CLOSED );
+        }
+
+        countTransferred( receivedSize );
+
+        return SocketResult( receivedSize );
+    }
+
+    /**
+     * Send several buffers in a single call, without copying them together.
+     * Like send(), it always tries to send all the bytes of all buffers.
+     */
+    ssize_t sendv( const struct iovec* buffers, int count )
+    {
+        SocketResult result = trySendv( buffers, count );
+
+        if ( result.status != SocketStatus::OK && result.status != SocketStatus::WOULD_BLOCK )
+        {
+            SocketLog::report( "Socket", "sendv", result.error );
+            return -1;
+        }
+
+        return result.size;
+    }
+
+    /**
+     * Same as trySend() for several buffers. After a partial write the next
+     * call must start from the byte given by result.size. In write coalescing
+     * mode the buffered writes are flushed first and these buffers are sent
+     * directly.
+     */
+    SocketResult trySendv( const struct iovec* buffers, int count )
+    {
+        if ( mSocketDescriptor == -1 )
+        {
+            return SocketResult( 0, SocketStatus::FAILURE, EBADF );
+        }
+
+        SocketResult result = flush();
+
+        if ( result.status != SocketStatus::OK )
+        {
+            return SocketResult( 0, result.status, result.error );
+        }
+
+        return sendBuffers( buffers, count, 0 );
+    }
+
+    /**
+     * In write coalescing mode send() and trySend() copy small writes into a
+     * buffer, which is sent with a single call when it reaches threshold
+     * bytes, on flush() or by EventLoop::flushAfterDispatch(). TCP_NODELAY is
+     * set so the last segment of a flush is never held by Nagle's algorithm,
+     * while the automatic flushes tell the kernel more data follows
+     * (MSG_MORE, a per call TCP_CORK). Only for stream sockets.
+     *
+     * At most threshold bytes are ever buffered. When a non-blocking socket
+     * cannot take a write that does not fit, trySend() returns WOULD_BLOCK
+     * with the number of bytes it took, like without coalescing. close()
+     * only sends what the socket takes without blocking, call flush() first
+     * to be sure everything was sent.
+     */
+    bool setWriteCoalescing( bool enable, size_t threshold = SOCKET_COALESCE_THRESHOLD )
+    {
+        if ( !enable )
+        {
+            SocketResult result = flush();
+
+            mCoalescing = false;
+
+            return result.status == SocketStatus::OK;
+        }
+
+        int socketType = 0, on = 1, off = 0;
+        socklen_t socketTypeSize = sizeof( socketType );
+
+        if ( getsockopt( mSocketDescriptor, SOL_SOCKET, SO_TYPE, &socketType, &socketTypeSize ) == -1 || socketType != SOCK_STREAM )
+        {
+            SocketLog::report( "Socket", "setWriteCoalescing", socketType == 0 ? errno : EPROTOTYPE );
+            return false;
+        }
+
+        setsockopt( mSocketDescriptor, IPPROTO_TCP, TCP_CORK, &off, sizeof( off ) );
+        setsockopt( mSocketDescriptor, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+
+        mCoalescing = true;
+        mCoalesceThreshold = threshold > 0 ? threshold : 1;
+        mWriteBuffer.reserve( mCoalesceThreshold );
+
+        return true;
+    }
+
+    bool isWriteCoalescingEnabled() const
+    {
+        return mCoalescing;
+    }
+
+    /**
+     * Send the buffered writes and push out any data held back by MSG_MORE.
+     * The status is WOULD_BLOCK while a non-blocking socket still has
+     * buffered data, flush() must be called again when it is writable.
+     */
+    SocketResult flush()
+    {
+        size_t bufferedSize = mWriteBuffer.size() - mWriteStart;
+
+        if ( bufferedSize == 0 )
+        {
+            if ( mPushPending )
+            {
+                // Setting TCP_NODELAY sends the pending partial segment
+                int on = 1;
+
+                setsockopt( mSocketDescriptor, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+                mPushPending = false;
+            }
+
+            return SocketResult();
+        }
+
+        struct iovec buffer;
+        buffer.iov_base = mWriteBuffer.data() + mWriteStart;
+        buffer.iov_len = bufferedSize;
+
+        SocketResult result = writeBuffered( &buffer, 1, 0 );
+
+        if ( result.status == SocketStatus::OK && mWriteStart != mWriteBuffer.size() )
+        {
+            result.status = SocketStatus::WOULD_BLOCK;
+        }
+
+        return result;
+    }
+
+    /**
+     * Bytes written in coalescing mode and not sent yet.
+     */
+    size_t getBufferedWriteSize() const
+    {
+        return mWriteBuffer.size() - mWriteStart;
+    }
+
+    /**
+     * Writes absorbed by the coalescing buffer and calls that sent it. Their
+     * ratio is the number of writes coalesced per system call.
+     */
+    uint64_t getCoalescedWriteCount() const
+    {
+        return mCoalescedWriteCount;
+    }
+
+    uint64_t getFlushCount() const
+    {
+        return mFlushCount;
+    }
+
+    /**
+     * Receive into several buffers, filling them in order. Returns the number
+     * of bytes received or 0 in case the connection was closed.
+     */
+    ssize_t receivev( const struct iovec* buffers, int count )
+    {
+        if ( mSocketDescriptor != -1 )
+        {
+            ssize_t receivedSize = ::readv( mSocketDescriptor, buffers, std::min( count, IOV_MAX ) );
+
+            countReceive( receivedSize );
+            countTransferred( receivedSize );
+
+            return receivedSize;
+        }
+
+        return 0;
+    }
+
+    SocketResult tryReceivev( const struct iovec* buffers, int count )
+    {
+        if ( mSocketDescriptor == -1 )
+        {
+            return SocketResult( 0, SocketStatus::FAILURE, EBADF );
+        }
+
+        ssize_t receivedSize;
+
+        do
+        {
+            receivedSize = ::readv( mSocketDescriptor, buffers, std::min( count, IOV_MAX ) );
+            countReceive( receivedSize );
+        }
+        while ( receivedSize == -1 && errno == EINTR );
+
+        if ( receivedSize == -1 )
+        {
+            return SocketResult( 0, errorStatus( errno ), errno );
+        }
+
+        if ( receivedSize == 0 && isStream() )
+        {
+            for ( int i = 0; i < count; ++i )
+            {
+                if ( buffers[i].iov_len > 0 )
+                {
+                    return SocketResult( 0, SocketStatus::CLOSED );
+                }
+            }
+        }
+
+        countTransferred( receivedSize );
+
+        return SocketResult( receivedSize );
+    }
+
+    static bool setDescriptorNonBlocking( int socketDescriptor, bool nonBlocking )
+    {
+        int flags = fcntl( socketDescriptor, F_GETFL, 0 );
+
+        if ( flags == -1 )
+        {
+            return false;
+        }
+
+        flags = nonBlocking ? ( flags | O_NONBLOCK ) : ( flags & ~O_NONBLOCK );
+
+        return fcntl( socketDescriptor, F_SETFL, flags ) != -1;
+    }
+
+    static SocketStatus errorStatus( int error )
+    {
+        if ( error == EAGAIN || error == EWOULDBLOCK )
+        {
+            return SocketStatus::WOULD_BLOCK;
+        }
+
+        return SocketStatus::FAILURE;
+    }
+    
+    ssize_t sendTo( const SocketAddress& receiver, const void* buffer, ssize_t size )
+    {
+        return sendToAddress( receiver.getSockaddr(), receiver.getSockaddrSize(), buffer, size );
+    }
+
+    /**
+     * Same as sendTo() with an address, without preparing it again for every
+     * datagram.
+     */
+    ssize_t sendTo( const Destination& receiver, const void* buffer, ssize_t size )
+    {
+        return sendToAddress( receiver.getSockaddr(), receiver.getSockaddrSize(), buffer, size );
+    }
+
+    /**
+     * Connect a datagram socket to receiver. Then send(), trySend() and
+     * sendv() send one datagram per call with no address at all, the kernel
+     * skips the route lookup, and only datagrams of receiver are received.
+     * ICMP errors of receiver (ECONNREFUSED) are reported by the next call.
+     */
+    SocketResult connect( const Destination& receiver )
+    {
+        if ( ::connect( mSocketDescriptor, receiver.getSockaddr(), receiver.getSockaddrSize() ) == -1 )
+        {
+            return SocketResult( 0, SocketStatus::FAILURE, errno );
+        }
+
+        return SocketResult();
+    }
+
+    /**
+     * Undo connect() of a datagram socket, so it sends and receives with any
+     * address again.
+     */
+    SocketResult disconnect()
+    {
+        struct sockaddr address;
+        memset( &address, 0, sizeof( address ) );
+        address.sa_family = AF_UNSPEC;
+
+        if ( ::connect( mSocketDescriptor, &address, sizeof( address ) ) == -1 )
+        {
+            return SocketResult( 0, SocketStatus::FAILURE, errno );
+        }
+
+        return SocketResult();
+    }
+    
+    /**
+     * Receive a datagram and fill sender with its origin, so the reply can
+     * go back with sendTo( sender, ... ).
+     */
+    ssize_t receiveFrom( SocketAddress& sender, void* buffer, ssize_t size )
+    {
+        if ( mSocketDescriptor != -1 )
+        {
+            struct sockaddr_storage address;
+            socklen_t addressSize = sizeof( address );
+
+            ssize_t receivedSize = ::recvfrom( mSocketDescriptor, buffer, size, 0, reinterpret_cast< struct sockaddr* >( &address ), &addressSize);
+
+            countReceive( receivedSize );
+
+            if ( receivedSize != -1 )
+            {
+                convertAddress( address, addressSize, sender );
+            }
+
+            return receivedSize;
+        }
+
+        return 0;
+    }
+
+    /**
+     * Send up to count datagrams with a single sendmmsg() call. Datagram i is
+     * buffers[i] and goes to receivers[i]. At most SOCKET_BATCH_SIZE datagrams
+     * are sent per call. Returns the number of datagrams sent or -1 in case of
+     * error.
+     */
+    int sendToBatch( const SocketAddress* receivers, const struct iovec* buffers, int count )
+    {
+        return sendToReceivers( receivers, buffers, count );
+    }
+
+    int sendToBatch( const Destination* receivers, const struct iovec* buffers, int count )
+    {
+        return sendToReceivers( receivers, buffers, count );
+    }
+
+    /**
+     * Receive up to count datagrams with a single recvmmsg() call. It blocks
+     * until the first datagram arrives (unless the socket is non-blocking) and
+     * then takes only the ones already queued. Datagram i is written into
+     * buffers[i], its size into sizes[i] and its origin into senders[i]
+     * (senders might be nullptr). At most SOCKET_BATCH_SIZE datagrams are
+     * received per call. Returns the number of datagrams received or -1 in
+     * case of error.
+     */
+    int receiveFromBatch( SocketAddress* senders, struct iovec* buffers, ssize_t* sizes, int count )
+    {
+        if ( mSocketDescriptor == -1 )
+        {
+            return -1;
+        }
+
+        struct mmsghdr messages[SOCKET_BATCH_SIZE];
+        struct sockaddr_storage addresses[SOCKET_BATCH_SIZE];
+
+        count = std::min( count, SOCKET_BATCH_SIZE );
+
+        for ( int i = 0; i < count; ++i )
+        {
+            memset( &messages[i], 0, sizeof( struct mmsghdr ) );
+            messages[i].msg_hdr.msg_name = &addresses[i];
+            messages[i].msg_hdr.msg_namelen = sizeof( struct sockaddr_storage );
+            messages[i].msg_hdr.msg_iov = &buffers[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int receivedCount;
+
+        do
+        {
+            receivedCount = ::recvmmsg( mSocketDescriptor, messages, count, MSG_WAITFORONE, nullptr );
+        }
+        while ( receivedCount == -1 && errno == EINTR );
+
+        countDatagrams( SocketCounter::RECEIVE_CALLS, SocketCounter::BYTES_RECEIVED, messages, receivedCount );
+
+        for ( int i = 0; i < receivedCount; ++i )
+        {
+            sizes[i] = messages[i].msg_len;
+
+            if ( senders != nullptr )
+            {
+                convertAddress( addresses[i], messages[i].msg_hdr.msg_namelen, senders[i] );
+            }
+        }
+
+        return receivedCount;
+    }
+    
+
+    /**
+     * Enable UDP segmentation offload on a datagram socket. sendToSegmented()
+     * then hands a large buffer to the kernel as a single datagram that is
+     * split in segments further down the stack (GSO), and receiveFromSegmented()
+     * gets consecutive datagrams of a peer coalesced in one buffer (GRO).
+     * Where the kernel lacks support, both fall back to one datagram per
+     * segment. Returns false when no offload is available.
+     */
+    bool setSegmentationOffload( bool enable )
+    {
+        int value = enable ? 1 : 0;
+        int segmentSize = 0;
+
+        // Setting a zero segment size only probes for UDP_SEGMENT support
+        mSendOffload = enable && setsockopt( mSocketDescriptor, SOL_UDP, UDP_SEGMENT, &segmentSize, sizeof( segmentSize ) ) == 0;
+        mReceiveOffload = setsockopt( mSocketDescriptor, SOL_UDP, UDP_GRO, &value, sizeof( value ) ) == 0 && enable;
+
+        return !enable || mSendOffload || mReceiveOffload;
+    }
+
+    bool isSendOffloadEnabled() const
+    {
+        return mSendOffload;
+    }
+
+    bool isReceiveOffloadEnabled() const
+    {
+        return mReceiveOffload;
+    }
+
+    /**
+     * Send buffer as consecutive datagrams of segmentSize bytes (the last one
+     * might be shorter). Returns the number of bytes sent or -1 in case of
+     * error, with errno set. A segment larger than a UDP datagram fails with
+     * EMSGSIZE.
+     */
+    ssize_t sendToSegmented( const SocketAddress& receiver, const void* buffer, ssize_t size, uint16_t segmentSize )
+    {
+        if ( mSocketDescriptor == -1 || segmentSize == 0 )
+        {
+            errno = mSocketDescriptor == -1 ? EBADF : EINVAL;
+            return -1;
+        }
+
+        if ( segmentSize > SOCKET_MAX_SEGMENTED_SIZE )
+        {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        void* address = const_cast< struct sockaddr* >( receiver.getSockaddr() );
+        socklen_t addressSize = receiver.getSockaddrSize();
+
+        const char* data = reinterpret_cast< const char* >( buffer );
+        ssize_t totalSentSize = 0;
+
+        // The kernel takes a limited number of segments per datagram
+        ssize_t maxChunkSize = std::min( SOCKET_MAX_SEGMENTS, SOCKET_MAX_SEGMENTED_SIZE / segmentSize ) * static_cast< ssize_t >( segmentSize );
+
+        while ( mSendOffload && totalSentSize < size )
+        {
+            ssize_t chunkSize = std::min( size - totalSentSize, maxChunkSize );
+
+            struct iovec chunk;
+            chunk.iov_base = const_cast< char* >( data + totalSentSize );
+            chunk.iov_len = chunkSize;
+
+            char control[CMSG_SPACE( sizeof( uint16_t ) )];
+            memset( control, 0, sizeof( control ) );
+
+            struct msghdr message;
+            memset( &message, 0, sizeof( message ) );
+            message.msg_name = address;
+            message.msg_namelen = addressSize;
+            message.msg_iov = &chunk;
+            message.msg_iovlen = 1;
+            message.msg_control = control;
+            message.msg_controllen = sizeof( control );
+
+            struct cmsghdr* header = CMSG_FIRSTHDR( &message );
+            header->cmsg_level = SOL_UDP;
+            header->cmsg_type = UDP_SEGMENT;
+            header->cmsg_len = CMSG_LEN( sizeof( uint16_t ) );
+            memcpy( CMSG_DATA( header ), &segmentSize, sizeof( uint16_t ) );
+
+            ssize_t sentSize = ::sendmsg( mSocketDescriptor, &message, 0 );
+
+            countSend( sentSize, sentSize != -1 && sentSize < chunkSize );
+
+            if ( sentSize == -1 )
+            {
+                if ( errno == EINTR )
+                {
+                    continue;
+                }
+
+                // The kernel or the device cannot segment (EIO without
+                // checksum offload), use the fallback from now on. Other
+                // errors, EINVAL included, are about this call only.
+                if ( errno == EIO || errno == ENOPROTOOPT || errno == EOPNOTSUPP )
+                {
+                    mSendOffload = false;
+                    break;
+                }
+
+                return totalSentSize > 0 ? totalSentSize : -1;
+            }
+
+            totalSentSize += sentSize;
+        }
+
+        while ( totalSentSize < size )
+        {
+            struct mmsghdr messages[SOCKET_BATCH_SIZE];
+            struct iovec segments[SOCKET_BATCH_SIZE];
+            int count = 0;
+            ssize_t offset = totalSentSize;
+
+            while ( count < SOCKET_BATCH_SIZE && offset < size )
+            {
+                segments[count].iov_base = const_cast< char* >( data + offset );
+                segments[count].iov_len = std::min( size - offset, static_cast< ssize_t >( segmentSize ) );
+
+                memset( &messages[count], 0, sizeof( struct mmsghdr ) );
+                messages[count].msg_hdr.msg_name = address;
+                messages[count].msg_hdr.msg_namelen = addressSize;
+                messages[count].msg_hdr.msg_iov = &segments[count];
+                messages[count].msg_hdr.msg_iovlen = 1;
+
+                offset += segments[count].iov_len;
+                count++;
+            }
+
+            int sentCount = ::sendmmsg( mSocketDescriptor, messages, count, 0 );
+
+            countDatagrams( SocketCounter::SEND_CALLS, SocketCounter::BYTES_SENT, messages, sentCount );
+
+            if ( sentCount == -1 )
+            {
+                if ( errno == EINTR )
+                {
+                    continue;
+                }
+
+                return totalSentSize > 0 ? totalSentSize : -1;
+            }
+
+            for ( int i = 0; i < sentCount; ++i )
+            {
+                totalSentSize += messages[i].msg_len;
+            }
+        }
+
+        return totalSentSize;
+    }
+
+    /**
+     * Receive one or more coalesced datagrams of the same sender. segmentSize
+     * is set to the size of each datagram: segment i starts at byte
+     * i * segmentSize and the last one might be shorter. Without offload it
+     * is a single datagram and segmentSize is the number of bytes received.
+     * The buffer should have room for SOCKET_MAX_SEGMENTED_SIZE bytes.
+     * Returns the number of bytes received or -1 in case of error.
+     */
+    ssize_t receiveFromSegmented( SocketAddress& sender, void* buffer, ssize_t size, ssize_t& segmentSize )
+    {
+        if ( mSocketDescriptor == -1 )
+        {
+            return -1;
+        }
+
+        struct sockaddr_storage address;
+
+        struct iovec data;
+        data.iov_base = buffer;
+        data.iov_len = size;
+
+        char control[CMSG_SPACE( sizeof( int ) )];
+
+        struct msghdr message;
+        memset( &message, 0, sizeof( message ) );
+        message.msg_name = &address;
+        message.msg_namelen = sizeof( address );
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof( control );
+
+        ssize_t receivedSize;
+
+        do
+        {
+            receivedSize = ::recvmsg( mSocketDescriptor, &message, 0 );
+            countReceive( receivedSize );
+        }
+        while ( receivedSize == -1 && errno == EINTR );
+
+        if ( receivedSize == -1 )
+        {
+            return -1;
+        }
+
+        segmentSize = receivedSize;
+
+        for ( struct cmsghdr* header = CMSG_FIRSTHDR( &message ); header != nullptr; header = CMSG_NXTHDR( &message, header ) )
+        {
+            if ( header->cmsg_level == SOL_UDP && header->cmsg_type == UDP_GRO )
+            {
+                int coalescedSize;
+                memcpy( &coalescedSize, CMSG_DATA( header ), sizeof( int ) );
+                segmentSize = coalescedSize;
+            }
+        }
+
+        convertAddress( address, message.msg_namelen, sender );
+
+        return receivedSize;
+    }
+
+    /**
+     * Enable zero-copy sends (SO_ZEROCOPY). Sends smaller than threshold bytes
+     * keep being copied. Returns false when the kernel does not support it.
+     */
+    bool setZeroCopy( bool enable, ssize_t threshold = SOCKET_ZEROCOPY_THRESHOLD )
+    {
+        int value = enable ? 1 : 0;
+
+        mZeroCopyThreshold = threshold;
+        mZeroCopy = setsockopt( mSocketDescriptor, SOL_SOCKET, SO_ZEROCOPY, &value, sizeof( value ) ) == 0 && enable;
+
+        return mZeroCopy || !enable;
+    }
+
+    bool isZeroCopyEnabled() const
+    {
+        return mZeroCopy;
+    }
+
+    /**
+     * Same as send(), but the kernel reads the pages of buffer directly. The
+     * buffer must not be modified or freed until every sequence number in
+     * range was reported by readZeroCopyCompletions(). When range.count is 0
+     * the data was copied and buffer can be reused at once.
+     */
+    ssize_t sendZeroCopy( const void* buffer, ssize_t size, ZeroCopyRange& range )
+    {
+        range = ZeroCopyRange();
+
+        if ( !mZeroCopy || size < mZeroCopyThreshold )
+        {
+            return send( buffer, size );
+        }
+
+        SocketResult flushed = flush();
+
+        if ( flushed.status != SocketStatus::OK )
+        {
+            return flushed.status == SocketStatus::WOULD_BLOCK ? 0 : -1;
+        }
+
+        range.first = mZeroCopySequence;
+
+        ssize_t totalSentSize = 0;
+
+        while ( totalSentSize < size )
+        {
+            ssize_t sentSize = ::send( mSocketDescriptor, (reinterpret_cast<const char*>(buffer) + totalSentSize), size - totalSentSize, MSG_ZEROCOPY );
+
+            countSend( sentSize, sentSize < size - totalSentSize );
+
+            if ( sentSize == -1 )
+            {
+                if ( errno == EINTR )
+                {
+                    continue;
+                }
+
+                // Too many notifications not read yet, copy the rest
+                if ( errno == ENOBUFS )
+                {
+                    ssize_t copiedSize = send( reinterpret_cast<const char*>(buffer) + totalSentSize, size - totalSentSize );
+
+                    return copiedSize == -1 ? -1 : totalSentSize + copiedSize;
+                }
+
+                if ( errno == EAGAIN || errno == EWOULDBLOCK )
+                {
+                    return totalSentSize;
+                }
+
+                SocketLog::report( "Socket", "sendZeroCopy", errno );
+                return -1;
+            }
+
+            // Every successful call consumes one sequence number
+            mZeroCopySequence++;
+            range.count++;
+            totalSentSize += sentSize;
+        }
+
+        return totalSentSize;
+    }
+
+    /**
+     * Read the notifications of finished zero-copy sends, without blocking.
+     * onComplete( first, last, copied ) is called for each finished range of
+     * sequence numbers; copied means the kernel fell back to copying them,
+     * in which case zero-copy is not worth using on this route. They arrive
+     * as an error condition on the socket (POLLERR). Returns the number of
+     * notifications read or -1 in case of error.
+     */
+    int readZeroCopyCompletions( const std::function< void( uint32_t first, uint32_t last, bool copied ) >& onComplete )
+    {
+        int count = 0;
+
+        while ( true )
+        {
+            char control[CMSG_SPACE( sizeof( struct sock_extended_err ) + sizeof( struct sockaddr_in6 ) )];
+
+            struct msghdr message;
+            memset( &message, 0, sizeof( message ) );
+            message.msg_control = control;
+            message.msg_controllen = sizeof( control );
+
+            if ( ::recvmsg( mSocketDescriptor, &message, MSG_ERRQUEUE | MSG_DONTWAIT ) == -1 )
+            {
+                if ( errno == EINTR )
+                {
+                    continue;
+                }
+
+                return ( errno == EAGAIN || errno == EWOULDBLOCK ) ? count : -1;
+            }
+
+            for ( struct cmsghdr* header = CMSG_FIRSTHDR( &message ); header != nullptr; header = CMSG_NXTHDR( &message, header ) )
+            {
+                bool isError = ( header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR ) ||
+                               ( header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR );
+
+                if ( !isError )
+                {
+                    continue;
+                }
+
+                struct sock_extended_err error;
+                memcpy( &error, CMSG_DATA( header ), sizeof( error ) );
+
+                if ( error.ee_origin == SO_EE_ORIGIN_ZEROCOPY && error.ee_errno == 0 )
+                {
+                    onComplete( error.ee_info, error.ee_data, ( error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED ) != 0 );
+                    count++;
+                }
+            }
+        }
+    }
+
+    /**
+     * Send length bytes of a file starting at offset, without copying them
+     * through user space. Like send(), it always tries to send everything and
+     * returns the number of bytes sent or -1 in case of error.
+     */
+    ssize_t sendFile( int fileDescriptor, off_t offset, size_t length )
+    {
+        SocketResult result = trySendFile( fileDescriptor, offset, length );
+
+        if ( result.status != SocketStatus::OK && result.status != SocketStatus::WOULD_BLOCK )
+        {
+            SocketLog::report( "Socket", "sendFile", result.error );
+            return -1;
+        }
+
+        return result.size;
+    }
+
+    /**
+     * Same as trySend() for a file. After a partial write the transfer
+     * continues at offset + result.size. The status is CLOSED when the file
+     * ends before length bytes.
+     */
+    SocketResult trySendFile( int fileDescriptor, off_t offset, size_t length )
+    {
+        if ( mSocketDescriptor == -1 )
+        {
+            return SocketResult( 0, SocketStatus::FAILURE, EBADF );
+        }
+
+        SocketResult result = flush();
+
+        if ( result.status != SocketStatus::OK )
+        {
+            return SocketResult( 0, result.status, result.error );
+        }
+
+        ssize_t totalSentSize = 0;
+
+        while ( static_cast< size_t >( totalSentSize ) < length )
+        {
+            ssize_t sentSize = ::sendfile( mSocketDescriptor, fileDescriptor, &offset, length - totalSentSize );
+
+            countSend( sentSize, sentSize != -1 && static_cast< size_t >( sentSize ) < length - totalSentSize );
+
+            if ( sentSize == -1 )
+            {
+                if ( errno == EINTR )
+                {
+                    continue;
+                }
+
+                return SocketResult( totalSentSize, errorStatus( errno ), errno );
+            }
+
+            if ( sentSize == 0 )
+            {
+                return SocketResult( totalSentSize, SocketStatus::CLOSED );
+            }
+
+            totalSentSize += sentSize;
+            countTransferred( sentSize );
+        }
+
+        return SocketResult( totalSentSize );
+    }
+
+    /**
+     * Receive length bytes and write them into a file starting at offset. The
+     * data is spliced through a pipe, so it never passes through user space.
+     * Returns the number of bytes written, which is smaller than length when
+     * the connection was closed or a non-blocking socket has nothing more to
+     * read, or -1 in case of error.
+     */
+    ssize_t receiveToFile( int fileDescriptor, off_t offset, size_t length )
+    {
+        SocketResult result = tryReceiveToFile( fileDescriptor, offset, length );
+
+        if ( result.status == SocketStatus::FAILURE )
+        {
+            SocketLog::report( "Socket", "receiveToFile", result.error );
+            return -1;
+        }
+
+        return result.size;
+    }
+
+    SocketResult tryReceiveToFile( int fileDescriptor, off_t offset, size_t length )
+    {
+        if ( mSocketDescriptor == -1 )
+        {
+            return SocketResult( 0, SocketStatus::FAILURE, EBADF );
+        }
+
+        if ( mPipe[0] == -1 && pipe2( mPipe, O_CLOEXEC ) == -1 )
+        {
+            return SocketResult( 0, SocketStatus::FAILURE, errno );
+        }
+
+        ssize_t totalWrittenSize = 0;
+
+        while ( static_cast< size_t >( totalWrittenSize ) < length )
+        {
+            ssize_t receivedSize = ::splice( mSocketDescriptor, nullptr, mPipe[1], nullptr, length - totalWrittenSize, SPLICE_F_MOVE | SPLICE_F_MORE );
+
+            countReceive( receivedSize );
+
+            if ( receivedSize == -1 )
+            {
+                if ( errno == EINTR )
+                {
+                    continue;
+                }
+
+                return SocketResult( totalWrittenSize, errorStatus( errno ), errno );
+            }
+
+            if ( receivedSize == 0 )
+            {
+                return SocketResult( totalWrittenSize, SocketStatus::CLOSED );
+            }
+
+            countTransferred( receivedSize );
+
+            // Drain the pipe completely, so it is empty for the next call
+            while ( receivedSize > 0 )
+            {
+                ssize_t writtenSize = ::splice( mPipe[0], nullptr, fileDescriptor, &offset, receivedSize, SPLICE_F_MOVE | SPLICE_F_MORE );
+
+                if ( writtenSize == -1 )
+                {
+                    if ( errno == EINTR )
+                    {
+                        continue;
+                    }
+
+                    // The data left in the pipe is lost, start with a new one
+                    int error = errno;
+                    ::close( mPipe[0] );
+                    ::close( mPipe[1] );
+                    mPipe[0] = mPipe[1] = -1;
+
+                    return SocketResult( totalWrittenSize, SocketStatus::FAILURE, error );
+                }
+
+                receivedSize -= writtenSize;
+                totalWrittenSize += writtenSize;
+            }
+        }
+
+        return SocketResult( totalWrittenSize );
+    }
+
+    private:
+
+    ssize_t sendToAddress( const struct sockaddr* address, socklen_t addressSize, const void* buffer, ssize_t size )
+    {
+        ssize_t totalSentSize = -1;
+
+        if ( mSocketDescriptor != -1 )
+        {
+            totalSentSize = ::sendto( mSocketDescriptor, buffer, size, 0, address, addressSize );
+            countSend( totalSentSize, totalSentSize != -1 && totalSentSize < size );
+
+            if ( totalSentSize != - 1 )
+            {
+                ssize_t remainingSize = size - totalSentSize;
+
+                while ( remainingSize > 0 )
+                {
+                    ssize_t sentSize = ::sendto( mSocketDescriptor, (reinterpret_cast<const char*>(buffer) + totalSentSize), remainingSize, 0, address, addressSize );
+                    countSend( sentSize, sentSize != -1 && sentSize < remainingSize );
+
+                    if ( sentSize != -1 )
+                    {
+                        totalSentSize += sentSize;
+                        remainingSize = size - totalSentSize;
+                    }
+                    else
+                    {
+                        remainingSize = -1;
+                    }
+                }
+            }
+        }
+
+        return totalSentSize;
+    }
+
+    // Receiver is SocketAddress or Destination, their addresses are used in place
+    template < class Receiver >
+    int sendToReceivers( const Receiver* receivers, const struct iovec* buffers, int count )
+    {
+        if ( mSocketDescriptor == -1 )
+        {
+            return -1;
+        }
+
+        struct mmsghdr messages[SOCKET_BATCH_SIZE];
+
+        count = std::min( count, SOCKET_BATCH_SIZE );
+
+        for ( int i = 0; i < count; ++i )
+        {
+            memset( &messages[i], 0, sizeof( struct mmsghdr ) );
+            messages[i].msg_hdr.msg_name = const_cast< struct sockaddr* >( receivers[i].getSockaddr() );
+            messages[i].msg_hdr.msg_namelen = receivers[i].getSockaddrSize();
+            messages[i].msg_hdr.msg_iov = const_cast< struct iovec* >( &buffers[i] );
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int sentCount;
+
+        do
+        {
+            sentCount = ::sendmmsg( mSocketDescriptor, messages, count, 0 );
+        }
+        while ( sentCount == -1 && errno == EINTR );
+
+        countDatagrams( SocketCounter::SEND_CALLS, SocketCounter::BYTES_SENT, messages, sentCount );
+
+        return sentCount;
+    }
+        
+    bool isStream() const
+    {
+        int socketType = 0;
+        socklen_t socketTypeSize = sizeof( socketType );
+
+        return getsockopt( mSocketDescriptor, SOL_SOCKET, SO_TYPE, &socketType, &socketTypeSize ) == 0 && socketType == SOCK_STREAM;
+    }
+
+    // addressSize is the one returned by the kernel, 0 when it gave no address
+    void convertAddress( const struct sockaddr_storage& address, socklen_t addressSize, SocketAddress& socketAddress )
+    {
+        socketAddress.setSocketType( SocketType::DATAGRAM );
+        socketAddress.setSockaddr( reinterpret_cast< const struct sockaddr* >( &address ), addressSize );
+    }
+
+    /**
+     * Buffer a write, or send it together with the buffered data when the
+     * threshold is reached. What a non-blocking socket does not take is
+     * buffered only when it fits below the threshold, otherwise the result
+     * is WOULD_BLOCK with the bytes of this write that were sent.
+     */
+    SocketResult coalesce( const void* buffer, ssize_t size )
+    {
+        const char* data = reinterpret_cast< const char* >( buffer );
+        size_t bufferedSize = mWriteBuffer.size() - mWriteStart;
+
+        mCoalescedWriteCount++;
+
+        if ( bufferedSize + size < mCoalesceThreshold )
+        {
+            appendWrite( data, size );
+            return SocketResult( size );
+        }
+
+        // Large writes are not copied, they go in the same call as the
+        // buffered data
+        struct iovec buffers[2];
+        buffers[0].iov_base = mWriteBuffer.data() + mWriteStart;
+        buffers[0].iov_len = bufferedSize;
+        buffers[1].iov_base = const_cast< char* >( data );
+        buffers[1].iov_len = size;
+
+        SocketResult result = writeBuffered( buffers, 2, MSG_MORE );
+        size_t sentSize = static_cast< size_t >( result.size ) > bufferedSize ? result.size - bufferedSize : 0;
+
+        if ( result.status != SocketStatus::OK && result.status != SocketStatus::WOULD_BLOCK )
+        {
+            return SocketResult( sentSize, result.status, result.error );
+        }
+
+        size_t remainingSize = size - sentSize;
+
+        if ( remainingSize > 0 && getBufferedWriteSize() + remainingSize >= mCoalesceThreshold )
+        {
+            return SocketResult( sentSize, SocketStatus::WOULD_BLOCK, EAGAIN );
+        }
+
+        // A small rest waits for flush()
+        appendWrite( data + sentSize, remainingSize );
+
+        return SocketResult( size );
+    }
+
+    void appendWrite( const char* data, size_t size )
+    {
+        if ( size == 0 )
+        {
+            return;
+        }
+
+        // Compacting only past the middle keeps appends amortized O(1)
+        if ( mWriteStart > 0 && mWriteStart >= mWriteBuffer.size() / 2 )
+        {
+            mWriteBuffer.erase( mWriteBuffer.begin(), mWriteBuffer.begin() + mWriteStart );
+            mWriteStart = 0;
+        }
+
+        mWriteBuffer.insert( mWriteBuffer.end(), data, data + size );
+    }
+
+    /**
+     * Send buffers, the first one starting at mWriteStart, and drop from the
+     * coalescing buffer what was sent.
+     */
+    SocketResult writeBuffered( const struct iovec* buffers, int count, int flags )
+    {
+        SocketResult result = sendBuffers( buffers, count, flags );
+
+        mFlushCount++;
+        mWriteStart += std::min( static_cast< size_t >( result.size ), buffers[0].iov_len );
+
+        if ( mWriteStart == mWriteBuffer.size() )
+        {
+            mWriteBuffer.clear();
+            mWriteStart = 0;
+        }
+
+        mPushPending = ( flags & MSG_MORE ) != 0;
+
+        return result;
+    }
+
+    void count( SocketCounter counter, uint64_t value )
+    {
+#ifndef SOCKET_NO_METRICS
+        mCounters.add( counter, value );
+        SocketMetrics::add( counter, value );
+#else
+        (void) counter;
+        (void) value;
+#endif
+    }
+
+    // A send system call, partial when it took only part of the data
+    void countSend( ssize_t sentSize, bool partial )
+    {
+        count( SocketCounter::SEND_CALLS, 1 );
+
+        if ( sentSize == -1 )
+        {
+            countError( errno );
+            return;
+        }
+
+        count( SocketCounter::BYTES_SENT, sentSize );
+
+        if ( partial )
+        {
+            count( SocketCounter::PARTIAL_SENDS, 1 );
+        }
+    }
+
+    void countReceive( ssize_t receivedSize )
+    {
+        count( SocketCounter::RECEIVE_CALLS, 1 );
+
+        if ( receivedSize == -1 )
+        {
+            countError( errno );
+            return;
+        }
+
+        count( SocketCounter::BYTES_RECEIVED, receivedSize );
+    }
+
+    // A sendmmsg() or recvmmsg() call that transferred messageCount datagrams
+    void countDatagrams( SocketCounter calls, SocketCounter bytes, const struct mmsghdr* messages, int messageCount )
+    {
+        count( calls, 1 );
+
+        if ( messageCount == -1 )
+        {
+            countError( errno );
+            return;
+        }
+
+        uint64_t size = 0;
+
+        for ( int i = 0; i < messageCount; ++i )
+        {
+            size += messages[i].msg_len;
+        }
+
+        count( bytes, size );
+    }
+
+    // Interrupted calls are retried, so they are not errors
+    void countError( int error )
+    {
+        if ( error != EINTR )
+        {
+            count( errorStatus( error ) == SocketStatus::WOULD_BLOCK ? SocketCounter::WOULD_BLOCKS : SocketCounter::ERRORS, 1 );
+        }
+    }
+
+    void countTransferred( ssize_t size )
+    {
+        if ( mAutoTuning && size > 0 && ( mTuneBytes += size ) >= SOCKET_TUNE_INTERVAL )
+        {
+            mTuneBytes = 0;
+            tuneBuffers();
+        }
+    }
+
+    /**
+     * Set a buffer to size bytes when the kernel's tuning cannot reach it.
+     * Sizes above the net.core maximum would be clamped, so they are reported
+     * with ENOBUFS and not set.
+     */
+    bool growBuffer( int option, uint64_t size )
+    {
+        uint64_t coreLimit, autoTuneLimit;
+        int currentSize = 0;
+        socklen_t optionSize = sizeof( currentSize );
+
+        size = std::min< uint64_t >( size, std::min< uint64_t >( mMaxTunedBufferSize, INT_MAX ) );
+        getBufferLimits( option == SO_SNDBUF, coreLimit, autoTuneLimit );
+
+        // Limits not read yet (or no procfs) leave the buffer to the kernel
+        if ( size <= autoTuneLimit || coreLimit == 0 )
+        {
+            return true;
+        }
+
+        if ( getsockopt( mSocketDescriptor, SOL_SOCKET, option, &currentSize, &optionSize ) == -1 )
+        {
+            return false;
+        }
+
+        if ( size <= static_cast< uint64_t >( currentSize ) )
+        {
+            return true;
+        }
+
+        // The kernel doubles the value for its bookkeeping overhead, and
+        // reports the doubled one
+        uint64_t value = size / 2;
+
+        if ( value > coreLimit )
+        {
+            SocketLog::report( "Socket", "tuneBuffers", ENOBUFS );
+            return false;
+        }
 
-    Socket( int socketDescriptor, PORT port, IPV6ADDRESS ipv6, IPV6FLOWINFO flowInfo, IPV6SCOPEID scopeId ) :
-        mSocketDescriptor( socketDescriptor ),
-        mFamily( SocketFamily::IPV6 ),
-        mPort( port ),
-        mIPv4Address( 0 ),
-        mIPv6FlowInfo( flowInfo ),
-        mIPv6ScopeId( scopeId )
-    {
-        memcpy( mIPv6Address, ipv6, sizeof( IPV6ADDRESS ) );
-    }
+        int intValue = static_cast< int >( value );
 
-    ~Socket()
-    {
-        ::close( mSocketDescriptor );
+        return setsockopt( mSocketDescriptor, SOL_SOCKET, option, &intValue, sizeof( intValue ) ) == 0;
     }
-    
-    ssize_t send( const void* buffer, ssize_t size )
+
+    /**
+     * net.core.wmem_max/rmem_max and net.ipv4.tcp_wmem/tcp_rmem[2], shared by
+     * every socket and read again at most once per SOCKET_SYSCTL_REFRESH
+     * milliseconds, so tuning does not open procfs files each time.
+     */
+    static void getBufferLimits( bool send, uint64_t& coreLimit, uint64_t& autoTuneLimit )
     {
-        ssize_t totalSentSize = -1;
+        // Send core, send autotuning, receive core, receive autotuning
+        static std::atomic< uint64_t > limits[4];
+        static std::atomic< int64_t > refreshTime( 0 );
 
-        if ( mSocketDescriptor != -1 )
-        {
-            totalSentSize = ::send( mSocketDescriptor, buffer, size, 0 );
-            
-            if ( totalSentSize != - 1 )
-            {
-                ssize_t remainingSize = size - totalSentSize;
+        int64_t now = std::chrono::duration_cast< std::chrono::milliseconds >( std::chrono::steady_clock::now().time_since_epoch() ).count();
+        int64_t nextRefresh = refreshTime.load( std::memory_order_acquire );
 
-                while ( remainingSize > 0 )
-                {
-                    ssize_t sentSize = ::send( mSocketDescriptor, (reinterpret_cast<const char*>(buffer) + totalSentSize), remainingSize, 0 );
-                    
-                    if ( sentSize != -1 )
-                    {
-                        totalSentSize += sentSize;
-                        remainingSize = size - totalSentSize;
-                    }
-                    else
-                    {
-                        remainingSize = -1;
-                    }
-                }
-            }
-            
-            if ( totalSentSize == - 1 )
-            {
-                std::cerr << "Socket error: send(). " << strerror(errno) << "\n";
-            }
+        // Only the thread that moves the refresh time reads the files
+        if ( now >= nextRefresh && refreshTime.compare_exchange_strong( nextRefresh, now + SOCKET_SYSCTL_REFRESH ) )
+        {
+            limits[0].store( readSysctl( "/proc/sys/net/core/wmem_max", 0 ), std::memory_order_relaxed );
+            limits[1].store( readSysctl( "/proc/sys/net/ipv4/tcp_wmem", 2 ), std::memory_order_relaxed );
+            limits[2].store( readSysctl( "/proc/sys/net/core/rmem_max", 0 ), std::memory_order_relaxed );
+            limits[3].store( readSysctl( "/proc/sys/net/ipv4/tcp_rmem", 2 ), std::memory_order_relaxed );
         }
 
-        return totalSentSize;
+        coreLimit = limits[send ? 0 : 2].load( std::memory_order_relaxed );
+        autoTuneLimit = limits[send ? 1 : 3].load( std::memory_order_relaxed );
     }
-    
-    ssize_t receive( void* buffer, ssize_t size )
+
+    // Field index of a sysctl file with several numbers, 0 when unreadable
+    static uint64_t readSysctl( const char* path, int index )
     {
-        if ( mSocketDescriptor != -1 )
+        unsigned long long values[3] = { 0, 0, 0 };
+        FILE* file = fopen( path, "r" );
+
+        if ( file == nullptr )
         {
-            return ::recv( mSocketDescriptor, buffer, size, 0 );
+            return 0;
         }
 
-        return 0;
+        int count = fscanf( file, "%llu %llu %llu", &values[0], &values[1], &values[2] );
+        fclose( file );
+
+        return index < count ? values[index] : 0;
     }
-    
-    ssize_t sendTo( const SocketAddress& receiver, const void* buffer, ssize_t size )
+
+    // Send all the bytes of buffers, see trySendv()
+    SocketResult sendBuffers( const struct iovec* buffers, int count, int flags )
     {
-        ssize_t totalSentSize = -1;
+        ssize_t totalSentSize = 0;
+        int index = 0;
+        size_t offset = 0;
 
-        if ( mSocketDescriptor != -1 )
+        while ( index < count && buffers[index].iov_len == 0 )
         {
-            struct sockaddr address;
-            size_t addressSize;
-            
-            convertAddress( receiver, address, addressSize );
-            
-            totalSentSize = ::sendto( mSocketDescriptor, buffer, size, 0, &address, addressSize );
-            
-            if ( totalSentSize != - 1 )
+            index++;
+        }
+
+        while ( index < count )
+        {
+            ssize_t sentSize;
+
+            if ( offset > 0 )
             {
-                ssize_t remainingSize = size - totalSentSize;
+                // The caller's array is never modified, so the rest of a
+                // partially sent buffer goes alone
+                sentSize = ::send( mSocketDescriptor, reinterpret_cast<const char*>( buffers[index].iov_base ) + offset, buffers[index].iov_len - offset, flags );
+            }
+            else
+            {
+                struct msghdr message;
+                memset( &message, 0, sizeof( message ) );
+                message.msg_iov = const_cast< struct iovec* >( buffers + index );
+                message.msg_iovlen = std::min( count - index, IOV_MAX );
 
-                while ( remainingSize > 0 )
+                sentSize = ::sendmsg( mSocketDescriptor, &message, flags );
+            }
+
+            if ( sentSize == -1 )
+            {
+                countSend( sentSize, false );
+
+                if ( errno == EINTR )
                 {
-                    ssize_t sentSize = ::sendto( mSocketDescriptor, (reinterpret_cast<const char*>(buffer) + totalSentSize), remainingSize, 0, &address, addressSize );
-                    
-                    if ( sentSize != -1 )
-                    {
-                        totalSentSize += sentSize;
-                        remainingSize = size - totalSentSize;
-                    }
-                    else
-                    {
-                        remainingSize = -1;
-                    }
+                    continue;
                 }
+
+                return SocketResult( totalSentSize, errorStatus( errno ), errno );
             }
-        }
 
-        return totalSentSize;
-    }
-    
-    ssize_t receiveFrom( const SocketAddress& sender, void* buffer, ssize_t size )
-    {
-        if ( mSocketDescriptor != -1 )
-        {
-            struct sockaddr address;
-            socklen_t addressSize;
-            
-            convertAddress( sender, address, addressSize );
+            totalSentSize += sentSize;
+
+            // Advance across the buffers that were completely sent
+            size_t remaining = static_cast< size_t >( sentSize );
+
+            while ( index < count && remaining >= buffers[index].iov_len - offset )
+            {
+                remaining -= buffers[index].iov_len - offset;
+                offset = 0;
+                index++;
+            }
+
+            offset += remaining;
 
-            return ::recvfrom( mSocketDescriptor, buffer, size, 0, &address, &addressSize);
+            countSend( sentSize, index < count );
         }
 
-        return 0;
-    }
-    
+        countTransferred( totalSentSize );
 
-    private:
-        
-    void convertAddress( const SocketAddress& socketAddress, struct sockaddr& address, socklen_t& addressSize )
-    {
-        size_t size;
-        convertAddress( socketAddress, address, size );
-        addressSize = static_cast<socklen_t>( size );
+        return SocketResult( totalSentSize );
     }
-    
-    void convertAddress( const SocketAddress& socketAddress, struct sockaddr& address, size_t& addressSize )
-    {
-        memset( &address, 0, sizeof( sockaddr ) );
 
-        int family = AF_UNSPEC;
+    void openDatagram( SocketFamily family, SocketResult& result )
+    {
+        int socketFamily = family == SocketFamily::IPV6 ? AF_INET6 : AF_INET;
 
-        SocketParameterConverter::getParam( socketAddress.getFamily(), family );
+        mFamily = family;
+        mSocketDescriptor = socket( socketFamily, SOCK_DGRAM, 0 );
 
-        if ( socketAddress.getFamily() == SocketFamily::IPV4 )
+        if ( mSocketDescriptor == -1 )
         {
-            addressSize = sizeof( sockaddr_in );
-            struct sockaddr_in* addressIPv4 = reinterpret_cast< struct sockaddr_in* >( &address );
-            IPV4ADDRESS ipv4 = 0;
-
-            socketAddress.getIPv4Address( ipv4 );
-
-            addressIPv4->sin_family = family;
-            addressIPv4->sin_port = htons( socketAddress.getPort() );
-            addressIPv4->sin_addr.s_addr = htonl( ipv4 );
+            result = SocketResult( 0, SocketStatus::FAILURE, errno );
+            SocketLog::report( "Socket", "socket", result.error );
+            return;
         }
-        else
-        {
-            addressSize = sizeof( sockaddr_in6 );
-            struct sockaddr_in6* addressIPv6 = reinterpret_cast< struct sockaddr_in6* >( &address );
-            IPV6ADDRESS ipv6;
 
-            socketAddress.getIPv6Address( ipv6 );
+        result = SocketResult();
+    }
 
-            addressIPv6->sin6_family = family;
-            addressIPv6->sin6_port = htons( socketAddress.getPort() );
-            addressIPv6->sin6_flowinfo = socketAddress.getIPv6FlowInfo();
-            memcpy( addressIPv6->sin6_addr.s6_addr, ipv6, sizeof( IPV6ADDRESS ) );
-            addressIPv6->sin6_scope_id = socketAddress.getIPv6ScopeId();
-        }
+    // Take over the state of other, which is left without descriptors
+    void moveFrom( Socket& other )
+    {
+        mSocketDescriptor = other.mSocketDescriptor;
+        mFamily = other.mFamily;
+        mPort = other.mPort;
+        mIPv4Address = other.mIPv4Address;
+        memcpy( mIPv6Address, other.mIPv6Address, sizeof( IPV6ADDRESS ) );
+        mIPv6FlowInfo = other.mIPv6FlowInfo;
+        mIPv6ScopeId = other.mIPv6ScopeId;
+        mSendOffload = other.mSendOffload;
+        mReceiveOffload = other.mReceiveOffload;
+        mZeroCopy = other.mZeroCopy;
+        mZeroCopyThreshold = other.mZeroCopyThreshold;
+        mZeroCopySequence = other.mZeroCopySequence;
+        mPipe[0] = other.mPipe[0];
+        mPipe[1] = other.mPipe[1];
+        mCoalescing = other.mCoalescing;
+        mCoalesceThreshold = other.mCoalesceThreshold;
+        mWriteBuffer = std::move( other.mWriteBuffer );
+        mWriteStart = other.mWriteStart;
+        mPushPending = other.mPushPending;
+        mCoalescedWriteCount = other.mCoalescedWriteCount;
+        mFlushCount = other.mFlushCount;
+        mAutoTuning = other.mAutoTuning;
+        mMaxTunedBufferSize = other.mMaxTunedBufferSize;
+        mTuneBytes = other.mTuneBytes;
+        mTuneBytesReceived = other.mTuneBytesReceived;
+        mTuneTime = other.mTuneTime;
+#ifndef SOCKET_NO_METRICS
+        mCounters = other.mCounters;
+#endif
+
+        other.mSocketDescriptor = -1;
+        other.mPipe[0] = -1;
+        other.mPipe[1] = -1;
+        other.mWriteBuffer.clear();
+        other.mWriteStart = 0;
     }
 
     int mSocketDescriptor;
@@ -731,6 +3242,37 @@ class Socket
     IPV6ADDRESS mIPv6Address;
     IPV6FLOWINFO mIPv6FlowInfo;
     IPV6SCOPEID mIPv6ScopeId;
+
+    bool mSendOffload;
+    bool mReceiveOffload;
+
+    bool mZeroCopy;
+    ssize_t mZeroCopyThreshold;
+    uint32_t mZeroCopySequence;
+
+    // Used by receiveToFile() to splice from the socket into a file
+    int mPipe[2];
+
+    // Write coalescing, the data not sent yet starts at mWriteStart
+    bool mCoalescing;
+    size_t mCoalesceThreshold;
+    std::vector< char > mWriteBuffer;
+    size_t mWriteStart;
+    bool mPushPending;
+    uint64_t mCoalescedWriteCount;
+    uint64_t mFlushCount;
+
+    // Buffer auto-tuning, mTuneBytes counts up to SOCKET_TUNE_INTERVAL and
+    // the receive rate is measured from the previous tuning
+    bool mAutoTuning;
+    size_t mMaxTunedBufferSize;
+    uint64_t mTuneBytes;
+    uint64_t mTuneBytesReceived;
+    std::chrono::steady_clock::time_point mTuneTime;
+
+#ifndef SOCKET_NO_METRICS
+    SocketCounters mCounters;
+#endif
 };
 
 
@@ -741,8 +3283,12 @@ class SocketHandler
 {
     public:
     
-    SocketHandler() : mSocketDescriptor(-1)
+    SocketHandler() : mSocketDescriptor(-1), mNonBlocking(false)
     {
+        mLastError.component = "SocketHandler";
+        mLastError.operation = "";
+        mLastError.error = 0;
+        mLastError.addressInfo = false;
     }
     
     virtual ~SocketHandler()
@@ -763,19 +3309,49 @@ class SocketHandler
 
         return nullptr;
     }
+
+    int getSocketDescriptor() const
+    {
+        return mSocketDescriptor;
+    }
+
+    /**
+     * In non-blocking mode accept() and connect() return immediately, and the
+     * sockets they create are non-blocking as well.
+     */
+    bool setNonBlocking( bool nonBlocking )
+    {
+        mNonBlocking = nonBlocking;
+
+        if ( mSocketDescriptor != -1 )
+        {
+            return Socket::setDescriptorNonBlocking( mSocketDescriptor, nonBlocking );
+        }
+
+        return true;
+    }
+
+    bool isNonBlocking() const
+    {
+        return mNonBlocking;
+    }
     
     void close()
     {
-        ::close( mSocketDescriptor );
-        mSocketDescriptor = -1;
+        if ( mSocketDescriptor != -1 )
+        {
+            ::close( mSocketDescriptor );
+            mSocketDescriptor = -1;
+        }
     }
 
-    protected:
-        
-    void fillSocketAddress( struct addrinfo* serverInfo )
+    /**
+     * Convert a getaddrinfo() result into a list of SocketAddress.
+     */
+    static void convertAddressInfo( const struct addrinfo* serverInfo, std::vector< SocketAddress >& socketAddressList )
     {
         int count = 0;
-        struct addrinfo* p = serverInfo;
+        const struct addrinfo* p = serverInfo;
 
         // Reserve vector size based on list size
         while ( p != nullptr )
@@ -784,8 +3360,8 @@ class SocketHandler
             p = p->ai_next;
         }
         
-        mSocketAddressList.clear();
-        mSocketAddressList.reserve( count );
+        socketAddressList.clear();
+        socketAddressList.reserve( count );
 
         p = serverInfo;
         while ( p != nullptr )
@@ -796,9 +3372,8 @@ class SocketHandler
             SocketParameterConverter::getParam( p->ai_flags, flags );
             socketAddress.setFlags( flags );
 
-            SocketFamily family;
-            SocketParameterConverter::getParam( p->ai_family, family );
-            socketAddress.setFamily( family );
+            // The family, address and port
+            socketAddress.setSockaddr( p->ai_addr, p->ai_addrlen );
 
             SocketType socketType;
             SocketParameterConverter::getParam( p->ai_socktype, socketType );
@@ -808,37 +3383,59 @@ class SocketHandler
             SocketParameterConverter::getParam( p->ai_protocol, protocol );
             socketAddress.setProtocol( protocol );
 
-            // IPv4
-            if ( p->ai_family == AF_INET )
-            {
-                struct sockaddr_in* addr = reinterpret_cast< struct sockaddr_in* >( p->ai_addr );
-                socketAddress.setPort( ntohs( addr->sin_port ) );
-                socketAddress.setIPv4Address( ntohl( addr->sin_addr.s_addr ) );
-            }
-            // IPv6
-            else if ( p->ai_family == AF_INET6 )
-            {
-                struct sockaddr_in6* addr = reinterpret_cast< struct sockaddr_in6* >( p->ai_addr );
-                socketAddress.setPort( ntohs( addr->sin6_port ) );
-                socketAddress.setIPv6Address( addr->sin6_addr.s6_addr );
-                socketAddress.setIPv6FlowInfo( addr->sin6_flowinfo );
-                socketAddress.setIPv6ScopeId( addr->sin6_scope_id );
-            }
-
             if ( p->ai_canonname != nullptr )
             {
                 std::string canonicalName = p->ai_canonname;
                 socketAddress.setCanonicalHostname( canonicalName );
             }
 
-            mSocketAddressList.push_back( socketAddress );
+            socketAddressList.push_back( std::move( socketAddress ) );
 
             p = p->ai_next;
         }
     }
 
+    /**
+     * Error of the last setup(), start() or connect() that failed. error is
+     * an errno value, or a getaddrinfo() error when addressInfo is set. A
+     * copy is returned, since connect() might fail on another thread.
+     */
+    SocketError getLastError() const
+    {
+        std::lock_guard< std::mutex > lock( mLastErrorMutex );
+
+        return mLastError;
+    }
+
+    protected:
+        
+    void fillSocketAddress( struct addrinfo* serverInfo )
+    {
+        convertAddressInfo( serverInfo, mSocketAddressList );
+    }
+
+    // Keep the error for getLastError() and pass it to the logger
+    void setLastError( const char* component, const char* operation, int error, bool addressInfo = false )
+    {
+        {
+            std::lock_guard< std::mutex > lock( mLastErrorMutex );
+
+            mLastError.component = component;
+            mLastError.operation = operation;
+            mLastError.error = error;
+            mLastError.addressInfo = addressInfo;
+        }
+
+        SocketLog::report( component, operation, error, addressInfo );
+    }
+
     int mSocketDescriptor;
+    bool mNonBlocking;
     std::vector< SocketAddress > mSocketAddressList;
+
+    // A ClientSocket can connect from several threads at once
+    mutable std::mutex mLastErrorMutex;
+    SocketError mLastError;
 };
 
 
@@ -850,17 +3447,17 @@ class ServerSocket : public SocketHandler
 {
     public:
     
-    ServerSocket() : SocketHandler(), mBacklog(10)
+    ServerSocket() : SocketHandler(), mBacklog(10), mShardCount(0)
     {
     }
 
-    ServerSocket( int backlog ) : SocketHandler(), mBacklog( backlog )
+    ServerSocket( int backlog ) : SocketHandler(), mBacklog( backlog ), mShardCount(0)
     {
     }
     
     ~ServerSocket()
     {
-        close();
+        closeShards();
     }
     
     void setBacklog( int backlog )
@@ -877,9 +3474,9 @@ class ServerSocket : public SocketHandler
     
     bool setup( const std::string& port, SocketType socketType = SocketType::STREAM )
     {
-        if ( mSocketDescriptor != -1 )
+        if ( mSocketDescriptor != -1 || mShardCount > 0 )
         {
-            close();
+            closeShards();
         }
         
         struct addrinfo hints;
@@ -904,7 +3501,7 @@ class ServerSocket : public SocketHandler
         }
         else
         {
-            std::cerr << "ServerSocket error: " << gai_strerror( status ) << "\n";
+            setLastError( "ServerSocket", "getaddrinfo", status, true );
             return false;
         }
 
@@ -915,263 +3512,352 @@ class ServerSocket : public SocketHandler
     {
         if ( mSocketDescriptor != -1 )
         {
-            std::cerr << "ServerSocket error: socket already bound.\n";
+            setLastError( "ServerSocket", "start", EISCONN );
             return false;
         }
         
         if ( socketAddressIndex >= mSocketAddressList.size() )
         {
-            std::cerr << "ServerSocket error: invalid socket address index.\n";
+            setLastError( "ServerSocket", "start", EINVAL );
             return false;
         }
 
-        SocketAddress& socketAddress = mSocketAddressList[socketAddressIndex];
+        // Shards left over by a close() that only released shard 0
+        closeShards();
 
-        int family = AF_UNSPEC, socketType = SOCK_STREAM, protocol = 0;
-        SocketParameterConverter::getParam( socketAddress.getFamily(), family );
-        SocketParameterConverter::getParam( socketAddress.getSocketType(), socketType );
-        SocketParameterConverter::getParam( socketAddress.getProtocol(), protocol );
+        mSocketDescriptor = createListener( mSocketAddressList[socketAddressIndex], false );
 
-        mSocketDescriptor = socket( family, socketType, protocol );
-        if ( mSocketDescriptor == -1 )
+        return mSocketDescriptor != -1;
+    }
+
+    /**
+     * Start shardCount listening sockets bound to the same address with
+     * SO_REUSEPORT. The kernel spreads incoming connections across them, so
+     * each shard can be accepted by its own thread with accept( shard )
+     * instead of serializing every accept on one queue. Shard 0 is the
+     * descriptor used by accept() and getSocketDescriptor().
+     *
+     * The SocketHandler methods only see shard 0: use closeShards() and
+     * setShardsNonBlocking() to act on all of them.
+     */
+    bool startSharded( size_t socketAddressIndex, size_t shardCount )
+    {
+        if ( mSocketDescriptor != -1 )
         {
-            std::cerr << "ServerSocket error: file descriptor creation failed.\n";
+            setLastError( "ServerSocket", "start", EISCONN );
             return false;
         }
 
-        // Specifies that the rules used in validating addresses supplied to bind()
-        // should allow reuse of local addresses, if this is supported by the protocol.
-        int yes = 1;
-        int status = setsockopt( mSocketDescriptor, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof( int ) );
-
-        if ( status == -1 )
+        if ( socketAddressIndex >= mSocketAddressList.size() || shardCount == 0 )
         {
-            std::cerr << "ServerSocket error: setsockopt()\n";
+            setLastError( "ServerSocket", "start", EINVAL );
             return false;
         }
 
-        // Fill with the server address
-        struct sockaddr address;
-        size_t addressSize;
-        memset( &address, 0, sizeof(sockaddr) );
+        // Shards left over by a close() that only released shard 0
+        closeShards();
+
+        mShards.reset( new AcceptShard[shardCount] );
+        mShardCount = shardCount;
 
-        if ( socketAddress.getFamily() == SocketFamily::IPV4 )
+        for ( size_t i = 0; i < shardCount; ++i )
         {
-            addressSize = sizeof( sockaddr_in );
-            struct sockaddr_in* addressIPv4 = reinterpret_cast< struct sockaddr_in* >( &address );
-            IPV4ADDRESS ipv4 = 0;
+            mShards[i].socketDescriptor = createListener( mSocketAddressList[socketAddressIndex], true );
 
-            socketAddress.getIPv4Address( ipv4 );
+            if ( mShards[i].socketDescriptor == -1 )
+            {
+                closeShards();
+                return false;
+            }
 
-            addressIPv4->sin_family = family;
-            addressIPv4->sin_port = htons( socketAddress.getPort() );
-            addressIPv4->sin_addr.s_addr = htonl( ipv4 );
+            // Set at once, so closeShards() releases shard 0 if a later one
+            // fails
+            if ( i == 0 )
+            {
+                mSocketDescriptor = mShards[0].socketDescriptor;
+            }
         }
-        else
-        {
-            addressSize = sizeof( sockaddr_in6 );
-            struct sockaddr_in6* addressIPv6 = reinterpret_cast< struct sockaddr_in6* >( &address );
-            IPV6ADDRESS ipv6;
 
-            socketAddress.getIPv6Address( ipv6 );
+        return true;
+    }
 
-            addressIPv6->sin6_family = family;
-            addressIPv6->sin6_port = htons( socketAddress.getPort() );
-            addressIPv6->sin6_flowinfo = socketAddress.getIPv6FlowInfo();
-            memcpy( addressIPv6->sin6_addr.s6_addr, ipv6, sizeof( IPV6ADDRESS ) );
-            addressIPv6->sin6_scope_id = socketAddress.getIPv6ScopeId();
-        }
+    size_t getShardCount() const
+    {
+        return mShardCount;
+    }
 
-        status = ::bind( mSocketDescriptor, &address, addressSize );
-        if ( status == -1 )
+    int getShardDescriptor( size_t shard ) const
+    {
+        return shard < mShardCount ? mShards[shard].socketDescriptor : -1;
+    }
+
+    /**
+     * Number of connections accepted by a shard, to check how evenly the
+     * kernel spreads them.
+     */
+    uint64_t getShardAcceptCount( size_t shard ) const
+    {
+        return shard < mShardCount ? mShards[shard].acceptCount.load( std::memory_order_relaxed ) : 0;
+    }
+
+    /**
+     * Same as setNonBlocking(), applied to every shard of startSharded().
+     */
+    bool setShardsNonBlocking( bool nonBlocking )
+    {
+        bool success = SocketHandler::setNonBlocking( nonBlocking );
+
+        for ( size_t i = 1; i < mShardCount; ++i )
         {
-            close();
-            std::cerr << "ServerSocket error: Error while binding address to the socket.\n";
-            return false;
+            success = Socket::setDescriptorNonBlocking( mShards[i].socketDescriptor, nonBlocking ) && success;
         }
-        
-        status = ::listen( mSocketDescriptor, mBacklog );
-        if ( status == -1 )
+
+        return success;
+    }
+
+    /**
+     * Close every listening socket of startSharded(), or the single one of
+     * start(). close() only closes shard 0. The destructor calls this.
+     */
+    void closeShards()
+    {
+        // Shard 0 is closed as mSocketDescriptor
+        for ( size_t i = 1; i < mShardCount; ++i )
         {
-            close();
-            std::cerr << "ServerSocket error: Trying listening. " << strerror(errno) << "\n";
-            return false;
+            if ( mShards[i].socketDescriptor != -1 )
+            {
+                ::close( mShards[i].socketDescriptor );
+            }
         }
 
-        return true;
+        mShards.reset();
+        mShardCount = 0;
+
+        SocketHandler::close();
     }
     
-    Socket* startConnectionless( size_t socketAddressIndex )
+    /**
+     * Bind a datagram socket. The returned socket owns the descriptor, so the
+     * server can be started again after this call. With reusePort several
+     * sockets can be bound to the same address, and the kernel spreads the
+     * peers among them, each peer always to the same socket.
+     */
+    Socket startConnectionless( size_t socketAddressIndex, bool reusePort = false )
     {
         if ( mSocketDescriptor != -1 )
         {
-            std::cerr << "ServerSocket error: socket already bound.\n";
-            return nullptr;
+            setLastError( "ServerSocket", "start", EISCONN );
+            return Socket();
         }
 
         if ( socketAddressIndex >= mSocketAddressList.size() )
         {
-            std::cerr << "ServerSocket error: invalid socket address index.\n";
-            return nullptr;
+            setLastError( "ServerSocket", "start", EINVAL );
+            return Socket();
+        }
+
+        SocketAddress& socketAddress = mSocketAddressList[socketAddressIndex];
+
+        if ( socketAddress.getSocketType() != SocketType::DATAGRAM )
+        {
+            setLastError( "ServerSocket", "startConnectionless", EPROTOTYPE );
+            return Socket();
+        }
+
+        int socketDescriptor = createListener( socketAddress, reusePort );
+
+        if ( socketDescriptor == -1 )
+        {
+            return Socket();
         }
 
-        SocketAddress& socketAddress = mSocketAddressList[socketAddressIndex];
+        struct sockaddr_storage address;
+        socklen_t addressSize;
+
+        socketAddress.getSockaddr( address, addressSize );
+
+        return Socket::create( socketDescriptor, address );
+    }
+    
+    
+    
+    /**
+     * Wait for a connection. The returned socket is invalid in case of error.
+     */
+    Socket accept()
+    {
+        SocketResult result;
+
+        return accept( result );
+    }
+
+    /**
+     * In non-blocking mode result.status is WOULD_BLOCK when there are no
+     * more connections waiting in the backlog.
+     */
+    Socket accept( SocketResult& result )
+    {
+        return accept( 0, result );
+    }
+
+    /**
+     * Accept a connection from one shard created by startSharded().
+     */
+    Socket accept( size_t shard, SocketResult& result )
+    {
+        int listenerDescriptor = shard == 0 ? mSocketDescriptor : getShardDescriptor( shard );
 
-        int family = AF_UNSPEC, socketType = SOCK_DGRAM, protocol = 0;
-        SocketParameterConverter::getParam( socketAddress.getFamily(), family );
-        SocketParameterConverter::getParam( socketAddress.getSocketType(), socketType );
-        SocketParameterConverter::getParam( socketAddress.getProtocol(), protocol );
-        
-        if ( socketType != SOCK_DGRAM )
+        if ( listenerDescriptor == -1 )
         {
-            std::cerr << "ServerSocket error: It must be a datagram connection.\n";
-            return nullptr;
+            result = SocketResult( 0, SocketStatus::FAILURE, EBADF );
+            SocketLog::report( "ServerSocket", "accept", EBADF );
+            return Socket();
         }
 
-        mSocketDescriptor = socket( family, socketType, protocol );
-        if ( mSocketDescriptor == -1 )
-        {
-            std::cerr << "ServerSocket error: file descriptor creation failed.\n";
-            return nullptr;
-        }
+        // Connector's address information
+        struct sockaddr_storage connectorAddress;
+        socklen_t addressSize = sizeof( connectorAddress );
 
-        // Specifies that the rules used in validating addresses supplied to bind()
-        // should allow reuse of local addresses, if this is supported by the protocol.
-        int yes = 1;
-        int status = setsockopt( mSocketDescriptor, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof( int ) );
+        memset( &connectorAddress, 0, sizeof( connectorAddress ) );
 
-        if ( status == -1 )
+        int flags = SOCK_CLOEXEC | ( mNonBlocking ? SOCK_NONBLOCK : 0 );
+        int socketDescriptor;
+
+        do
         {
-            std::cerr << "ServerSocket error: setsockopt()\n";
-            return nullptr;
+            addressSize = sizeof( connectorAddress );
+            socketDescriptor = ::accept4( listenerDescriptor, reinterpret_cast<struct sockaddr*>( &connectorAddress ), &addressSize, flags );
         }
+        while ( socketDescriptor == -1 && ( errno == EINTR || errno == ECONNABORTED ) );
 
-        // Fill with the server address
-        struct sockaddr address;
-        size_t addressSize;
-        memset( &address, 0, sizeof(sockaddr) );
-
-        if ( socketAddress.getFamily() == SocketFamily::IPV4 )
+        if ( socketDescriptor == -1 )
         {
-            addressSize = sizeof( sockaddr_in );
-            struct sockaddr_in* addressIPv4 = reinterpret_cast< struct sockaddr_in* >( &address );
-            IPV4ADDRESS ipv4 = 0;
+            result = SocketResult( 0, Socket::errorStatus( errno ), errno );
 
-            socketAddress.getIPv4Address( ipv4 );
+            if ( result.status != SocketStatus::WOULD_BLOCK )
+            {
+                SocketMetrics::add( SocketCounter::ACCEPT_ERRORS, 1 );
+                SocketLog::report( "ServerSocket", "accept", result.error );
+            }
+            else
+            {
+                SocketMetrics::add( SocketCounter::WOULD_BLOCKS, 1 );
+            }
 
-            addressIPv4->sin_family = family;
-            addressIPv4->sin_port = htons( socketAddress.getPort() );
-            addressIPv4->sin_addr.s_addr = htonl( ipv4 );
+            return Socket();
         }
-        else
-        {
-            addressSize = sizeof( sockaddr_in6 );
-            struct sockaddr_in6* addressIPv6 = reinterpret_cast< struct sockaddr_in6* >( &address );
-            IPV6ADDRESS ipv6;
 
-            socketAddress.getIPv6Address( ipv6 );
+        result = SocketResult();
 
-            addressIPv6->sin6_family = family;
-            addressIPv6->sin6_port = htons( socketAddress.getPort() );
-            addressIPv6->sin6_flowinfo = socketAddress.getIPv6FlowInfo();
-            memcpy( addressIPv6->sin6_addr.s6_addr, ipv6, sizeof( IPV6ADDRESS ) );
-            addressIPv6->sin6_scope_id = socketAddress.getIPv6ScopeId();
-        }
+        SocketMetrics::add( SocketCounter::ACCEPTS, 1 );
 
-        status = ::bind( mSocketDescriptor, &address, addressSize );
-        if ( status == -1 )
+        if ( shard < mShardCount )
         {
-            close();
-            std::cerr << "ServerSocket error: Error while binding address to the socket.\n";
-            return nullptr;
+            mShards[shard].acceptCount.fetch_add( 1, std::memory_order_relaxed );
         }
-        
-        Socket* socket = nullptr;
-
-        if ( family ==  AF_INET )
-        {
-            IPV4ADDRESS ipv4;
-            socketAddress.getIPv4Address( ipv4 );
 
-            socket = new Socket( mSocketDescriptor, socketAddress.getPort(), ipv4 );
-        }
-        else if ( family == AF_INET6 )
-        {
-            IPV6ADDRESS ipv6;
-            socketAddress.getIPv6Address( ipv6 );
+        return Socket::create( socketDescriptor, connectorAddress );
+    }
 
-            socket = new Socket( mSocketDescriptor, socketAddress.getPort(), ipv6, socketAddress.getIPv6FlowInfo(), socketAddress.getIPv6ScopeId() );
-        }
+    private:
 
-        return socket;
-    }
-    
-    
-    
-    Socket* accept()
+    // Listening socket of a sharded server. Padded so the counters of
+    // different shards do not share a cache line.
+    struct AcceptShard
     {
-        if ( mSocketDescriptor == -1 )
+        AcceptShard() : socketDescriptor( -1 ), acceptCount( 0 )
         {
-            std::cerr << "ServerSocket error: server not set.\n";
-            return nullptr;
         }
 
-        // Connector's address information
-        struct sockaddr_storage connectorAddress;
-        socklen_t addressSize = sizeof( connectorAddress );
-
-        memset( &connectorAddress, 0, sizeof( connectorAddress ) );
+        int socketDescriptor;
+        std::atomic< uint64_t > acceptCount;
+        char padding[64 - sizeof( int ) - sizeof( std::atomic< uint64_t > )];
+    };
 
-        int socketDescriptor = ::accept( mSocketDescriptor, reinterpret_cast<struct sockaddr*>( &connectorAddress ), &addressSize );
+    /**
+     * Create a socket bound to socketAddress, listening when it is a stream.
+     * Returns the descriptor or -1 in case of error.
+     */
+    int createListener( const SocketAddress& socketAddress, bool reusePort )
+    {
+        int family = AF_UNSPEC, socketType = SOCK_STREAM, protocol = 0;
+        SocketParameterConverter::getParam( socketAddress.getFamily(), family );
+        SocketParameterConverter::getParam( socketAddress.getSocketType(), socketType );
+        SocketParameterConverter::getParam( socketAddress.getProtocol(), protocol );
 
+        int socketDescriptor = socket( family, socketType | SOCK_CLOEXEC, protocol );
         if ( socketDescriptor == -1 )
         {
-            std::cerr << "ServerSocket error: " << strerror(errno) << "\n";
-            return nullptr;
+            setLastError( "ServerSocket", "socket", errno );
+            return -1;
         }
 
-        Socket* socket = nullptr;
+        // Specifies that the rules used in validating addresses supplied to bind()
+        // should allow reuse of local addresses, if this is supported by the protocol.
+        int yes = 1;
+        int status = setsockopt( socketDescriptor, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof( int ) );
+
+        // Allows several sockets to bind the very same address, the kernel
+        // balances the incoming connections between them.
+        if ( status != -1 && reusePort )
+        {
+            status = setsockopt( socketDescriptor, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof( int ) );
+        }
 
-        struct sockaddr* connectorSockAddr = reinterpret_cast<struct sockaddr*>( &connectorAddress );
-        if ( connectorSockAddr && connectorSockAddr->sa_family ==  AF_INET )
+        if ( status == -1 )
         {
-            PORT port;
-            IPV4ADDRESS ipv4;
+            setLastError( "ServerSocket", "setsockopt", errno );
+            ::close( socketDescriptor );
+            return -1;
+        }
 
-            struct sockaddr_in* address = reinterpret_cast<struct sockaddr_in*>( connectorSockAddr);
+        // Fill with the server address
+        struct sockaddr_storage address;
+        socklen_t addressSize;
 
-            port = ntohs( address->sin_port );
-            ipv4 = ntohl( address->sin_addr.s_addr );
+        socketAddress.getSockaddr( address, addressSize );
 
-            socket = new Socket( socketDescriptor, port, ipv4 );
-        }
-        else if ( connectorSockAddr && connectorSockAddr->sa_family ==  AF_INET6 )
+        status = ::bind( socketDescriptor, reinterpret_cast< struct sockaddr* >( &address ), addressSize );
+        if ( status == -1 )
         {
-            PORT port;
-            IPV6ADDRESS ipv6;
-            IPV6FLOWINFO ipv6FlowInfo;
-            IPV6SCOPEID ipv6ScopeId;
-
-            struct sockaddr_in6* address = reinterpret_cast<struct sockaddr_in6*>( connectorSockAddr);
+            setLastError( "ServerSocket", "bind", errno );
+            ::close( socketDescriptor );
+            return -1;
+        }
 
-            port = ntohs( address->sin6_port );
-            memcpy( ipv6, address->sin6_addr.s6_addr, sizeof( IPV6ADDRESS ) );
-            ipv6FlowInfo = address->sin6_flowinfo;
-            ipv6ScopeId = address->sin6_scope_id;
+        if ( socketType == SOCK_STREAM )
+        {
+            status = ::listen( socketDescriptor, mBacklog );
+            if ( status == -1 )
+            {
+                setLastError( "ServerSocket", "listen", errno );
+                ::close( socketDescriptor );
+                return -1;
+            }
+        }
 
-            socket = new Socket( socketDescriptor, port, ipv6, ipv6FlowInfo, ipv6ScopeId );
+        if ( mNonBlocking && !Socket::setDescriptorNonBlocking( socketDescriptor, true ) )
+        {
+            setLastError( "ServerSocket", "fcntl", errno );
+            ::close( socketDescriptor );
+            return -1;
         }
 
-        return socket;
+        return socketDescriptor;
     }
 
-    private:
-
     int mBacklog;
+    std::unique_ptr< AcceptShard[] > mShards;
+    size_t mShardCount;
 };
 
 
 
+// Caching resolver of Resolver.h
+class Resolver;
+
+
+
 /**
  * This class creates a client socket.
  */
@@ -1218,81 +3904,380 @@ class ClientSocket : public SocketHandler
         }
         else
         {
-            std::cerr << "ClientSocket error: " << gai_strerror( status ) << "\n";
+            setLastError( "ClientSocket", "getaddrinfo", status, true );
             return false;
         }
 
         return true;
     }
 
-    Socket* connect( size_t socketAddressIndex )
+    /**
+     * Take the addresses from the cache of a Resolver, waiting for the name
+     * resolution only when it is not cached. Defined in Resolver.h.
+     */
+    bool setup( Resolver& resolver, const std::string& address, const std::string& port, SocketType socketType = SocketType::STREAM );
+
+    /**
+     * Connect to the server. The returned socket owns the descriptor and is
+     * invalid in case of error.
+     */
+    Socket connect( size_t socketAddressIndex )
+    {
+        SocketResult result;
+
+        return connect( socketAddressIndex, result );
+    }
+
+    /**
+     * In non-blocking mode result.status is WOULD_BLOCK while the connection
+     * is in progress. Wait until the socket is writable and then check
+     * Socket::getPendingError().
+     */
+    Socket connect( size_t socketAddressIndex, SocketResult& result )
     {
         if ( socketAddressIndex >= mSocketAddressList.size() )
         {
-            std::cerr << "ClientSocket error: invalid socket address index.\n";
-            return nullptr;
+            result = SocketResult( 0, SocketStatus::FAILURE, EINVAL );
+            setLastError( "ClientSocket", "connect", EINVAL );
+            return Socket();
         }
 
-        SocketAddress& socketAddress = mSocketAddressList[socketAddressIndex];
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        Socket socket = startConnect( mSocketAddressList[socketAddressIndex], mNonBlocking, result );
+
+        // A non-blocking connection in progress is not counted
+        if ( result.status != SocketStatus::WOULD_BLOCK )
+        {
+            countConnect( result, start );
+        }
+
+        if ( result.status == SocketStatus::FAILURE )
+        {
+            setLastError( "ClientSocket", "connect", result.error );
+        }
+
+        return socket;
+    }
+
+    /**
+     * Connect within timeout milliseconds. A connection still in progress
+     * when the deadline passes is abandoned and result.status is TIMEOUT.
+     */
+    Socket connect( size_t socketAddressIndex, int timeout, SocketResult& result )
+    {
+        if ( socketAddressIndex >= mSocketAddressList.size() )
+        {
+            result = SocketResult( 0, SocketStatus::FAILURE, EINVAL );
+            setLastError( "ClientSocket", "connect", EINVAL );
+            return Socket();
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point deadline = getDeadline( timeout );
+        Socket socket = startConnect( mSocketAddressList[socketAddressIndex], true, result );
+
+        if ( result.status == SocketStatus::WOULD_BLOCK )
+        {
+            result = waitConnect( socket, timeout, deadline );
+        }
+
+        countConnect( result, start );
+
+        if ( result.status != SocketStatus::OK )
+        {
+            setLastError( "ClientSocket", "connect", result.error );
+            return Socket();
+        }
+
+        return finishConnect( socket, result );
+    }
+
+    Socket connectAny( int attemptDelay = 250 )
+    {
+        SocketResult result;
 
+        return connectAny( result, attemptDelay );
+    }
+
+    /**
+     * Connect to the first address that answers, following Happy Eyeballs
+     * (RFC 8305). The addresses are tried in the order of the list, but
+     * alternating between the two families, and each attempt starts
+     * attemptDelay milliseconds after the previous one or as soon as it fails.
+     * The attempts still in progress when one succeeds are closed.
+     *
+     * With a timeout (in milliseconds) the remaining attempts are abandoned
+     * when it passes, and result.status is TIMEOUT.
+     */
+    Socket connectAny( SocketResult& result, int attemptDelay = 250, int timeout = -1 )
+    {
+        std::vector< size_t > order = interleaveFamilies();
+        std::vector< Socket > attempts;
+        std::vector< struct pollfd > descriptors;
+        std::chrono::steady_clock::time_point deadline = getDeadline( timeout );
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point nextStart = start;
+        size_t next = 0;
+
+        result = SocketResult( 0, SocketStatus::FAILURE, EADDRNOTAVAIL );
+
+        while ( next < order.size() || !attempts.empty() )
+        {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+            if ( next < order.size() && ( attempts.empty() || now >= nextStart ) )
+            {
+                SocketResult attemptResult;
+                Socket socket = startConnect( mSocketAddressList[order[next++]], true, attemptResult );
+
+                if ( attemptResult.status == SocketStatus::OK )
+                {
+                    countConnect( attemptResult, start );
+                    return finishConnect( socket, result );
+                }
+
+                if ( attemptResult.status == SocketStatus::WOULD_BLOCK )
+                {
+                    attempts.push_back( std::move( socket ) );
+                    nextStart = now + std::chrono::milliseconds( attemptDelay );
+                }
+                else
+                {
+                    result = attemptResult;
+                }
+
+                continue;
+            }
+
+            if ( timeout >= 0 && now >= deadline )
+            {
+                result = SocketResult( 0, SocketStatus::TIMEOUT, ETIMEDOUT );
+                countConnect( result, start );
+                return Socket();
+            }
+
+            int waitTime = timeout >= 0 ? getRemainingTime( deadline, now ) : -1;
+
+            if ( next < order.size() )
+            {
+                int startTime = getRemainingTime( nextStart, now );
+
+                waitTime = waitTime == -1 ? startTime : std::min( waitTime, startTime );
+            }
+
+            descriptors.resize( attempts.size() );
+
+            for ( size_t i = 0; i < attempts.size(); ++i )
+            {
+                descriptors[i].fd = attempts[i].getSocketDescriptor();
+                descriptors[i].events = POLLOUT;
+                descriptors[i].revents = 0;
+            }
+
+            if ( ::poll( descriptors.data(), descriptors.size(), waitTime ) == -1 && errno != EINTR )
+            {
+                result = SocketResult( 0, SocketStatus::FAILURE, errno );
+                break;
+            }
+
+            // Backwards, so erasing an attempt keeps the indexes of the others
+            for ( size_t i = attempts.size(); i-- > 0; )
+            {
+                if ( descriptors[i].revents == 0 )
+                {
+                    continue;
+                }
+
+                int error = attempts[i].getPendingError();
+
+                if ( error == 0 )
+                {
+                    countConnect( SocketResult(), start );
+                    return finishConnect( attempts[i], result );
+                }
+
+                result = SocketResult( 0, SocketStatus::FAILURE, error );
+                attempts.erase( attempts.begin() + i );
+
+                // A failed attempt does not wait for the delay
+                nextStart = now;
+            }
+        }
+
+        countConnect( result, start );
+
+        SocketLog::report( "ClientSocket", "connect", result.error );
+        return Socket();
+    }
+
+    private:
+
+    /**
+     * Create a socket and start connecting it. result.status is WOULD_BLOCK
+     * when a non-blocking connection is in progress.
+     */
+    Socket startConnect( const SocketAddress& socketAddress, bool nonBlocking, SocketResult& result )
+    {
         int family = AF_UNSPEC, socketType = SOCK_STREAM, protocol = 0;
         SocketParameterConverter::getParam( socketAddress.getFamily(), family );
         SocketParameterConverter::getParam( socketAddress.getSocketType(), socketType );
         SocketParameterConverter::getParam( socketAddress.getProtocol(), protocol );
 
-        mSocketDescriptor = socket( family, socketType, protocol );
+        socketType |= SOCK_CLOEXEC | ( nonBlocking ? SOCK_NONBLOCK : 0 );
 
-        if ( mSocketDescriptor == -1 )
+        int socketDescriptor = socket( family, socketType, protocol );
+
+        if ( socketDescriptor == -1 )
         {
-            std::cerr << "ClientSocket error: file descriptor creation failed.\n";
-            return nullptr;
+            result = SocketResult( 0, SocketStatus::FAILURE, errno );
+            return Socket();
         }
 
-        struct sockaddr address;
-        size_t addressSize;
-        memset( &address, 0, sizeof( sockaddr ) );
+        struct sockaddr_storage address;
+        socklen_t addressSize;
+
+        socketAddress.getSockaddr( address, addressSize );
+
+        // From here on the socket owns the descriptor
+        Socket socket = Socket::create( socketDescriptor, address );
+
+        int status = ::connect( socketDescriptor, reinterpret_cast< struct sockaddr* >( &address ), addressSize );
+        if ( status == -1 )
+        {
+            if ( nonBlocking && errno == EINPROGRESS )
+            {
+                result = SocketResult( 0, SocketStatus::WOULD_BLOCK, errno );
+                return socket;
+            }
+
+            result = SocketResult( 0, SocketStatus::FAILURE, errno );
+            return Socket();
+        }
+
+        result = SocketResult();
+
+        return socket;
+    }
 
-        Socket* socket = nullptr;
+    /**
+     * Wait until a non-blocking connect completes. timeout is only checked
+     * to be non-negative, the deadline is when it expires.
+     */
+    static SocketResult waitConnect( const Socket& socket, int timeout, std::chrono::steady_clock::time_point deadline )
+    {
+        struct pollfd descriptor;
+        descriptor.fd = socket.getSocketDescriptor();
+        descriptor.events = POLLOUT;
 
-        if ( socketAddress.getFamily() == SocketFamily::IPV4 )
+        for ( ;; )
         {
-            addressSize = sizeof( sockaddr_in );
-            struct sockaddr_in* addressIPv4 = reinterpret_cast< struct sockaddr_in* >( &address );
-            IPV4ADDRESS ipv4 = 0;
+            descriptor.revents = 0;
+
+            int waitTime = timeout >= 0 ? getRemainingTime( deadline, std::chrono::steady_clock::now() ) : -1;
+            int count = ::poll( &descriptor, 1, waitTime );
+
+            if ( count > 0 )
+            {
+                int error = socket.getPendingError();
 
-            socketAddress.getIPv4Address( ipv4 );
+                return error == 0 ? SocketResult() : SocketResult( 0, SocketStatus::FAILURE, error );
+            }
 
-            addressIPv4->sin_family = family;
-            addressIPv4->sin_port = htons( socketAddress.getPort() );
-            addressIPv4->sin_addr.s_addr = htonl( ipv4 );
+            if ( count == 0 )
+            {
+                return SocketResult( 0, SocketStatus::TIMEOUT, ETIMEDOUT );
+            }
 
-            socket = new Socket( mSocketDescriptor, socketAddress.getPort(), ipv4 );
+            if ( errno != EINTR )
+            {
+                return SocketResult( 0, SocketStatus::FAILURE, errno );
+            }
         }
-        else
+    }
+
+    static std::chrono::steady_clock::time_point getDeadline( int timeout )
+    {
+        return std::chrono::steady_clock::now() + std::chrono::milliseconds( timeout > 0 ? timeout : 0 );
+    }
+
+    // Milliseconds until time, rounded up so poll() does not wake up early
+    static int getRemainingTime( std::chrono::steady_clock::time_point time, std::chrono::steady_clock::time_point now )
+    {
+        if ( time <= now )
         {
-            addressSize = sizeof( sockaddr_in6 );
-            struct sockaddr_in6* addressIPv6 = reinterpret_cast< struct sockaddr_in6* >( &address );
-            IPV6ADDRESS ipv6;
+            return 0;
+        }
+
+        std::chrono::microseconds remaining = std::chrono::duration_cast< std::chrono::microseconds >( time - now );
+
+        return static_cast< int >( ( remaining.count() + 999 ) / 1000 );
+    }
+
+    // Successful connections record the time since start
+    static void countConnect( const SocketResult& result, std::chrono::steady_clock::time_point start )
+    {
+        if ( result.status != SocketStatus::OK )
+        {
+            SocketMetrics::add( SocketCounter::CONNECT_ERRORS, 1 );
+            return;
+        }
 
-            socketAddress.getIPv6Address( ipv6 );
+        std::chrono::microseconds latency = std::chrono::duration_cast< std::chrono::microseconds >( std::chrono::steady_clock::now() - start );
 
-            addressIPv6->sin6_family = family;
-            addressIPv6->sin6_port = htons( socketAddress.getPort() );
-            addressIPv6->sin6_flowinfo = socketAddress.getIPv6FlowInfo();
-            memcpy( addressIPv6->sin6_addr.s6_addr, ipv6, sizeof( IPV6ADDRESS ) );
-            addressIPv6->sin6_scope_id = socketAddress.getIPv6ScopeId();
+        SocketMetrics::add( SocketCounter::CONNECTS, 1 );
+        SocketMetrics::recordConnectLatency( static_cast< uint64_t >( latency.count() ) );
+    }
 
-            socket = new Socket( mSocketDescriptor, socketAddress.getPort(), ipv6, socketAddress.getIPv6FlowInfo(), socketAddress.getIPv6ScopeId() );
+    // Connections started non-blocking get the mode of this ClientSocket back
+    Socket finishConnect( Socket& socket, SocketResult& result )
+    {
+        if ( !mNonBlocking )
+        {
+            socket.setNonBlocking( false );
         }
 
-        int status = ::connect( mSocketDescriptor, &address, addressSize );
-        if ( status == -1 )
+        result = SocketResult();
+
+        return std::move( socket );
+    }
+
+    /**
+     * Indexes of mSocketAddressList alternating between the family of the
+     * first address and the other one.
+     */
+    std::vector< size_t > interleaveFamilies() const
+    {
+        std::vector< size_t > preferred, other, order;
+
+        for ( size_t i = 0; i < mSocketAddressList.size(); ++i )
         {
-            this->close();
-            std::cerr << "ClientSocket error: Cannot connect.\n";
-            return nullptr;
+            if ( mSocketAddressList[i].getFamily() == mSocketAddressList[0].getFamily() )
+            {
+                preferred.push_back( i );
+            }
+            else
+            {
+                other.push_back( i );
+            }
         }
 
-        return socket;
+        for ( size_t i = 0; i < preferred.size() || i < other.size(); ++i )
+        {
+            if ( i < preferred.size() )
+            {
+                order.push_back( preferred[i] );
+            }
+
+            if ( i < other.size() )
+            {
+                order.push_back( other[i] );
+            }
+        }
+
+        return order;
     }
 };
+
+
+
+#endif // SOCKET_H
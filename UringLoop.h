@@ -0,0 +1,1181 @@
+/**
+ * Asynchronous socket operations using io_uring. Operations are queued as
+ * submission entries and their results are delivered to callbacks, which
+ * saves most of the system calls and context switches of the blocking and
+ * epoll paths. When io_uring is not available (old kernel, seccomp) the same
+ * interface is served by an EventLoop.
+ *
+ * EXAMPLE OF USE:
+ *
+ *    #include "UringLoop.h"
+ *
+ *    int main()
+ *    {
+ *        ServerSocket server( 50 );
+ *        UringLoop loop;
+ *
+ *        // Accepted sockets are kept by descriptor until the peer closes
+ *        std::unordered_map< int, Socket > connections;
+ *
+ *        // 256 buffers of 4096 bytes shared by all multishot receives
+ *        loop.setupBufferRing( 256, 4096 );
+ *
+ *        if ( server.setup( "3490" ) && server.start( 0 ) )
+ *        {
+ *            // A multishot accept delivers every new connection to the callback
+ *            loop.accept( server, [&]( UringCompletion& accepted )
+ *            {
+ *                if ( !accepted.socket.isValid() )
+ *                {
+ *                    return;
+ *                }
+ *
+ *                int fd = accepted.socket.getSocketDescriptor();
+ *
+ *                loop.receive( accepted.socket, [&, fd]( const UringCompletion& received )
+ *                {
+ *                    if ( received.result <= 0 )
+ *                    {
+ *                        connections.erase( fd );
+ *                        return;
+ *                    }
+ *
+ *                    // ... use received.buffer, received.result bytes ...
+ *
+ *                    // The buffer goes back to the ring once it is consumed
+ *                    loop.releaseBuffer( received.bufferId );
+ *                }, true );
+ *
+ *                // Otherwise the socket is closed when the callback returns
+ *                connections[fd] = std::move( accepted.socket );
+ *            }, true );
+ *
+ *            // Dispatch completions until loop.stop() is called
+ *            loop.run();
+ *        }
+ *
+ *        return 0;
+ *    }
+ */
+
+
+
+#ifndef URINGLOOP_H
+#define URINGLOOP_H
+
+
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include "EventLoop.h"
+#include "Socket.h"
+
+
+
+/**
+ * Result of an asynchronous operation.
+ */
+struct UringCompletion
+{
+    UringCompletion() :
+        result( 0 ),
+        more( false ),
+        bufferId( -1 ),
+        buffer( nullptr )
+    {
+    }
+
+    int result;             // Bytes transferred, 0 when the peer closed the connection or -errno
+    bool more;              // A multishot operation will deliver more completions
+    Socket socket;          // Accepted or connected socket, move it out to keep it open
+    int bufferId;           // Provided buffer holding the received data, or -1
+    const char* buffer;     // Data of the provided buffer
+};
+
+
+
+/**
+ * This class runs socket operations asynchronously.
+ */
+class UringLoop
+{
+    public:
+
+    // The completion is not const so the callback can move the socket out
+    typedef std::function< void( UringCompletion& completion ) > UringCallback;
+
+    /**
+     * entries is the size of the submission queue. With forceFallback the
+     * EventLoop path is used even if io_uring is available.
+     */
+    UringLoop( unsigned entries = 256, bool forceFallback = false ) :
+        mRingDescriptor( -1 ),
+        mWakeDescriptor( -1 ),
+        mStopping( false ),
+        mNextOperationId( FIRST_OPERATION_ID ),
+        mPendingSubmissions( 0 ),
+        mRingMemory( nullptr ),
+        mRingMemorySize( 0 ),
+        mSubmissionEntries( nullptr ),
+        mSubmissionEntriesSize( 0 ),
+        mBufferRing( nullptr ),
+        mBufferRingSize( 0 ),
+        mBufferCount( 0 ),
+        mBufferSize( 0 ),
+        mBufferTail( 0 )
+    {
+        memset( &mParams, 0, sizeof( mParams ) );
+
+        if ( !forceFallback )
+        {
+            setupRing( entries );
+        }
+
+        if ( mRingDescriptor == -1 )
+        {
+            mFallbackLoop.reset( new EventLoop() );
+        }
+    }
+
+    UringLoop( const UringLoop& ) = delete;
+    UringLoop& operator=( const UringLoop& ) = delete;
+
+    ~UringLoop()
+    {
+        if ( mBufferRing != nullptr )
+        {
+            munmap( mBufferRing, mBufferRingSize );
+        }
+
+        if ( mSubmissionEntries != nullptr )
+        {
+            munmap( mSubmissionEntries, mSubmissionEntriesSize );
+        }
+
+        if ( mRingMemory != nullptr )
+        {
+            munmap( mRingMemory, mRingMemorySize );
+        }
+
+        ::close( mWakeDescriptor );
+        ::close( mRingDescriptor );
+
+        // The descriptor of a pending connect is not owned by a Socket yet
+        for ( const std::pair< const uint64_t, std::unique_ptr< Operation > >& entry : mOperations )
+        {
+            if ( entry.second->type == OperationType::CONNECT )
+            {
+                ::close( entry.second->socketDescriptor );
+            }
+        }
+    }
+
+    /**
+     * Returns false when operations are served by the EventLoop fallback.
+     */
+    bool isUringEnabled() const
+    {
+        return mRingDescriptor != -1;
+    }
+
+    /**
+     * Create count buffers of size bytes for receive() with provided buffers.
+     * count must be a power of two. The kernel picks a free buffer for each
+     * received chunk, so idle connections do not hold any memory.
+     */
+    bool setupBufferRing( unsigned count, unsigned size )
+    {
+        if ( count == 0 || ( count & ( count - 1 ) ) != 0 || count > 32768 || size == 0 || mBufferCount != 0 )
+        {
+            SocketLog::report( "UringLoop", "setupBufferRing", EINVAL );
+            return false;
+        }
+
+        mBuffers.resize( static_cast< size_t >( count ) * size );
+        mBufferCount = count;
+        mBufferSize = size;
+
+        if ( isUringEnabled() )
+        {
+            mBufferRingSize = count * sizeof( struct io_uring_buf );
+            mBufferRing = mmap( nullptr, mBufferRingSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0 );
+
+            if ( mBufferRing == MAP_FAILED )
+            {
+                mBufferRing = nullptr;
+            }
+
+            struct io_uring_buf_reg registration;
+            memset( &registration, 0, sizeof( registration ) );
+            registration.ring_addr = reinterpret_cast< uint64_t >( mBufferRing );
+            registration.ring_entries = count;
+            registration.bgid = BUFFER_GROUP;
+
+            if ( mBufferRing == nullptr ||
+                 syscall( __NR_io_uring_register, mRingDescriptor, IORING_REGISTER_PBUF_RING, &registration, 1 ) == -1 )
+            {
+                SocketLog::report( "UringLoop", "io_uring_register", errno );
+
+                if ( mBufferRing != nullptr )
+                {
+                    munmap( mBufferRing, mBufferRingSize );
+                    mBufferRing = nullptr;
+                }
+
+                mBuffers.clear();
+                mBufferCount = 0;
+                return false;
+            }
+        }
+
+        for ( unsigned i = 0; i < count; ++i )
+        {
+            releaseBuffer( static_cast< int >( i ) );
+        }
+
+        return true;
+    }
+
+    const char* getBuffer( int bufferId ) const
+    {
+        return &mBuffers[static_cast< size_t >( bufferId ) * mBufferSize];
+    }
+
+    /**
+     * Give a buffer delivered by a completion back to the ring.
+     */
+    void releaseBuffer( int bufferId )
+    {
+        if ( bufferId < 0 || static_cast< unsigned >( bufferId ) >= mBufferCount )
+        {
+            return;
+        }
+
+        if ( !isUringEnabled() )
+        {
+            mFreeBuffers.push_back( bufferId );
+            return;
+        }
+
+        struct io_uring_buf* buffers = reinterpret_cast< struct io_uring_buf* >( mBufferRing );
+        struct io_uring_buf& buffer = buffers[mBufferTail & ( mBufferCount - 1 )];
+
+        buffer.addr = reinterpret_cast< uint64_t >( getBuffer( bufferId ) );
+        buffer.len = mBufferSize;
+        buffer.bid = static_cast< uint16_t >( bufferId );
+
+        // The tail of the ring shares its place with the reserved field of
+        // the first buffer
+        mBufferTail++;
+        __atomic_store_n( &buffers[0].resv, mBufferTail, __ATOMIC_RELEASE );
+    }
+
+    /**
+     * Accept connections of a started ServerSocket. A multishot accept keeps
+     * delivering connections until it is cancelled. Returns an operation id
+     * to be used with cancel(), or 0 in case of error.
+     */
+    uint64_t accept( const ServerSocket& server, const UringCallback& callback, bool multishot = false )
+    {
+        std::unique_ptr< Operation > operation( new Operation( OperationType::ACCEPT, server.getSocketDescriptor(), callback ) );
+        operation->multishot = multishot;
+
+        return submit( std::move( operation ) );
+    }
+
+    /**
+     * Connect to one of the addresses filled by ClientSocket::setup(). The
+     * completion carries the connected socket.
+     */
+    uint64_t connect( ClientSocket& client, size_t socketAddressIndex, const UringCallback& callback )
+    {
+        const SocketAddress* socketAddress = client.getSocketAddress( socketAddressIndex );
+
+        if ( socketAddress == nullptr )
+        {
+            SocketLog::report( "UringLoop", "connect", EINVAL );
+            return 0;
+        }
+
+        int family = AF_UNSPEC, socketType = SOCK_STREAM, protocol = 0;
+        SocketParameterConverter::getParam( socketAddress->getFamily(), family );
+        SocketParameterConverter::getParam( socketAddress->getSocketType(), socketType );
+        SocketParameterConverter::getParam( socketAddress->getProtocol(), protocol );
+
+        int socketDescriptor = socket( family, socketType | SOCK_CLOEXEC | ( isUringEnabled() ? 0 : SOCK_NONBLOCK ), protocol );
+
+        if ( socketDescriptor == -1 )
+        {
+            SocketLog::report( "UringLoop", "socket", errno );
+            return 0;
+        }
+
+        std::unique_ptr< Operation > operation( new Operation( OperationType::CONNECT, socketDescriptor, callback ) );
+        socketAddress->getSockaddr( operation->address, operation->addressSize );
+
+        return submit( std::move( operation ) );
+    }
+
+    /**
+     * Send all size bytes, the completion is delivered once everything was
+     * sent or in case of error. The buffer must remain valid until then.
+     */
+    uint64_t send( const Socket& socket, const void* buffer, size_t size, const UringCallback& callback )
+    {
+        std::unique_ptr< Operation > operation( new Operation( OperationType::SEND, socket.getSocketDescriptor(), callback ) );
+        operation->buffer = const_cast< char* >( reinterpret_cast< const char* >( buffer ) );
+        operation->size = size;
+
+        return submit( std::move( operation ) );
+    }
+
+    /**
+     * Receive up to size bytes into buffer.
+     */
+    uint64_t receive( const Socket& socket, void* buffer, size_t size, const UringCallback& callback )
+    {
+        std::unique_ptr< Operation > operation( new Operation( OperationType::RECEIVE, socket.getSocketDescriptor(), callback ) );
+        operation->buffer = reinterpret_cast< char* >( buffer );
+        operation->size = size;
+
+        return submit( std::move( operation ) );
+    }
+
+    /**
+     * Receive into buffers of the ring created by setupBufferRing(). Every
+     * completion carries a buffer that must be given back with
+     * releaseBuffer(). A multishot receive stops when the ring runs out of
+     * buffers (result is -ENOBUFS) and has to be submitted again.
+     */
+    uint64_t receive( const Socket& socket, const UringCallback& callback, bool multishot = false )
+    {
+        if ( mBufferCount == 0 )
+        {
+            SocketLog::report( "UringLoop", "receive", ENOBUFS );
+            return 0;
+        }
+
+        std::unique_ptr< Operation > operation( new Operation( OperationType::RECEIVE, socket.getSocketDescriptor(), callback ) );
+        operation->multishot = multishot;
+        operation->selectBuffer = true;
+
+        return submit( std::move( operation ) );
+    }
+
+    /**
+     * sendmsg() and recvmsg(). The message and everything it points to must
+     * remain valid until the completion.
+     */
+    uint64_t sendMessage( const Socket& socket, const struct msghdr* message, const UringCallback& callback, int flags = 0 )
+    {
+        std::unique_ptr< Operation > operation( new Operation( OperationType::SEND_MESSAGE, socket.getSocketDescriptor(), callback ) );
+        operation->message = const_cast< struct msghdr* >( message );
+        operation->flags = flags;
+
+        return submit( std::move( operation ) );
+    }
+
+    uint64_t receiveMessage( const Socket& socket, struct msghdr* message, const UringCallback& callback, int flags = 0 )
+    {
+        std::unique_ptr< Operation > operation( new Operation( OperationType::RECEIVE_MESSAGE, socket.getSocketDescriptor(), callback ) );
+        operation->message = message;
+        operation->flags = flags;
+
+        return submit( std::move( operation ) );
+    }
+
+    /**
+     * Cancel a pending operation. Its callback receives -ECANCELED.
+     */
+    bool cancel( uint64_t operationId )
+    {
+        std::unordered_map< uint64_t, std::unique_ptr< Operation > >::iterator iterator = mOperations.find( operationId );
+
+        if ( iterator == mOperations.end() )
+        {
+            return false;
+        }
+
+        if ( !isUringEnabled() )
+        {
+            // A connect that completed right away, or an operation cancelled
+            // already, has its final completion queued
+            for ( const FallbackCompletion& completion : mFallbackCompletions )
+            {
+                if ( completion.operationId == operationId )
+                {
+                    return false;
+                }
+            }
+
+            Operation* operation = iterator->second.get();
+
+            if ( static_cast< size_t >( operation->socketDescriptor ) < mFallbackDescriptors.size() )
+            {
+                FallbackDescriptor& descriptor = mFallbackDescriptors[operation->socketDescriptor];
+                std::deque< uint64_t >& queue = isWrite( operation->type ) ? descriptor.writes : descriptor.reads;
+
+                for ( std::deque< uint64_t >::iterator i = queue.begin(); i != queue.end(); ++i )
+                {
+                    if ( *i == operationId )
+                    {
+                        queue.erase( i );
+                        break;
+                    }
+                }
+
+                updateFallbackInterest( operation->socketDescriptor );
+            }
+
+            operation->multishot = false;
+            mFallbackCompletions.push_back( FallbackCompletion( operationId, -ECANCELED ) );
+            return true;
+        }
+
+        struct io_uring_sqe* entry = getSubmissionEntry();
+
+        if ( entry == nullptr )
+        {
+            return false;
+        }
+
+        entry->opcode = IORING_OP_ASYNC_CANCEL;
+        entry->fd = -1;
+        entry->addr = operationId;
+        entry->user_data = CANCEL_ID;
+
+        return true;
+    }
+
+    /**
+     * Wait up to timeout milliseconds (-1 waits forever) and dispatch the
+     * completions. Returns the number of completions dispatched or -1 in case
+     * of error.
+     */
+    int poll( int timeout = -1 )
+    {
+        if ( !isUringEnabled() )
+        {
+            return pollFallback( timeout );
+        }
+
+        struct __kernel_timespec timespec;
+        timespec.tv_sec = timeout / 1000;
+        timespec.tv_nsec = ( timeout % 1000 ) * 1000000LL;
+
+        struct io_uring_getevents_arg argument;
+        memset( &argument, 0, sizeof( argument ) );
+        argument.sigmask_sz = _NSIG / 8;
+        argument.ts = timeout >= 0 ? reinterpret_cast< uint64_t >( &timespec ) : 0;
+
+        unsigned head = __atomic_load_n( mCompletionHead, __ATOMIC_RELAXED );
+        bool ready = head != __atomic_load_n( mCompletionTail, __ATOMIC_ACQUIRE );
+
+        // A single call submits the new entries and waits for completions
+        if ( mPendingSubmissions > 0 || !ready )
+        {
+            long status = syscall( __NR_io_uring_enter, mRingDescriptor, mPendingSubmissions, ready ? 0 : 1,
+                                   IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &argument, sizeof( argument ) );
+
+            if ( status == -1 && errno != ETIME && errno != EINTR && errno != EBUSY )
+            {
+                SocketLog::report( "UringLoop", "io_uring_enter", errno );
+                return -1;
+            }
+
+            if ( status > 0 )
+            {
+                mPendingSubmissions -= static_cast< unsigned >( status );
+            }
+        }
+
+        int dispatched = 0;
+
+        while ( true )
+        {
+            head = __atomic_load_n( mCompletionHead, __ATOMIC_RELAXED );
+
+            if ( head == __atomic_load_n( mCompletionTail, __ATOMIC_ACQUIRE ) )
+            {
+                break;
+            }
+
+            struct io_uring_cqe completion = mCompletionEntries[head & *mCompletionMask];
+
+            // Free the slot before dispatching, callbacks might submit more work
+            __atomic_store_n( mCompletionHead, head + 1, __ATOMIC_RELEASE );
+
+            dispatch( completion.user_data, completion.res, completion.flags );
+            dispatched++;
+        }
+
+        return dispatched;
+    }
+
+    /**
+     * Dispatch completions until stop() is called. A stop() that came before
+     * run() makes it return right away.
+     */
+    void run()
+    {
+        // The request is consumed, so the loop can be run again afterwards
+        while ( !mStopping.exchange( false ) )
+        {
+            if ( poll( -1 ) == -1 )
+            {
+                break;
+            }
+        }
+    }
+
+    /**
+     * Make run() return. It can be called from any thread.
+     */
+    void stop()
+    {
+        mStopping = true;
+
+        if ( mFallbackLoop )
+        {
+            mFallbackLoop->stop();
+        }
+        else if ( mWakeDescriptor != -1 )
+        {
+            eventfd_write( mWakeDescriptor, 1 );
+        }
+    }
+
+    private:
+
+    enum class OperationType
+    {
+        ACCEPT,
+        CONNECT,
+        SEND,
+        RECEIVE,
+        SEND_MESSAGE,
+        RECEIVE_MESSAGE
+    };
+
+    struct Operation
+    {
+        Operation( OperationType type, int socketDescriptor, const UringCallback& callback ) :
+            type( type ),
+            socketDescriptor( socketDescriptor ),
+            multishot( false ),
+            selectBuffer( false ),
+            buffer( nullptr ),
+            size( 0 ),
+            transferred( 0 ),
+            message( nullptr ),
+            flags( 0 ),
+            addressSize( 0 ),
+            callback( callback )
+        {
+            memset( &address, 0, sizeof( address ) );
+        }
+
+        OperationType type;
+        int socketDescriptor;
+        bool multishot;
+        bool selectBuffer;
+        char* buffer;
+        size_t size;
+        size_t transferred;
+        struct msghdr* message;
+        int flags;
+        struct sockaddr_storage address;
+        socklen_t addressSize;
+        UringCallback callback;
+    };
+
+    struct FallbackDescriptor
+    {
+        FallbackDescriptor() : watched( false )
+        {
+        }
+
+        std::deque< uint64_t > reads;
+        std::deque< uint64_t > writes;
+        bool watched;
+    };
+
+    struct FallbackCompletion
+    {
+        FallbackCompletion( uint64_t operationId, int result, unsigned flags = 0 ) :
+            operationId( operationId ),
+            result( result ),
+            flags( flags )
+        {
+        }
+
+        uint64_t operationId;
+        int result;
+        unsigned flags;
+    };
+
+    // Reserved user data of internal submissions
+    static const uint64_t CANCEL_ID = 1;
+    static const uint64_t WAKE_ID = 2;
+    static const uint64_t FIRST_OPERATION_ID = 16;
+
+    static const uint16_t BUFFER_GROUP = 0;
+
+    void setupRing( unsigned entries )
+    {
+        long descriptor = syscall( __NR_io_uring_setup, entries, &mParams );
+
+        if ( descriptor == -1 )
+        {
+            return;
+        }
+
+        mRingDescriptor = static_cast< int >( descriptor );
+
+        // Waiting with a timeout needs IORING_ENTER_EXT_ARG (Linux 5.11)
+        if ( ( mParams.features & IORING_FEAT_SINGLE_MMAP ) == 0 || ( mParams.features & IORING_FEAT_EXT_ARG ) == 0 )
+        {
+            ::close( mRingDescriptor );
+            mRingDescriptor = -1;
+            return;
+        }
+
+        size_t submissionSize = mParams.sq_off.array + mParams.sq_entries * sizeof( unsigned );
+        size_t completionSize = mParams.cq_off.cqes + mParams.cq_entries * sizeof( struct io_uring_cqe );
+
+        mRingMemorySize = std::max( submissionSize, completionSize );
+        mRingMemory = mmap( nullptr, mRingMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingDescriptor, IORING_OFF_SQ_RING );
+
+        mSubmissionEntriesSize = mParams.sq_entries * sizeof( struct io_uring_sqe );
+        mSubmissionEntries = mmap( nullptr, mSubmissionEntriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingDescriptor, IORING_OFF_SQES );
+
+        if ( mRingMemory == MAP_FAILED || mSubmissionEntries == MAP_FAILED )
+        {
+            SocketLog::report( "UringLoop", "mmap", errno );
+
+            if ( mRingMemory != MAP_FAILED )
+            {
+                munmap( mRingMemory, mRingMemorySize );
+            }
+
+            if ( mSubmissionEntries != MAP_FAILED )
+            {
+                munmap( mSubmissionEntries, mSubmissionEntriesSize );
+            }
+
+            mRingMemory = nullptr;
+            mSubmissionEntries = nullptr;
+            ::close( mRingDescriptor );
+            mRingDescriptor = -1;
+            return;
+        }
+
+        char* ring = reinterpret_cast< char* >( mRingMemory );
+
+        mSubmissionHead = reinterpret_cast< unsigned* >( ring + mParams.sq_off.head );
+        mSubmissionTail = reinterpret_cast< unsigned* >( ring + mParams.sq_off.tail );
+        mSubmissionMask = reinterpret_cast< unsigned* >( ring + mParams.sq_off.ring_mask );
+        mSubmissionArray = reinterpret_cast< unsigned* >( ring + mParams.sq_off.array );
+        mCompletionHead = reinterpret_cast< unsigned* >( ring + mParams.cq_off.head );
+        mCompletionTail = reinterpret_cast< unsigned* >( ring + mParams.cq_off.tail );
+        mCompletionMask = reinterpret_cast< unsigned* >( ring + mParams.cq_off.ring_mask );
+        mCompletionEntries = reinterpret_cast< struct io_uring_cqe* >( ring + mParams.cq_off.cqes );
+
+        // Used to wake up io_uring_enter() when stop() is called from another thread
+        mWakeDescriptor = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+        armWake();
+    }
+
+    void armWake()
+    {
+        struct io_uring_sqe* entry = getSubmissionEntry();
+
+        if ( entry == nullptr || mWakeDescriptor == -1 )
+        {
+            return;
+        }
+
+        entry->opcode = IORING_OP_POLL_ADD;
+        entry->fd = mWakeDescriptor;
+        entry->poll32_events = POLLIN;
+        entry->user_data = WAKE_ID;
+    }
+
+    /**
+     * Returns a zeroed submission entry, flushing the queue when it is full.
+     */
+    struct io_uring_sqe* getSubmissionEntry()
+    {
+        unsigned tail = *mSubmissionTail;
+
+        if ( tail - __atomic_load_n( mSubmissionHead, __ATOMIC_ACQUIRE ) >= mParams.sq_entries )
+        {
+            long status = syscall( __NR_io_uring_enter, mRingDescriptor, mPendingSubmissions, 0, 0, nullptr, 0 );
+
+            if ( status <= 0 )
+            {
+                SocketLog::report( "UringLoop", "submit", status == -1 ? errno : EBUSY );
+                return nullptr;
+            }
+
+            mPendingSubmissions -= static_cast< unsigned >( status );
+        }
+
+        unsigned index = tail & *mSubmissionMask;
+        struct io_uring_sqe* entry = reinterpret_cast< struct io_uring_sqe* >( mSubmissionEntries ) + index;
+
+        memset( entry, 0, sizeof( struct io_uring_sqe ) );
+        mSubmissionArray[index] = index;
+
+        // The kernel only sees the entry once the tail moves, and the entry
+        // is filled before the next io_uring_enter()
+        __atomic_store_n( mSubmissionTail, tail + 1, __ATOMIC_RELEASE );
+        mPendingSubmissions++;
+
+        return entry;
+    }
+
+    uint64_t submit( std::unique_ptr< Operation > operation )
+    {
+        if ( operation->socketDescriptor < 0 )
+        {
+            SocketLog::report( "UringLoop", "submit", EBADF );
+            return 0;
+        }
+
+        uint64_t operationId = mNextOperationId++;
+        Operation* pending = operation.get();
+
+        mOperations[operationId] = std::move( operation );
+
+        bool submitted = isUringEnabled() ? prepare( operationId, *pending ) : submitFallback( operationId, *pending );
+
+        if ( !submitted )
+        {
+            if ( pending->type == OperationType::CONNECT )
+            {
+                ::close( pending->socketDescriptor );
+            }
+
+            mOperations.erase( operationId );
+            return 0;
+        }
+
+        return operationId;
+    }
+
+    bool prepare( uint64_t operationId, Operation& operation )
+    {
+        struct io_uring_sqe* entry = getSubmissionEntry();
+
+        if ( entry == nullptr )
+        {
+            return false;
+        }
+
+        entry->fd = operation.socketDescriptor;
+        entry->user_data = operationId;
+
+        switch ( operation.type )
+        {
+            case OperationType::ACCEPT:
+                entry->opcode = IORING_OP_ACCEPT;
+                entry->accept_flags = SOCK_CLOEXEC;
+                entry->ioprio = operation.multishot ? IORING_ACCEPT_MULTISHOT : 0;
+                break;
+
+            case OperationType::CONNECT:
+                entry->opcode = IORING_OP_CONNECT;
+                entry->addr = reinterpret_cast< uint64_t >( &operation.address );
+                entry->off = operation.addressSize;
+                break;
+
+            case OperationType::SEND:
+                entry->opcode = IORING_OP_SEND;
+                entry->addr = reinterpret_cast< uint64_t >( operation.buffer + operation.transferred );
+                entry->len = static_cast< unsigned >( std::min< size_t >( operation.size - operation.transferred, INT_MAX ) );
+                break;
+
+            case OperationType::RECEIVE:
+                entry->opcode = IORING_OP_RECV;
+
+                if ( operation.selectBuffer )
+                {
+                    entry->flags = IOSQE_BUFFER_SELECT;
+                    entry->buf_group = BUFFER_GROUP;
+                    entry->ioprio = operation.multishot ? IORING_RECV_MULTISHOT : 0;
+                }
+                else
+                {
+                    entry->addr = reinterpret_cast< uint64_t >( operation.buffer );
+                    entry->len = static_cast< unsigned >( std::min< size_t >( operation.size, INT_MAX ) );
+                }
+                break;
+
+            case OperationType::SEND_MESSAGE:
+                entry->opcode = IORING_OP_SENDMSG;
+                entry->addr = reinterpret_cast< uint64_t >( operation.message );
+                entry->len = 1;
+                entry->msg_flags = operation.flags;
+                break;
+
+            case OperationType::RECEIVE_MESSAGE:
+                entry->opcode = IORING_OP_RECVMSG;
+                entry->addr = reinterpret_cast< uint64_t >( operation.message );
+                entry->len = 1;
+                entry->msg_flags = operation.flags;
+                break;
+        }
+
+        return true;
+    }
+
+    void dispatch( uint64_t operationId, int result, unsigned flags )
+    {
+        if ( operationId == WAKE_ID )
+        {
+            eventfd_t value;
+            eventfd_read( mWakeDescriptor, &value );
+            armWake();
+            return;
+        }
+
+        std::unordered_map< uint64_t, std::unique_ptr< Operation > >::iterator iterator = mOperations.find( operationId );
+
+        if ( iterator == mOperations.end() )
+        {
+            return;
+        }
+
+        Operation& operation = *iterator->second;
+
+        // Partial sends continue from where they stopped. The fallback
+        // path only completes a send once everything was sent.
+        if ( operation.type == OperationType::SEND && result > 0 && isUringEnabled() )
+        {
+            operation.transferred += static_cast< size_t >( result );
+
+            if ( operation.transferred < operation.size )
+            {
+                if ( prepare( operationId, operation ) )
+                {
+                    return;
+                }
+
+                result = -EAGAIN;
+            }
+            else
+            {
+                result = static_cast< int >( operation.transferred );
+            }
+        }
+
+        UringCompletion completion;
+        completion.result = result;
+        completion.more = ( flags & IORING_CQE_F_MORE ) != 0;
+
+        if ( flags & IORING_CQE_F_BUFFER )
+        {
+            completion.bufferId = static_cast< int >( flags >> IORING_CQE_BUFFER_SHIFT );
+            completion.buffer = getBuffer( completion.bufferId );
+        }
+
+        if ( result >= 0 && operation.type == OperationType::ACCEPT )
+        {
+            struct sockaddr_storage address;
+            socklen_t addressSize = sizeof( address );
+
+            memset( &address, 0, sizeof( address ) );
+            getpeername( result, reinterpret_cast< struct sockaddr* >( &address ), &addressSize );
+
+            completion.socket = Socket::create( result, address );
+            completion.result = 0;
+        }
+        else if ( operation.type == OperationType::CONNECT )
+        {
+            if ( result == 0 )
+            {
+                if ( !isUringEnabled() )
+                {
+                    Socket::setDescriptorNonBlocking( operation.socketDescriptor, false );
+                }
+
+                completion.socket = Socket::create( operation.socketDescriptor, operation.address );
+            }
+            else
+            {
+                ::close( operation.socketDescriptor );
+            }
+        }
+
+        if ( completion.more )
+        {
+            // Cancelling only takes effect on the final completion, so the
+            // operation outlives its callback
+            operation.callback( completion );
+            return;
+        }
+
+        // The last completion releases the operation before the callback,
+        // which might submit new operations
+        std::unique_ptr< Operation > finished = std::move( iterator->second );
+        mOperations.erase( iterator );
+
+        finished->callback( completion );
+    }
+
+    static bool isWrite( OperationType type )
+    {
+        return type == OperationType::CONNECT || type == OperationType::SEND || type == OperationType::SEND_MESSAGE;
+    }
+
+    bool submitFallback( uint64_t operationId, Operation& operation )
+    {
+        int socketDescriptor = operation.socketDescriptor;
+
+        if ( operation.type == OperationType::CONNECT && operation.transferred == 0 )
+        {
+            // transferred marks that the connection is in progress
+            operation.transferred = 1;
+
+            int status = ::connect( socketDescriptor, reinterpret_cast< struct sockaddr* >( &operation.address ), operation.addressSize );
+
+            if ( status == 0 || errno != EINPROGRESS )
+            {
+                mFallbackCompletions.push_back( FallbackCompletion( operationId, status == 0 ? 0 : -errno ) );
+                return true;
+            }
+        }
+
+        if ( static_cast< size_t >( socketDescriptor ) >= mFallbackDescriptors.size() )
+        {
+            mFallbackDescriptors.resize( socketDescriptor + 1 );
+        }
+
+        FallbackDescriptor& descriptor = mFallbackDescriptors[socketDescriptor];
+
+        ( isWrite( operation.type ) ? descriptor.writes : descriptor.reads ).push_back( operationId );
+
+        if ( !descriptor.watched )
+        {
+            descriptor.watched = true;
+
+            mFallbackLoop->add( socketDescriptor,
+                [this]( int fd ) { processFallback( fd, false ); },
+                [this]( int fd ) { processFallback( fd, true ); },
+                EventLoop::EventCallback(), EventTrigger::LEVEL );
+        }
+
+        updateFallbackInterest( socketDescriptor );
+
+        return true;
+    }
+
+    void updateFallbackInterest( int socketDescriptor )
+    {
+        FallbackDescriptor& descriptor = mFallbackDescriptors[socketDescriptor];
+
+        if ( descriptor.reads.empty() && descriptor.writes.empty() )
+        {
+            if ( descriptor.watched )
+            {
+                descriptor.watched = false;
+                mFallbackLoop->remove( socketDescriptor );
+            }
+
+            return;
+        }
+
+        if ( !descriptor.watched )
+        {
+            return;
+        }
+
+        mFallbackLoop->setReadable( socketDescriptor, !descriptor.reads.empty() );
+        mFallbackLoop->setWritable( socketDescriptor, !descriptor.writes.empty() );
+    }
+
+    /**
+     * Run the queued operations of a ready descriptor without blocking.
+     */
+    void processFallback( int socketDescriptor, bool writable )
+    {
+        while ( true )
+        {
+            FallbackDescriptor& descriptor = mFallbackDescriptors[socketDescriptor];
+            std::deque< uint64_t >& queue = writable ? descriptor.writes : descriptor.reads;
+
+            if ( queue.empty() )
+            {
+                break;
+            }
+
+            uint64_t operationId = queue.front();
+            Operation& operation = *mOperations[operationId];
+            unsigned flags = 0;
+            int result = execute( operation, flags );
+
+            if ( result == -EAGAIN || result == -EWOULDBLOCK )
+            {
+                break;
+            }
+
+            // Multishot operations stay queued until they fail or, for a
+            // receive, until the connection is closed
+            bool more = operation.multishot && ( result > 0 || ( result == 0 && operation.type == OperationType::ACCEPT ) );
+
+            if ( !more )
+            {
+                queue.pop_front();
+            }
+
+            dispatch( operationId, result, flags | ( more ? IORING_CQE_F_MORE : 0 ) );
+
+            // The listening descriptor might be blocking, so only one accept
+            // is done per readiness notification
+            if ( more && operation.type == OperationType::ACCEPT )
+            {
+                break;
+            }
+        }
+
+        updateFallbackInterest( socketDescriptor );
+    }
+
+    int execute( Operation& operation, unsigned& flags )
+    {
+        int socketDescriptor = operation.socketDescriptor;
+        ssize_t result = -1;
+
+        switch ( operation.type )
+        {
+            case OperationType::ACCEPT:
+                result = accept4( socketDescriptor, nullptr, nullptr, SOCK_CLOEXEC );
+                break;
+
+            case OperationType::CONNECT:
+            {
+                int error = 0;
+                socklen_t errorSize = sizeof( error );
+
+                getsockopt( socketDescriptor, SOL_SOCKET, SO_ERROR, &error, &errorSize );
+                return -error;
+            }
+
+            case OperationType::SEND:
+                while ( operation.transferred < operation.size )
+                {
+                    result = ::send( socketDescriptor, operation.buffer + operation.transferred, operation.size - operation.transferred, MSG_DONTWAIT );
+
+                    if ( result == -1 )
+                    {
+                        return -errno;
+                    }
+
+                    operation.transferred += static_cast< size_t >( result );
+                }
+
+                return static_cast< int >( operation.transferred );
+
+            case OperationType::RECEIVE:
+                if ( operation.selectBuffer )
+                {
+                    if ( mFreeBuffers.empty() )
+                    {
+                        return -ENOBUFS;
+                    }
+
+                    int bufferId = mFreeBuffers.front();
+                    result = ::recv( socketDescriptor, const_cast< char* >( getBuffer( bufferId ) ), mBufferSize, MSG_DONTWAIT );
+
+                    if ( result >= 0 )
+                    {
+                        mFreeBuffers.pop_front();
+                        flags = IORING_CQE_F_BUFFER | ( static_cast< unsigned >( bufferId ) << IORING_CQE_BUFFER_SHIFT );
+                    }
+                }
+                else
+                {
+                    result = ::recv( socketDescriptor, operation.buffer, operation.size, MSG_DONTWAIT );
+                }
+                break;
+
+            case OperationType::SEND_MESSAGE:
+                result = ::sendmsg( socketDescriptor, operation.message, operation.flags | MSG_DONTWAIT );
+                break;
+
+            case OperationType::RECEIVE_MESSAGE:
+                result = ::recvmsg( socketDescriptor, operation.message, operation.flags | MSG_DONTWAIT );
+                break;
+        }
+
+        return result == -1 ? -errno : static_cast< int >( result );
+    }
+
+    int pollFallback( int timeout )
+    {
+        int dispatched = 0;
+
+        // Completions that did not need to wait, like cancellations
+        while ( !mFallbackCompletions.empty() )
+        {
+            FallbackCompletion completion = mFallbackCompletions.front();
+            mFallbackCompletions.pop_front();
+
+            dispatch( completion.operationId, completion.result, completion.flags );
+            dispatched++;
+        }
+
+        int status = mFallbackLoop->poll( dispatched > 0 ? 0 : timeout );
+
+        return status == -1 ? -1 : dispatched + status;
+    }
+
+    int mRingDescriptor;
+    int mWakeDescriptor;
+    std::atomic< bool > mStopping;
+    uint64_t mNextOperationId;
+    unsigned mPendingSubmissions;
+
+    struct io_uring_params mParams;
+    void* mRingMemory;
+    size_t mRingMemorySize;
+    void* mSubmissionEntries;
+    size_t mSubmissionEntriesSize;
+    unsigned* mSubmissionHead;
+    unsigned* mSubmissionTail;
+    unsigned* mSubmissionMask;
+    unsigned* mSubmissionArray;
+    unsigned* mCompletionHead;
+    unsigned* mCompletionTail;
+    unsigned* mCompletionMask;
+    struct io_uring_cqe* mCompletionEntries;
+
+    void* mBufferRing;
+    size_t mBufferRingSize;
+    unsigned mBufferCount;
+    unsigned mBufferSize;
+    uint16_t mBufferTail;
+    std::vector< char > mBuffers;
+    std::deque< int > mFreeBuffers;
+
+    std::unordered_map< uint64_t, std::unique_ptr< Operation > > mOperations;
+
+    std::unique_ptr< EventLoop > mFallbackLoop;
+    std::vector< FallbackDescriptor > mFallbackDescriptors;
+    std::deque< FallbackCompletion > mFallbackCompletions;
+};
+
+
+
+#endif // URINGLOOP_H
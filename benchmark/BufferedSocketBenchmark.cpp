@@ -0,0 +1,244 @@
+/**
+ * Compares the delimiter search of BufferedSocket with a byte by byte scan,
+ * first in memory and then reading CRLF terminated lines from a loopback
+ * connection.
+ *
+ * BUILD AND RUN:
+ *
+ *    g++ -std=c++11 -O2 -I.. BufferedSocketBenchmark.cpp -o BufferedSocketBenchmark -pthread
+ *    ./BufferedSocketBenchmark [line length] [lines]
+ */
+
+
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include "../BufferedSocket.h"
+
+
+
+typedef const char* ( *FindByte )( const char* begin, const char* end, char value );
+
+static size_t naiveFind( const char* data, size_t size )
+{
+    for ( size_t i = 0; i + 1 < size; ++i )
+    {
+        if ( data[i] == '\r' && data[i + 1] == '\n' )
+        {
+            return i;
+        }
+    }
+
+    return size;
+}
+
+static size_t findWith( FindByte findByte, const char* data, size_t size )
+{
+    const char* end = data + size - 1;
+    const char* position = data;
+
+    while ( ( position = findByte( position, end, '\r' ) ) != end )
+    {
+        if ( position[1] == '\n' )
+        {
+            return position - data;
+        }
+
+        position++;
+    }
+
+    return size;
+}
+
+static std::string makeLines( size_t lineLength, size_t lines )
+{
+    std::string text;
+
+    for ( size_t i = 0; i < lines; ++i )
+    {
+        text.append( lineLength, static_cast< char >( 'a' + i % 26 ) );
+        text.append( "\r\n" );
+    }
+
+    return text;
+}
+
+/**
+ * Split text into lines with find and return the throughput in GB/s.
+ */
+template < class Find >
+static double scan( const std::string& text, Find find, size_t& lines )
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    size_t passes = 0;
+
+    lines = 0;
+
+    do
+    {
+        const char* data = text.data();
+        size_t size = text.size();
+
+        for ( size_t offset = 0; offset < size; )
+        {
+            size_t found = find( data + offset, size - offset );
+
+            if ( found == size - offset )
+            {
+                break;
+            }
+
+            offset += found + 2;
+            lines++;
+        }
+
+        passes++;
+    }
+    while ( std::chrono::steady_clock::now() - start < std::chrono::milliseconds( 500 ) );
+
+    double seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+
+    return static_cast< double >( text.size() ) * passes / seconds / 1e9;
+}
+
+// Lines found by all passes of scan()
+static void reportScan( const char* name, double throughput, size_t lines )
+{
+    printf( "%-24s %8.2f GB/s %12zu lines\n", name, throughput, lines );
+}
+
+static ServerSocket* startServer( const std::string& port )
+{
+    ServerSocket* server = new ServerSocket( 16 );
+
+    if ( server->setup( port ) )
+    {
+        for ( size_t i = 0; i < server->getSocketAddressCount(); ++i )
+        {
+            if ( server->getSocketAddress( i )->getFamily() == SocketFamily::IPV4 && server->start( i ) )
+            {
+                return server;
+            }
+        }
+    }
+
+    delete server;
+    return nullptr;
+}
+
+/**
+ * Send text over loopback and return the lines per second read by reader.
+ */
+template < class Reader >
+static double transfer( const std::string& port, const std::string& text, Reader reader, size_t& lines )
+{
+    ServerSocket* server = startServer( port );
+
+    if ( server == nullptr )
+    {
+        return 0;
+    }
+
+    std::thread sender( [&]()
+    {
+        Socket socket = server->accept();
+
+        socket.send( text.data(), text.size() );
+    } );
+
+    ClientSocket client;
+    client.setup( "127.0.0.1", port );
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    lines = reader( client.connect( 0 ) );
+
+    double seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+
+    sender.join();
+    delete server;
+
+    return lines / seconds;
+}
+
+// Receive into a buffer and build every line byte by byte
+static size_t readNaive( Socket socket )
+{
+    std::vector< char > buffer( 65536 );
+    std::string line;
+    size_t lines = 0;
+    ssize_t size;
+
+    while ( ( size = socket.receive( buffer.data(), buffer.size() ) ) > 0 )
+    {
+        for ( ssize_t i = 0; i < size; ++i )
+        {
+            line.push_back( buffer[i] );
+
+            if ( line.size() >= 2 && line[line.size() - 2] == '\r' && line[line.size() - 1] == '\n' )
+            {
+                lines++;
+                line.clear();
+            }
+        }
+    }
+
+    return lines;
+}
+
+static size_t readBuffered( Socket socket )
+{
+    BufferedSocket buffered( std::move( socket ) );
+    BufferView line;
+    size_t lines = 0;
+
+    while ( buffered.readUntil( "\r\n", 2, line ).status == SocketStatus::OK )
+    {
+        lines++;
+    }
+
+    return lines;
+}
+
+int main( int argc, char** argv )
+{
+    size_t lineLength = argc > 1 ? static_cast< size_t >( atol( argv[1] ) ) : 64;
+    size_t lineCount = argc > 2 ? static_cast< size_t >( atol( argv[2] ) ) : 1000000;
+    std::string text = makeLines( lineLength, lineCount );
+    size_t lines = 0;
+
+    printf( "%zu lines of %zu bytes\n\n", lineCount, lineLength );
+
+    double throughput = scan( text, naiveFind, lines );
+    reportScan( "naive", throughput, lines );
+
+    throughput = scan( text, []( const char* data, size_t size ) { return findWith( BufferedSocket::findByteScalar, data, size ); }, lines );
+    reportScan( "scalar", throughput, lines );
+
+#ifdef BUFFEREDSOCKET_X86
+    throughput = scan( text, []( const char* data, size_t size ) { return findWith( BufferedSocket::findByteSse2, data, size ); }, lines );
+    reportScan( "sse2", throughput, lines );
+
+    if ( __builtin_cpu_supports( "avx2" ) )
+    {
+        throughput = scan( text, []( const char* data, size_t size ) { return findWith( BufferedSocket::findByteAvx2, data, size ); }, lines );
+        reportScan( "avx2", throughput, lines );
+    }
+#endif
+
+    throughput = scan( text, []( const char* data, size_t size ) { return BufferedSocket::findDelimiter( data, size, "\r\n", 2 ); }, lines );
+    reportScan( "findDelimiter", throughput, lines );
+
+    printf( "\n" );
+
+    double rate = transfer( "39701", text, readNaive, lines );
+    printf( "%-24s %12.0f lines/s %12zu lines\n", "loopback naive", rate, lines );
+
+    rate = transfer( "39702", text, readBuffered, lines );
+    printf( "%-24s %12.0f lines/s %12zu lines\n", "loopback BufferedSocket", rate, lines );
+
+    return 0;
+}
@@ -0,0 +1,471 @@
+/**
+ * Loopback load generator built on ClientSocket and ServerSocket, to see
+ * the throughput and the latency tail a machine can sustain.
+ *
+ * request  Each connection sends messages to an echo server at a fixed rate
+ *          and the latency is the time until the echo is read back.
+ * stream   The server pushes messages to each connection at a fixed rate and
+ *          the latency is the time until the client has read them.
+ * accept   Fill the backlog with connections, then time accept() draining it.
+ * connect  Connect and disconnect as fast as possible from several threads
+ *          while the server accepts, and time each connect().
+ *
+ * The load is open-loop: message k of the run is due at start + k / rate,
+ * whether the previous ones were answered or not, and its latency counts
+ * from that time rather than from when it was actually sent. A stall then
+ * shows up in the latency of every message it delayed, instead of holding
+ * back the sender and hiding them (coordinated omission).
+ *
+ * Latencies are recorded in nanoseconds in a SocketHistogram, which keeps
+ * them within 12.5% from nanoseconds to hours. The percentiles printed are
+ * the upper limits of their buckets, so they can be up to 12.5% above the
+ * measured latencies; only max and mean are exact.
+ *
+ * BUILD AND RUN:
+ *
+ *    g++ -std=c++11 -O2 -I.. LoadGenerator.cpp -o LoadGenerator -pthread
+ *    ./LoadGenerator request|stream [connections] [messages per second] [seconds] [message size]
+ *    ./LoadGenerator accept|connect [connections]
+ */
+
+
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include "../Socket.h"
+
+
+
+typedef std::chrono::steady_clock Clock;
+
+static const char* const SERVER_PORT = "39521";
+
+static int64_t getTime()
+{
+    return std::chrono::duration_cast< std::chrono::nanoseconds >( Clock::now().time_since_epoch() ).count();
+}
+
+static ServerSocket* startServer( int backlog )
+{
+    ServerSocket* server = new ServerSocket( backlog );
+
+    if ( server->setup( SERVER_PORT ) )
+    {
+        for ( size_t i = 0; i < server->getSocketAddressCount(); ++i )
+        {
+            if ( server->getSocketAddress( i )->getFamily() == SocketFamily::IPV4 && server->start( i ) )
+            {
+                return server;
+            }
+        }
+    }
+
+    printf( "cannot listen on port %s\n", SERVER_PORT );
+    delete server;
+    return nullptr;
+}
+
+static bool setupClient( ClientSocket& client )
+{
+    if ( !client.setup( "127.0.0.1", SERVER_PORT ) )
+    {
+        printf( "cannot resolve 127.0.0.1\n" );
+        return false;
+    }
+
+    return true;
+}
+
+static bool sendAll( Socket& socket, const char* data, size_t size )
+{
+    return socket.send( data, size ) == static_cast< ssize_t >( size );
+}
+
+static void printLatency( const SocketHistogram& histogram )
+{
+    SocketHistogramSnapshot snapshot;
+    histogram.snapshot( snapshot );
+
+    printf( "latency (us): p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f  mean %.1f\n",
+            snapshot.getPercentile( 50 ) / 1000.0, snapshot.getPercentile( 99 ) / 1000.0,
+            snapshot.getPercentile( 99.9 ) / 1000.0, snapshot.max / 1000.0, snapshot.getMean() / 1000.0 );
+
+    // Percentiles are the upper limits of their buckets, max and mean are exact
+    printf( "percentiles are bucket limits, up to %.1f%% above the measured latency\n",
+            100.0 / SOCKET_HISTOGRAM_SUB_BUCKETS );
+}
+
+/**
+ * Send messages of size bytes round-robin over sockets, rate per second in
+ * total, from start until end. Each message starts with the time it was due.
+ * Returns the number of messages sent.
+ */
+static uint64_t pace( std::vector< Socket >& sockets, double rate, size_t size, int64_t start, int64_t end )
+{
+    std::vector< char > message( size, 'm' );
+    double interval = 1e9 / rate;
+    uint64_t sent = 0;
+
+    for ( ;; )
+    {
+        int64_t due = start + static_cast< int64_t >( sent * interval );
+
+        if ( due >= end )
+        {
+            break;
+        }
+
+        // Never wait for a late message, it is sent right away
+        std::this_thread::sleep_until( Clock::time_point( std::chrono::nanoseconds( due ) ) );
+
+        memcpy( message.data(), &due, sizeof( due ) );
+
+        if ( !sendAll( sockets[sent % sockets.size()], message.data(), size ) )
+        {
+            break;
+        }
+
+        sent++;
+    }
+
+    return sent;
+}
+
+/**
+ * Read the messages of pace() from all sockets and record how late they
+ * arrived, until expected messages were read or nothing came for a second
+ * after end. Returns the number of messages read.
+ */
+static uint64_t collect( std::vector< Socket >& sockets, const std::atomic< uint64_t >& expected, size_t size, int64_t end, SocketHistogram& latency )
+{
+    std::vector< struct pollfd > descriptors( sockets.size() );
+    std::vector< std::vector< char > > messages( sockets.size(), std::vector< char >( size ) );
+    std::vector< size_t > offsets( sockets.size(), 0 );
+    uint64_t received = 0;
+    int64_t lastReceive = end;
+
+    for ( size_t i = 0; i < sockets.size(); ++i )
+    {
+        descriptors[i].fd = sockets[i].getSocketDescriptor();
+        descriptors[i].events = POLLIN;
+    }
+
+    while ( received < expected.load() && getTime() - std::max( end, lastReceive ) < 1000000000 )
+    {
+        if ( ::poll( descriptors.data(), descriptors.size(), 100 ) <= 0 )
+        {
+            continue;
+        }
+
+        for ( size_t i = 0; i < sockets.size(); ++i )
+        {
+            if ( descriptors[i].revents == 0 )
+            {
+                continue;
+            }
+
+            ssize_t count = sockets[i].receive( messages[i].data() + offsets[i], size - offsets[i] );
+
+            if ( count <= 0 )
+            {
+                descriptors[i].fd = -1;
+                continue;
+            }
+
+            offsets[i] += count;
+
+            if ( offsets[i] == size )
+            {
+                int64_t due;
+                memcpy( &due, messages[i].data(), sizeof( due ) );
+
+                lastReceive = getTime();
+                latency.record( static_cast< uint64_t >( lastReceive - due ) );
+                offsets[i] = 0;
+                received++;
+            }
+        }
+    }
+
+    return received;
+}
+
+static void runTraffic( bool stream, int connections, double rate, int seconds, size_t size )
+{
+    ServerSocket* server = startServer( connections );
+
+    if ( server == nullptr )
+    {
+        return;
+    }
+
+    ClientSocket clientSocket;
+    std::vector< Socket > clients;
+    std::vector< Socket > peers;
+
+    if ( !setupClient( clientSocket ) )
+    {
+        delete server;
+        return;
+    }
+
+    for ( int i = 0; i < connections; ++i )
+    {
+        clients.push_back( clientSocket.connect( 0 ) );
+        peers.push_back( clients.back().isValid() ? server->accept() : Socket() );
+
+        if ( !clients.back().isValid() || !peers.back().isValid() )
+        {
+            printf( "connection %d failed\n", i );
+            delete server;
+            return;
+        }
+    }
+
+    printf( "%s: %d connections, %.0f messages/s of %zu bytes for %d s\n", stream ? "stream" : "request",
+            connections, rate, size, seconds );
+
+    // The echo threads return when their client shuts down
+    std::vector< std::thread > echoes;
+
+    if ( !stream )
+    {
+        for ( int i = 0; i < connections; ++i )
+        {
+            echoes.push_back( std::thread( [&peers, i]()
+            {
+                char buffer[65536];
+                ssize_t count;
+
+                while ( ( count = peers[i].receive( buffer, sizeof( buffer ) ) ) > 0 && sendAll( peers[i], buffer, count ) )
+                {
+                }
+            } ) );
+        }
+    }
+
+    SocketHistogram latency;
+    std::atomic< uint64_t > expected( UINT64_MAX );
+    int64_t start = getTime() + 10000000;
+    int64_t end = start + static_cast< int64_t >( seconds ) * 1000000000;
+    uint64_t received = 0;
+
+    std::thread collector( [&]()
+    {
+        received = collect( clients, expected, size, end, latency );
+    } );
+
+    expected.store( pace( stream ? peers : clients, rate, size, start, end ) );
+    collector.join();
+
+    double elapsed = ( getTime() - start ) / 1e9;
+
+    for ( int i = 0; i < connections; ++i )
+    {
+        ::shutdown( clients[i].getSocketDescriptor(), SHUT_RDWR );
+    }
+
+    for ( size_t i = 0; i < echoes.size(); ++i )
+    {
+        echoes[i].join();
+    }
+
+    printf( "sent %llu, received %llu in %.2f s: %.0f messages/s, %.1f MB/s\n", static_cast< unsigned long long >( expected.load() ),
+            static_cast< unsigned long long >( received ), elapsed, received / elapsed, received * size / elapsed / 1e6 );
+    printLatency( latency );
+
+    delete server;
+}
+
+static int getMaxBacklog()
+{
+    std::ifstream file( "/proc/sys/net/core/somaxconn" );
+    int backlog = 4096;
+
+    file >> backlog;
+
+    return backlog;
+}
+
+static void runAcceptStorm( int connections )
+{
+    // Connections beyond the backlog would wait in connect() for accept()
+    connections = std::min( connections, getMaxBacklog() );
+
+    ServerSocket* server = startServer( connections );
+
+    if ( server == nullptr )
+    {
+        return;
+    }
+
+    ClientSocket clientSocket;
+    std::vector< Socket > clients;
+
+    if ( !setupClient( clientSocket ) )
+    {
+        delete server;
+        return;
+    }
+
+    for ( int i = 0; i < connections; ++i )
+    {
+        clients.push_back( clientSocket.connect( 0 ) );
+
+        if ( !clients.back().isValid() )
+        {
+            clients.pop_back();
+            break;
+        }
+    }
+
+    printf( "accept: %zu connections in the backlog\n", clients.size() );
+
+    SocketHistogram latency;
+    std::vector< Socket > peers( clients.size() );
+    int64_t start = getTime();
+
+    for ( size_t i = 0; i < peers.size(); ++i )
+    {
+        int64_t acceptStart = getTime();
+
+        peers[i] = server->accept();
+        latency.record( static_cast< uint64_t >( getTime() - acceptStart ) );
+    }
+
+    double elapsed = ( getTime() - start ) / 1e9;
+
+    printf( "accepted %zu in %.3f s: %.0f accepts/s\n", peers.size(), elapsed, peers.size() / elapsed );
+    printLatency( latency );
+
+    delete server;
+}
+
+static void runConnectStorm( int connections )
+{
+    ServerSocket* server = startServer( getMaxBacklog() );
+
+    if ( server == nullptr )
+    {
+        return;
+    }
+
+    int threadCount = std::max( 1, std::min( connections, static_cast< int >( std::thread::hardware_concurrency() ) * 2 ) );
+    SocketHistogram latency;
+    std::atomic< int > connected( 0 );
+    int accepted = 0;
+
+    printf( "connect: %d connections from %d threads\n", connections, threadCount );
+
+    // The server closes first, so the TIME_WAIT sockets pile up on its
+    // side and the clients do not run out of ephemeral ports
+    std::thread acceptor( [&]()
+    {
+        for ( ;; )
+        {
+            Socket peer = server->accept();
+
+            if ( !peer.isValid() )
+            {
+                break;
+            }
+
+            accepted++;
+        }
+    } );
+
+    int64_t start = getTime();
+    std::vector< std::thread > threads;
+
+    for ( int t = 0; t < threadCount; ++t )
+    {
+        threads.push_back( std::thread( [&, t]()
+        {
+            ClientSocket clientSocket;
+            char byte;
+
+            if ( !setupClient( clientSocket ) )
+            {
+                return;
+            }
+
+            for ( int i = t; i < connections; i += threadCount )
+            {
+                int64_t connectStart = getTime();
+                Socket client = clientSocket.connect( 0 );
+
+                if ( !client.isValid() )
+                {
+                    break;
+                }
+
+                latency.record( static_cast< uint64_t >( getTime() - connectStart ) );
+                connected++;
+
+                // Wait for the server to close
+                client.receive( &byte, 1 );
+            }
+        } ) );
+    }
+
+    for ( size_t i = 0; i < threads.size(); ++i )
+    {
+        threads[i].join();
+    }
+
+    double elapsed = ( getTime() - start ) / 1e9;
+
+    // Every client saw its connection accepted, so accept() can fail now
+    ::shutdown( server->getSocketDescriptor(), SHUT_RDWR );
+    acceptor.join();
+
+    printf( "connected %d, accepted %d in %.3f s: %.0f connections/s\n", connected.load(), accepted, elapsed, connected.load() / elapsed );
+    printLatency( latency );
+
+    delete server;
+}
+
+int main( int argc, char** argv )
+{
+    std::string mode = argc > 1 ? argv[1] : "request";
+    int connections = argc > 2 ? atoi( argv[2] ) : 64;
+
+    // Two descriptors per connection, both ends are in this process
+    struct rlimit limit;
+
+    if ( getrlimit( RLIMIT_NOFILE, &limit ) == 0 )
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit( RLIMIT_NOFILE, &limit );
+    }
+
+    if ( mode == "request" || mode == "stream" )
+    {
+        double rate = argc > 3 ? atof( argv[3] ) : 10000;
+        int seconds = argc > 4 ? atoi( argv[4] ) : 5;
+        size_t size = argc > 5 ? static_cast< size_t >( atol( argv[5] ) ) : 64;
+
+        // The message starts with its due time
+        runTraffic( mode == "stream", std::max( 1, connections ), std::max( 1.0, rate ), std::max( 1, seconds ), std::max( size, sizeof( int64_t ) ) );
+    }
+    else if ( mode == "accept" )
+    {
+        runAcceptStorm( std::max( 1, connections ) );
+    }
+    else if ( mode == "connect" )
+    {
+        runConnectStorm( std::max( 1, connections ) );
+    }
+    else
+    {
+        printf( "usage: %s request|stream|accept|connect [connections] [messages per second] [seconds] [message size]\n", argv[0] );
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,424 @@
+/**
+ * Cost of the Socket.h wrappers on top of the system calls they make. Each
+ * case runs the library call and the plain C equivalent the same number of
+ * times and prints both, with the difference as the overhead per call.
+ *
+ * The conversions (parameter switches, sockaddr copies, the getaddrinfo
+ * list that setup() turns into SocketAddress objects, string addresses) run
+ * in memory. The I/O cases use loopback: a TCP send loop drained by another
+ * thread, a TCP ping-pong against an echo thread, and UDP datagrams sent and
+ * received by the same thread at several payload sizes.
+ *
+ * BUILD AND RUN:
+ *
+ *    g++ -std=c++11 -O2 -I.. SocketBenchmark.cpp -o SocketBenchmark -pthread
+ *    ./SocketBenchmark [iterations scale]
+ */
+
+
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include "../Socket.h"
+
+
+
+// Keep the compiler from removing a result nobody reads
+template< typename T >
+static void keep( const T& value )
+{
+    asm volatile( "" : : "g"( &value ) : "memory" );
+}
+
+/**
+ * Nanoseconds per call of function, the best of a few rounds so a context
+ * switch in one of them does not count.
+ */
+template< typename Function >
+static double measure( long iterations, Function function )
+{
+    double best = 0;
+
+    for ( int round = 0; round < 5; ++round )
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        for ( long i = 0; i < iterations; ++i )
+        {
+            function( i );
+        }
+
+        double time = std::chrono::duration< double, std::nano >( std::chrono::steady_clock::now() - start ).count() / iterations;
+
+        if ( round == 0 || time < best )
+        {
+            best = time;
+        }
+    }
+
+    return best;
+}
+
+static void report( const char* name, double library, double raw )
+{
+    printf( "%-32s %10.1f ns %10.1f ns %+10.1f ns\n", name, library, raw, library - raw );
+}
+
+static ServerSocket* startServer( const std::string& port, SocketType socketType )
+{
+    ServerSocket* server = new ServerSocket( 16 );
+
+    if ( server->setup( port, socketType ) )
+    {
+        for ( size_t i = 0; i < server->getSocketAddressCount(); ++i )
+        {
+            if ( server->getSocketAddress( i )->getFamily() == SocketFamily::IPV4 )
+            {
+                return server;
+            }
+        }
+    }
+
+    delete server;
+    return nullptr;
+}
+
+static size_t findIPv4( ServerSocket& server )
+{
+    for ( size_t i = 0; i < server.getSocketAddressCount(); ++i )
+    {
+        if ( server.getSocketAddress( i )->getFamily() == SocketFamily::IPV4 )
+        {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+static void benchmarkConversions( long iterations )
+{
+    static const int families[] = { AF_INET, AF_INET6, AF_UNSPEC, AF_INET };
+    static const SocketType types[] = { SocketType::STREAM, SocketType::DATAGRAM, SocketType::DATAGRAM, SocketType::STREAM };
+
+    report( "getParam( int, SocketFamily& )", measure( iterations, []( long i )
+    {
+        SocketFamily family;
+        SocketParameterConverter::getParam( families[i & 3], family );
+        keep( family );
+    } ), measure( iterations, []( long i )
+    {
+        int family = families[i & 3];
+        keep( family );
+    } ) );
+
+    report( "getParam( SocketType, int& )", measure( iterations, []( long i )
+    {
+        int type;
+        SocketParameterConverter::getParam( types[i & 3], type );
+        keep( type );
+    } ), measure( iterations, []( long i )
+    {
+        int type = static_cast< int >( types[i & 3] );
+        keep( type );
+    } ) );
+
+    struct sockaddr_in6 source;
+    memset( &source, 0, sizeof( source ) );
+    source.sin6_family = AF_INET6;
+    source.sin6_port = htons( 3490 );
+    inet_pton( AF_INET6, "2001:db8::1", &source.sin6_addr );
+
+    // What receiveFrom() does with the sender of every datagram
+    SocketAddress address;
+    struct sockaddr_storage storage;
+
+    report( "convertAddress (setSockaddr)", measure( iterations, [&]( long )
+    {
+        address.setSocketType( SocketType::DATAGRAM );
+        address.setSockaddr( reinterpret_cast< const struct sockaddr* >( &source ), sizeof( source ) );
+        keep( address );
+    } ), measure( iterations, [&]( long )
+    {
+        memcpy( &storage, &source, sizeof( source ) );
+        keep( storage );
+    } ) );
+
+    // What setup() does with the getaddrinfo() list, through fillSocketAddress()
+    struct addrinfo hints;
+    struct addrinfo* serverInfo = nullptr;
+
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_flags = AI_PASSIVE;
+
+    if ( getaddrinfo( nullptr, "3490", &hints, &serverInfo ) == 0 )
+    {
+        std::vector< SocketAddress > socketAddressList;
+        std::vector< struct sockaddr_storage > rawList;
+        long listIterations = iterations / 10;
+
+        report( "convertAddressInfo", measure( listIterations, [&]( long )
+        {
+            SocketHandler::convertAddressInfo( serverInfo, socketAddressList );
+            keep( socketAddressList );
+        } ), measure( listIterations, [&]( long )
+        {
+            rawList.clear();
+
+            for ( const struct addrinfo* p = serverInfo; p != nullptr; p = p->ai_next )
+            {
+                rawList.push_back( storage );
+                memcpy( &rawList.back(), p->ai_addr, p->ai_addrlen );
+            }
+
+            keep( rawList );
+        } ) );
+
+        freeaddrinfo( serverInfo );
+    }
+
+    const std::string ipv4 = "192.168.1.20";
+    struct in_addr rawIPv4;
+
+    report( "setIPv4Address( string )", measure( iterations, [&]( long )
+    {
+        address.setIPv4Address( ipv4 );
+        keep( address );
+    } ), measure( iterations, [&]( long )
+    {
+        inet_pton( AF_INET, ipv4.c_str(), &rawIPv4 );
+        keep( rawIPv4 );
+    } ) );
+
+    address.setSockaddr( reinterpret_cast< const struct sockaddr* >( &source ), sizeof( source ) );
+
+    std::string ipv6;
+    char rawIPv6[INET6_ADDRSTRLEN];
+
+    report( "getIPv6Address( string& )", measure( iterations, [&]( long )
+    {
+        address.getIPv6Address( ipv6 );
+        keep( ipv6 );
+    } ), measure( iterations, [&]( long )
+    {
+        inet_ntop( AF_INET6, &source.sin6_addr, rawIPv6, INET6_ADDRSTRLEN );
+        keep( rawIPv6 );
+    } ) );
+}
+
+/**
+ * A connected pair over loopback: client is the Socket to measure, peer is
+ * the accepted end. Returns false when the connection fails.
+ */
+static bool connectPair( const std::string& port, Socket& client, Socket& peer )
+{
+    ServerSocket* server = startServer( port, SocketType::STREAM );
+
+    if ( server == nullptr || !server->start( findIPv4( *server ) ) )
+    {
+        delete server;
+        return false;
+    }
+
+    ClientSocket clientSocket;
+
+    // The connection completes in the backlog, before accept()
+    if ( clientSocket.setup( "127.0.0.1", port ) )
+    {
+        client = clientSocket.connect( 0 );
+
+        if ( client.isValid() )
+        {
+            peer = server->accept();
+        }
+    }
+
+    delete server;
+
+    return client.isValid() && peer.isValid();
+}
+
+static void benchmarkSend( long iterations )
+{
+    Socket client;
+    Socket peer;
+
+    if ( !connectPair( "39511", client, peer ) )
+    {
+        printf( "send: cannot connect over loopback\n" );
+        return;
+    }
+
+    std::thread drain( [&]()
+    {
+        char buffer[65536];
+
+        while ( peer.receive( buffer, sizeof( buffer ) ) > 0 )
+        {
+        }
+    } );
+
+    char message[64] = { 0 };
+    int descriptor = client.getSocketDescriptor();
+
+    report( "send 64 bytes", measure( iterations, [&]( long )
+    {
+        client.send( message, sizeof( message ) );
+    } ), measure( iterations, [&]( long )
+    {
+        ::send( descriptor, message, sizeof( message ), 0 );
+    } ) );
+
+    ::shutdown( descriptor, SHUT_WR );
+    drain.join();
+}
+
+static void benchmarkPingPong( long iterations )
+{
+    Socket client;
+    Socket peer;
+
+    if ( !connectPair( "39512", client, peer ) )
+    {
+        printf( "ping-pong: cannot connect over loopback\n" );
+        return;
+    }
+
+    int on = 1;
+    setsockopt( client.getSocketDescriptor(), IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+    setsockopt( peer.getSocketDescriptor(), IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+
+    // The echo side is the same for both, only the client side changes
+    std::thread echo( [&]()
+    {
+        char buffer[65536];
+        ssize_t size;
+        int descriptor = peer.getSocketDescriptor();
+
+        while ( ( size = ::recv( descriptor, buffer, sizeof( buffer ), 0 ) ) > 0 )
+        {
+            ::send( descriptor, buffer, size, 0 );
+        }
+    } );
+
+    static const ssize_t sizes[] = { 16, 1024, 16384 };
+    std::vector< char > message( 16384, 'm' );
+    std::vector< char > reply( 16384 );
+    int descriptor = client.getSocketDescriptor();
+
+    for ( size_t i = 0; i < sizeof( sizes ) / sizeof( sizes[0] ); ++i )
+    {
+        ssize_t size = sizes[i];
+        char name[64];
+
+        snprintf( name, sizeof( name ), "TCP ping-pong %zd bytes", size );
+
+        report( name, measure( iterations / 10, [&]( long )
+        {
+            client.send( message.data(), size );
+
+            for ( ssize_t received = 0; received < size; )
+            {
+                ssize_t count = client.receive( reply.data() + received, size - received );
+
+                if ( count <= 0 )
+                {
+                    break;
+                }
+
+                received += count;
+            }
+        } ), measure( iterations / 10, [&]( long )
+        {
+            ::send( descriptor, message.data(), size, 0 );
+
+            for ( ssize_t received = 0; received < size; )
+            {
+                ssize_t count = ::recv( descriptor, reply.data() + received, size - received, 0 );
+
+                if ( count <= 0 )
+                {
+                    break;
+                }
+
+                received += count;
+            }
+        } ) );
+    }
+
+    ::shutdown( descriptor, SHUT_WR );
+    echo.join();
+}
+
+static void benchmarkDatagrams( long iterations )
+{
+    ServerSocket* server = startServer( "39513", SocketType::DATAGRAM );
+
+    if ( server == nullptr )
+    {
+        printf( "datagrams: cannot bind over loopback\n" );
+        return;
+    }
+
+    Socket receiver = server->startConnectionless( findIPv4( *server ) );
+    Socket sender( SocketFamily::IPV4 );
+    delete server;
+
+    if ( !receiver.isValid() || !sender.isValid() )
+    {
+        printf( "datagrams: cannot bind over loopback\n" );
+        return;
+    }
+
+    SocketAddress to;
+    to.setFamily( SocketFamily::IPV4 );
+    to.setIPv4Address( "127.0.0.1" );
+    to.setPort( 39513 );
+
+    static const ssize_t sizes[] = { 16, 512, 1400, 8192 };
+    std::vector< char > payload( 8192, 'd' );
+    std::vector< char > buffer( 65536 );
+    SocketAddress from;
+    struct sockaddr_storage rawFrom;
+    int senderDescriptor = sender.getSocketDescriptor();
+    int receiverDescriptor = receiver.getSocketDescriptor();
+
+    for ( size_t i = 0; i < sizeof( sizes ) / sizeof( sizes[0] ); ++i )
+    {
+        ssize_t size = sizes[i];
+        char name[64];
+
+        snprintf( name, sizeof( name ), "UDP sendTo/receiveFrom %zd bytes", size );
+
+        // One datagram in flight, so the receive buffer never drops any
+        report( name, measure( iterations / 10, [&]( long )
+        {
+            sender.sendTo( to, payload.data(), size );
+            receiver.receiveFrom( from, buffer.data(), buffer.size() );
+        } ), measure( iterations / 10, [&]( long )
+        {
+            ::sendto( senderDescriptor, payload.data(), size, 0, to.getSockaddr(), to.getSockaddrSize() );
+
+            socklen_t fromSize = sizeof( rawFrom );
+            ::recvfrom( receiverDescriptor, buffer.data(), buffer.size(), 0, reinterpret_cast< struct sockaddr* >( &rawFrom ), &fromSize );
+        } ) );
+    }
+}
+
+int main( int argc, char** argv )
+{
+    long scale = argc > 1 ? atol( argv[1] ) : 1;
+    long iterations = 1000000 * ( scale > 0 ? scale : 1 );
+
+    printf( "%-32s %13s %13s %13s\n", "", "Socket.h", "raw", "overhead" );
+
+    benchmarkConversions( iterations );
+    benchmarkSend( iterations / 10 );
+    benchmarkPingPong( iterations / 10 );
+    benchmarkDatagrams( iterations / 10 );
+
+    return 0;
+}
@@ -0,0 +1,248 @@
+/**
+ * Loopback echo benchmark comparing a blocking server (one thread per
+ * connection) with UringLoop, using io_uring and its EventLoop fallback.
+ *
+ * Each client connection sends a message, waits for the echo and repeats.
+ * The clients are the same blocking ClientSocket code for every server.
+ *
+ * BUILD AND RUN:
+ *
+ *    g++ -std=c++11 -O2 -I.. UringBenchmark.cpp -o UringBenchmark -pthread
+ *    ./UringBenchmark [connections] [messages per connection] [message size]
+ */
+
+
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "../UringLoop.h"
+
+
+
+static ServerSocket* startServer( const std::string& port )
+{
+    ServerSocket* server = new ServerSocket( 1024 );
+
+    if ( server->setup( port ) )
+    {
+        for ( size_t i = 0; i < server->getSocketAddressCount(); ++i )
+        {
+            if ( server->getSocketAddress( i )->getFamily() == SocketFamily::IPV4 && server->start( i ) )
+            {
+                return server;
+            }
+        }
+    }
+
+    delete server;
+    return nullptr;
+}
+
+/**
+ * Run the clients and return the elapsed time in seconds.
+ */
+static double runClients( const std::string& port, int connections, int messages, size_t messageSize )
+{
+    std::vector< std::thread > clients;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    for ( int i = 0; i < connections; ++i )
+    {
+        clients.push_back( std::thread( [&]()
+        {
+            ClientSocket client;
+
+            if ( !client.setup( "127.0.0.1", port ) )
+            {
+                return;
+            }
+
+            Socket socket = client.connect( 0 );
+
+            if ( !socket.isValid() )
+            {
+                return;
+            }
+
+            std::vector< char > message( messageSize, 'm' );
+            std::vector< char > echo( messageSize );
+
+            for ( int j = 0; j < messages; ++j )
+            {
+                socket.send( message.data(), messageSize );
+
+                size_t received = 0;
+
+                while ( received < messageSize )
+                {
+                    ssize_t size = socket.receive( echo.data() + received, messageSize - received );
+
+                    if ( size <= 0 )
+                    {
+                        return;
+                    }
+
+                    received += size;
+                }
+            }
+        } ) );
+    }
+
+    for ( size_t i = 0; i < clients.size(); ++i )
+    {
+        clients[i].join();
+    }
+
+    return std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+}
+
+static double runBlocking( const std::string& port, int connections, int messages, size_t messageSize )
+{
+    ServerSocket* server = startServer( port );
+
+    if ( server == nullptr )
+    {
+        return 0;
+    }
+
+    std::thread acceptor( [&]()
+    {
+        std::vector< std::thread > workers;
+
+        for ( int i = 0; i < connections; ++i )
+        {
+            Socket socket = server->accept();
+
+            if ( !socket.isValid() )
+            {
+                continue;
+            }
+
+            workers.push_back( std::thread( [messageSize]( Socket socket )
+            {
+                std::vector< char > buffer( messageSize );
+                ssize_t size;
+
+                while ( ( size = socket.receive( buffer.data(), messageSize ) ) > 0 )
+                {
+                    socket.send( buffer.data(), size );
+                }
+            }, std::move( socket ) ) );
+        }
+
+        for ( size_t i = 0; i < workers.size(); ++i )
+        {
+            workers[i].join();
+        }
+    } );
+
+    double seconds = runClients( port, connections, messages, messageSize );
+
+    acceptor.join();
+    delete server;
+
+    return seconds;
+}
+
+static double runUring( const std::string& port, int connections, int messages, size_t messageSize, bool fallback )
+{
+    ServerSocket* server = startServer( port );
+
+    if ( server == nullptr )
+    {
+        return 0;
+    }
+
+    UringLoop loop( 4096, fallback );
+    loop.setupBufferRing( 1024, 16384 );
+
+    // Accepted sockets by descriptor, references stay valid while they are open
+    std::unordered_map< int, Socket > sockets;
+    int closed = 0;
+    std::function< void( Socket& ) > receive;
+
+    receive = [&]( Socket& socket )
+    {
+        loop.receive( socket, [&]( const UringCompletion& received )
+        {
+            if ( received.result == -ENOBUFS )
+            {
+                receive( socket );
+                return;
+            }
+
+            if ( received.result <= 0 )
+            {
+                sockets.erase( socket.getSocketDescriptor() );
+
+                if ( ++closed == connections )
+                {
+                    loop.stop();
+                }
+
+                return;
+            }
+
+            // The buffer goes back to the ring once the echo was sent
+            int bufferId = received.bufferId;
+
+            loop.send( socket, received.buffer, received.result, [&loop, bufferId]( const UringCompletion& )
+            {
+                loop.releaseBuffer( bufferId );
+            } );
+
+            if ( !received.more )
+            {
+                receive( socket );
+            }
+        }, true );
+    };
+
+    loop.accept( *server, [&]( UringCompletion& accepted )
+    {
+        if ( accepted.socket.isValid() )
+        {
+            int socketDescriptor = accepted.socket.getSocketDescriptor();
+
+            receive( sockets[socketDescriptor] = std::move( accepted.socket ) );
+        }
+    }, true );
+
+    double seconds = 0;
+    std::thread clients( [&]()
+    {
+        seconds = runClients( port, connections, messages, messageSize );
+    } );
+
+    loop.run();
+    clients.join();
+    delete server;
+
+    return seconds;
+}
+
+static void report( const char* name, double seconds, int connections, int messages )
+{
+    double total = static_cast< double >( connections ) * messages;
+
+    printf( "%-20s %10.3f s %14.0f msg/s\n", name, seconds, seconds > 0 ? total / seconds : 0.0 );
+}
+
+int main( int argc, char** argv )
+{
+    int connections = argc > 1 ? atoi( argv[1] ) : 16;
+    int messages = argc > 2 ? atoi( argv[2] ) : 20000;
+    size_t messageSize = argc > 3 ? static_cast< size_t >( atol( argv[3] ) ) : 64;
+
+    printf( "%d connections, %d messages of %zu bytes each\n", connections, messages, messageSize );
+
+    report( "blocking", runBlocking( "39501", connections, messages, messageSize ), connections, messages );
+    report( "io_uring", runUring( "39502", connections, messages, messageSize, false ), connections, messages );
+    report( "epoll fallback", runUring( "39503", connections, messages, messageSize, true ), connections, messages );
+
+    return 0;
+}